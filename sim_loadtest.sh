@@ -0,0 +1,80 @@
+#!/usr/bin/env bash
+# Load test toupcamsrc against the simulated camera
+# Needs a plugin built with: ./configure --with-sdk=sim
+#
+# Runs a pipeline for DURATION seconds (default 10) and checks the last
+# stats message against the thresholds below, exits 1 if any is exceeded
+#
+# Ex:
+# SIMCAM=width=1920,height=1080,fps=60,jitter=2000 MIN_FPS=58 \
+#     ./sim_loadtest.sh 30
+#
+# Thresholds, unset => reported but not checked
+#   MIN_FPS         delivered frames per second
+#   MAX_LATENCY_US  p99 pull + p99 convert
+#   MAX_DROPPED     dropped-frames
+#   MAX_TIMEOUTS    timeouts
+#   MAX_RSS_KB      peak resident memory of the pipeline
+# Pipeline
+#   ELEMENT_ARGS    extra toupcamsrc properties, ex "stack-frames=4"
+#   SINK            default fakesink sync=false
+
+set -e
+
+DURATION=${1:-10}
+SINK=${SINK:-fakesink sync=false}
+GST_PLUGIN_PATH=${GST_PLUGIN_PATH:-$(dirname "$0")/src/.libs}
+export GST_PLUGIN_PATH
+
+log=$(mktemp)
+rss=$(mktemp)
+trap 'rm -f "$log" "$rss"' EXIT
+
+# -e: turn the SIGINT from timeout into EOS so the pipeline shuts down cleanly
+# shellcheck disable=SC2086
+/usr/bin/time -f %M -o "$rss" \
+    timeout -s INT "$DURATION" \
+    gst-launch-1.0 -e -m toupcamsrc post-stats=true $ELEMENT_ARGS ! $SINK \
+    > "$log" || true
+
+stats=$(grep "toupcamsrc-stats" "$log" | tail -n 1)
+if [ -z "$stats" ]; then
+    echo "FAIL: no stats messages, pipeline output:"
+    cat "$log"
+    exit 1
+fi
+
+# field NAME => value of NAME=(type)value in the last stats message
+field() {
+    echo "$stats" | sed -n "s/.*[ ,]$1=([a-z0-9]*)\([^,;]*\).*/\1/p"
+}
+
+fps=$(field fps)
+latency=$(( $(field pull-p99) + $(field convert-p99) ))
+dropped=$(field dropped-frames)
+timeouts=$(field timeouts)
+rss_kb=$(tail -n 1 "$rss")
+
+failed=0
+# check NAME VALUE LIMIT min|max
+check() {
+    local verdict=ok
+    if [ -n "$3" ]; then
+        if ! awk -v v="$2" -v l="$3" -v d="$4" \
+            'BEGIN { exit !(d == "min" ? v >= l : v <= l) }'; then
+            verdict=FAIL
+            failed=1
+        fi
+        echo "$1: $2 ($4 $3) $verdict"
+    else
+        echo "$1: $2"
+    fi
+}
+
+check fps "$fps" "$MIN_FPS" min
+check latency-us "$latency" "$MAX_LATENCY_US" max
+check dropped-frames "$dropped" "$MAX_DROPPED" max
+check timeouts "$timeouts" "$MAX_TIMEOUTS" max
+check rss-kb "$rss_kb" "$MAX_RSS_KB" max
+
+exit $failed
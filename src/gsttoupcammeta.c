@@ -0,0 +1,155 @@
+/* GStreamer ToupCam Plugin
+ * Copyright (C) 2022 Labsmore LLC
+ *
+ * Author John McMaster <johndmcmaster@gmail.com>
+ * Author Kishore Arepalli <kishore.arepalli@gmail.com>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "gsttoupcammeta.h"
+
+GType gst_toupcam_frame_meta_api_get_type(void)
+{
+    static gsize type = 0;
+    // Describes the capture, not the pixels: survives any transform
+    static const gchar *tags[] = { NULL };
+
+    if (g_once_init_enter(&type)) {
+        GType _type =
+            gst_meta_api_type_register("GstToupCamFrameMetaAPI", tags);
+        g_once_init_leave(&type, _type);
+    }
+    return type;
+}
+
+static gboolean gst_toupcam_frame_meta_init(GstMeta * meta, gpointer params,
+                                            GstBuffer * buffer)
+{
+    GstToupCamFrameMeta *fmeta = (GstToupCamFrameMeta *) meta;
+
+    memset((guint8 *) fmeta + sizeof(GstMeta), 0,
+           sizeof(*fmeta) - sizeof(GstMeta));
+    return TRUE;
+}
+
+static gboolean gst_toupcam_frame_meta_transform(GstBuffer * dest,
+                                                 GstMeta * meta,
+                                                 GstBuffer * buffer,
+                                                 GQuark type, gpointer data)
+{
+    GstToupCamFrameMeta *smeta = (GstToupCamFrameMeta *) meta;
+    GstToupCamFrameMeta *dmeta;
+
+    if (!GST_META_TRANSFORM_IS_COPY(type)) {
+        return FALSE;
+    }
+    dmeta = gst_buffer_add_toupcam_frame_meta(dest);
+    if (!dmeta) {
+        return FALSE;
+    }
+    memcpy((guint8 *) dmeta + sizeof(GstMeta),
+           (guint8 *) smeta + sizeof(GstMeta),
+           sizeof(*dmeta) - sizeof(GstMeta));
+    return TRUE;
+}
+
+const GstMetaInfo *gst_toupcam_frame_meta_get_info(void)
+{
+    static const GstMetaInfo *info = NULL;
+
+    if (g_once_init_enter((GstMetaInfo **) & info)) {
+        const GstMetaInfo *meta =
+            gst_meta_register(GST_TOUPCAM_FRAME_META_API_TYPE,
+                              "GstToupCamFrameMeta",
+                              sizeof(GstToupCamFrameMeta),
+                              gst_toupcam_frame_meta_init, NULL,
+                              gst_toupcam_frame_meta_transform);
+        g_once_init_leave((GstMetaInfo **) & info, (GstMetaInfo *) meta);
+    }
+    return info;
+}
+
+GstToupCamFrameMeta *gst_buffer_add_toupcam_frame_meta(GstBuffer * buffer)
+{
+    return (GstToupCamFrameMeta *) gst_buffer_add_meta(buffer,
+                                                       GST_TOUPCAM_FRAME_META_INFO,
+                                                       NULL);
+}
+
+GType gst_toupcam_pyramid_meta_api_get_type(void)
+{
+    static gsize type = 0;
+    // Offsets into the buffer's memory
+    static const gchar *tags[] = { GST_META_TAG_MEMORY_STR, NULL };
+
+    if (g_once_init_enter(&type)) {
+        GType _type =
+            gst_meta_api_type_register("GstToupCamPyramidMetaAPI", tags);
+        g_once_init_leave(&type, _type);
+    }
+    return type;
+}
+
+static gboolean gst_toupcam_pyramid_meta_init(GstMeta * meta,
+                                              gpointer params,
+                                              GstBuffer * buffer)
+{
+    GstToupCamPyramidMeta *pmeta = (GstToupCamPyramidMeta *) meta;
+
+    memset((guint8 *) pmeta + sizeof(GstMeta), 0,
+           sizeof(*pmeta) - sizeof(GstMeta));
+    return TRUE;
+}
+
+static gboolean gst_toupcam_pyramid_meta_transform(GstBuffer * dest,
+                                                   GstMeta * meta,
+                                                   GstBuffer * buffer,
+                                                   GQuark type,
+                                                   gpointer data)
+{
+    GstToupCamPyramidMeta *smeta = (GstToupCamPyramidMeta *) meta;
+    GstToupCamPyramidMeta *dmeta;
+    GstMetaTransformCopy *copy = data;
+
+    // Offsets only hold for a copy of the whole buffer
+    if (!GST_META_TRANSFORM_IS_COPY(type) || copy->region) {
+        return FALSE;
+    }
+    dmeta = gst_buffer_add_toupcam_pyramid_meta(dest);
+    if (!dmeta) {
+        return FALSE;
+    }
+    memcpy((guint8 *) dmeta + sizeof(GstMeta),
+           (guint8 *) smeta + sizeof(GstMeta),
+           sizeof(*dmeta) - sizeof(GstMeta));
+    return TRUE;
+}
+
+const GstMetaInfo *gst_toupcam_pyramid_meta_get_info(void)
+{
+    static const GstMetaInfo *info = NULL;
+
+    if (g_once_init_enter((GstMetaInfo **) & info)) {
+        const GstMetaInfo *meta =
+            gst_meta_register(GST_TOUPCAM_PYRAMID_META_API_TYPE,
+                              "GstToupCamPyramidMeta",
+                              sizeof(GstToupCamPyramidMeta),
+                              gst_toupcam_pyramid_meta_init, NULL,
+                              gst_toupcam_pyramid_meta_transform);
+        g_once_init_leave((GstMetaInfo **) & info, (GstMetaInfo *) meta);
+    }
+    return info;
+}
+
+GstToupCamPyramidMeta *gst_buffer_add_toupcam_pyramid_meta(GstBuffer *
+                                                           buffer)
+{
+    return (GstToupCamPyramidMeta *) gst_buffer_add_meta(buffer,
+                                                         GST_TOUPCAM_PYRAMID_META_INFO,
+                                                         NULL);
+}
@@ -0,0 +1,96 @@
+/* GStreamer ToupCam Plugin
+ * Copyright (C) 2022 Labsmore LLC
+ *
+ * Author John McMaster <johndmcmaster@gmail.com>
+ * Author Kishore Arepalli <kishore.arepalli@gmail.com>
+ */
+
+/*
+Per frame capture metadata attached to every toupcamsrc output buffer
+and the layout of the optional image pyramid
+*/
+
+#ifndef _GST_TOUPCAM_META_H_
+#define _GST_TOUPCAM_META_H_
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+#define GST_TOUPCAM_FRAME_META_API_TYPE (gst_toupcam_frame_meta_api_get_type())
+#define GST_TOUPCAM_FRAME_META_INFO (gst_toupcam_frame_meta_get_info())
+typedef struct _GstToupCamFrameMeta GstToupCamFrameMeta;
+
+struct _GstToupCamFrameMeta {
+    GstMeta meta;
+
+    // SDK frame sequence number, valid if flags has FRAMEINFO_FLAG_SEQ
+    guint seq;
+    // Device timestamp in us, valid if flags has FRAMEINFO_FLAG_TIMESTAMP
+    guint64 timestamp;
+    // SDK FRAMEINFO_FLAG_* bits
+    guint flags;
+    // Settings in effect when the frame was delivered
+    // Exposure time in us
+    guint expotime;
+    // Analog gain in percent, ex: 100 => 1.0x
+    guint expoagain;
+    gint esize;
+    // Region of interest in sensor pixels
+    guint roi_x;
+    guint roi_y;
+    guint roi_width;
+    guint roi_height;
+    // Camera frames missing from the sequence just before this one
+    guint dropped;
+    // Settings generation the frame was exposed under, bumped by every
+    // camera control write since start (0 => the settings at start)
+    guint generation;
+    // generation is older than the latest control write
+    gboolean stale;
+};
+
+GType gst_toupcam_frame_meta_api_get_type(void);
+const GstMetaInfo *gst_toupcam_frame_meta_get_info(void);
+
+GstToupCamFrameMeta *gst_buffer_add_toupcam_frame_meta(GstBuffer * buffer);
+#define gst_buffer_get_toupcam_frame_meta(b) \
+  ((GstToupCamFrameMeta *) gst_buffer_get_meta((b), \
+                                               GST_TOUPCAM_FRAME_META_API_TYPE))
+
+#define GST_TOUPCAM_PYRAMID_META_API_TYPE (gst_toupcam_pyramid_meta_api_get_type())
+#define GST_TOUPCAM_PYRAMID_META_INFO (gst_toupcam_pyramid_meta_get_info())
+typedef struct _GstToupCamPyramidMeta GstToupCamPyramidMeta;
+
+// Full resolution plus up to 8 halvings
+#define GST_TOUPCAM_PYRAMID_MAX_LEVELS 9
+
+/*
+Where each level of the pyramid-levels mipmap is in the buffer
+Level 0 is the frame described by the caps, level N is box filtered to
+width / 2^N x height / 2^N in the same pixel format
+All levels are in the buffer's single GstMemory, later levels following
+level 0, so one gst_buffer_map() covers the whole pyramid
+*/
+struct _GstToupCamPyramidMeta {
+    GstMeta meta;
+
+    guint n_levels;
+    guint width[GST_TOUPCAM_PYRAMID_MAX_LEVELS];
+    guint height[GST_TOUPCAM_PYRAMID_MAX_LEVELS];
+    // Bytes from the start of the mapped memory
+    gsize offset[GST_TOUPCAM_PYRAMID_MAX_LEVELS];
+    // Bytes per row
+    gint stride[GST_TOUPCAM_PYRAMID_MAX_LEVELS];
+};
+
+GType gst_toupcam_pyramid_meta_api_get_type(void);
+const GstMetaInfo *gst_toupcam_pyramid_meta_get_info(void);
+
+GstToupCamPyramidMeta *gst_buffer_add_toupcam_pyramid_meta(GstBuffer *
+                                                           buffer);
+#define gst_buffer_get_toupcam_pyramid_meta(b) \
+  ((GstToupCamPyramidMeta *) gst_buffer_get_meta((b), \
+                                                 GST_TOUPCAM_PYRAMID_META_API_TYPE))
+
+G_END_DECLS
+#endif
@@ -0,0 +1,167 @@
+/* GStreamer ToupCam Plugin
+ * Copyright (C) 2022 Labsmore LLC
+ *
+ * Author John McMaster <johndmcmaster@gmail.com>
+ * Author Kishore Arepalli <kishore.arepalli@gmail.com>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+
+#include <gst/allocators/allocators.h>
+
+#include "gsttoupcampool.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_toupcam_pool_debug);
+#define GST_CAT_DEFAULT gst_toupcam_pool_debug
+
+// Size of a huge page, MFD_HUGETLB files must be a multiple of this
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+G_DEFINE_TYPE(GstToupCamPool, gst_toupcam_pool, GST_TYPE_BUFFER_POOL);
+
+static gboolean gst_toupcam_pool_set_config(GstBufferPool * bpool,
+                                            GstStructure * config)
+{
+    GstToupCamPool *pool = GST_TOUPCAM_POOL(bpool);
+    GstCaps *caps;
+    guint size, min, max;
+
+    if (!gst_buffer_pool_config_get_params(config, &caps, &size, &min, &max)
+        || !size) {
+        GST_ERROR_OBJECT(pool, "invalid config");
+        return FALSE;
+    }
+    pool->size = size;
+
+    return GST_BUFFER_POOL_CLASS(gst_toupcam_pool_parent_class)->set_config
+        (bpool, config);
+}
+
+#ifdef HAVE_MEMFD_CREATE
+static int memfd_open(GstToupCamPool * pool, gsize * alloc_size)
+{
+    int fd = -1;
+
+    if (pool->hugepages) {
+        *alloc_size = (pool->size + HUGEPAGE_SIZE - 1) & ~(gsize)
+            (HUGEPAGE_SIZE - 1);
+        fd = memfd_create("toupcamsrc",
+                          MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_HUGETLB);
+        if (fd >= 0 && ftruncate(fd, *alloc_size) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd < 0 && !pool->hugepages_warned) {
+            GST_WARNING_OBJECT(pool,
+                               "hugepage memfd failed (%s), using regular pages",
+                               g_strerror(errno));
+            pool->hugepages_warned = TRUE;
+        }
+    }
+    if (fd < 0) {
+        *alloc_size = pool->size;
+        fd = memfd_create("toupcamsrc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0) {
+            return -1;
+        }
+        if (ftruncate(fd, *alloc_size) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    /*
+       Size is fixed so consumers can map it without worrying about SIGBUS
+       Contents can't be write sealed since pooled buffers get reused
+     */
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+        < 0) {
+        GST_WARNING_OBJECT(pool, "failed to seal memfd: %s",
+                           g_strerror(errno));
+    }
+    return fd;
+}
+#endif
+
+static GstFlowReturn gst_toupcam_pool_alloc_buffer(GstBufferPool * bpool,
+                                                   GstBuffer ** buffer,
+                                                   GstBufferPoolAcquireParams
+                                                   * params)
+{
+#ifdef HAVE_MEMFD_CREATE
+    GstToupCamPool *pool = GST_TOUPCAM_POOL(bpool);
+    GstMemory *mem;
+    gsize alloc_size;
+    int fd;
+
+    fd = memfd_open(pool, &alloc_size);
+    if (fd < 0) {
+        GST_ERROR_OBJECT(pool, "memfd_create failed: %s", g_strerror(errno));
+        return GST_FLOW_ERROR;
+    }
+    // Mapped once and kept mapped while the buffer cycles through the pool
+    mem = gst_fd_allocator_alloc(pool->allocator, fd, alloc_size,
+                                 GST_FD_MEMORY_FLAG_KEEP_MAPPED);
+    if (!mem) {
+        close(fd);
+        return GST_FLOW_ERROR;
+    }
+    gst_memory_resize(mem, 0, pool->size);
+
+    *buffer = gst_buffer_new();
+    gst_buffer_append_memory(*buffer, mem);
+    return GST_FLOW_OK;
+#else
+    return GST_FLOW_ERROR;
+#endif
+}
+
+static void gst_toupcam_pool_finalize(GObject * object)
+{
+    GstToupCamPool *pool = GST_TOUPCAM_POOL(object);
+
+    if (pool->allocator) {
+        gst_object_unref(pool->allocator);
+    }
+    G_OBJECT_CLASS(gst_toupcam_pool_parent_class)->finalize(object);
+}
+
+static void gst_toupcam_pool_class_init(GstToupCamPoolClass * klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+    GstBufferPoolClass *pool_class = GST_BUFFER_POOL_CLASS(klass);
+
+    GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "toupcampool", 0,
+                            "ToupCam memfd buffer pool");
+
+    gobject_class->finalize = gst_toupcam_pool_finalize;
+    pool_class->set_config = gst_toupcam_pool_set_config;
+    pool_class->alloc_buffer = gst_toupcam_pool_alloc_buffer;
+}
+
+static void gst_toupcam_pool_init(GstToupCamPool * pool)
+{
+    pool->allocator = gst_fd_allocator_new();
+}
+
+GstBufferPool *gst_toupcam_pool_new(gboolean hugepages)
+{
+#ifdef HAVE_MEMFD_CREATE
+    GstToupCamPool *pool = g_object_new(GST_TYPE_TOUPCAM_POOL, NULL);
+
+    pool->hugepages = hugepages;
+    return GST_BUFFER_POOL(pool);
+#else
+    return NULL;
+#endif
+}
@@ -0,0 +1,50 @@
+/* GStreamer ToupCam Plugin
+ * Copyright (C) 2022 Labsmore LLC
+ *
+ * Author John McMaster <johndmcmaster@gmail.com>
+ * Author Kishore Arepalli <kishore.arepalli@gmail.com>
+ */
+
+/*
+Buffer pool backed by memfd GstFdMemory
+
+Each buffer is a single sealed (can't grow or shrink) memfd mapping so that
+consumers in other processes (unixfdsink, a custom consumer...) can be
+handed the fd rather than a copy of the frame
+*/
+
+#ifndef _GST_TOUPCAM_POOL_H_
+#define _GST_TOUPCAM_POOL_H_
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+#define GST_TYPE_TOUPCAM_POOL (gst_toupcam_pool_get_type())
+#define GST_TOUPCAM_POOL(obj)                                                  \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_TOUPCAM_POOL, GstToupCamPool))
+#define GST_IS_TOUPCAM_POOL(obj)                                               \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj), GST_TYPE_TOUPCAM_POOL))
+typedef struct _GstToupCamPool GstToupCamPool;
+typedef struct _GstToupCamPoolClass GstToupCamPoolClass;
+
+struct _GstToupCamPool {
+    GstBufferPool parent;
+
+    GstAllocator *allocator;
+    gsize size;
+    // Try MFD_HUGETLB first, falling back to regular pages
+    gboolean hugepages;
+    gboolean hugepages_warned;
+};
+
+struct _GstToupCamPoolClass {
+    GstBufferPoolClass parent_class;
+};
+
+GType gst_toupcam_pool_get_type(void);
+
+// Returns NULL if memfd isn't supported on this system
+GstBufferPool *gst_toupcam_pool_new(gboolean hugepages);
+
+G_END_DECLS
+#endif
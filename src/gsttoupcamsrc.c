@@ -33,7 +33,12 @@
 #include <stdlib.h>
 
 #include "gsttoupcamsrc.h"
+#include "gsttoupcampool.h"
+#include "gsttoupcammeta.h"
+#include "toupcamproc.h"
 
+#include <errno.h>
+#include <math.h>
 #include <stdio.h>
 
 GST_DEBUG_CATEGORY_STATIC(gst_toupcam_src_debug);
@@ -55,15 +60,47 @@ static gboolean gst_toupcam_src_stop(GstBaseSrc * src);
 static GstCaps *gst_toupcam_src_get_caps(GstBaseSrc * src,
                                          GstCaps * filter);
 static gboolean gst_toupcam_src_set_caps(GstBaseSrc * src, GstCaps * caps);
+static gboolean gst_toupcam_src_event(GstBaseSrc * src, GstEvent * event);
+static gboolean gst_toupcam_src_decide_allocation(GstBaseSrc * src,
+                                                  GstQuery * query);
 
 static GstFlowReturn gst_toupcam_src_fill(GstPushSrc * src,
                                           GstBuffer * buf);
-static GstFlowReturn gst_toupcam_src_alloc(GstPushSrc * psrc,
-                                           GstBuffer ** buf);
 void gst_toupcam_pdebug(GstToupCamSrc * src);
 
 // static GstCaps *gst_toupcam_src_create_caps (GstToupCamSrc * src);
 static void gst_toupcam_src_reset(GstToupCamSrc * src);
+static void gst_toupcam_src_capture_dark(GstToupCamSrc * src, gint frames);
+static void gst_toupcam_src_capture_flat(GstToupCamSrc * src, gint frames);
+static void gst_toupcam_src_build_defect_map(GstToupCamSrc * src);
+static GstSample *gst_toupcam_src_grab(GstToupCamSrc * src,
+                                       guint64 timeout);
+static void gst_toupcam_src_rearm_motion(GstToupCamSrc * src);
+static void rearm_exposure_settle(GstToupCamSrc * src);
+static void crop_window(GstToupCamSrc * src);
+static void output_layout(GstToupCamSrc * src);
+static GstPad *gst_toupcam_src_request_new_pad(GstElement * element,
+                                               GstPadTemplate * templ,
+                                               const gchar * name,
+                                               const GstCaps * caps);
+static void gst_toupcam_src_release_pad(GstElement * element, GstPad * pad);
+static gboolean gst_toupcam_src_send_event(GstElement * element,
+                                           GstEvent * event);
+
+enum {
+    SIGNAL_CAPTURE_DARK,
+    SIGNAL_CAPTURE_FLAT,
+    SIGNAL_BUILD_DEFECT_MAP,
+    SIGNAL_GRAB,
+    SIGNAL_REARM_MOTION,
+    LAST_SIGNAL
+};
+
+static guint gst_toupcam_src_signals[LAST_SIGNAL] = { 0 };
+
+// Per frame timing spans, see log_span()
+static GstTracerRecord *span_record;
+
 enum {
     PROP_0,
 
@@ -126,6 +163,54 @@ enum {
     PROP_AWB_RGB,
     PROP_AWB_TT,
 
+    PROP_STACK_FRAMES,
+    PROP_BEST_OF,
+    PROP_DARK_FILE,
+    PROP_FLAT_FILE,
+    PROP_DEFECT_DIR,
+    PROP_DEFECT_SIGMA,
+    PROP_DEFECT_COUNT,
+    PROP_HOST_CCM,
+    PROP_HOST_WB_R,
+    PROP_HOST_WB_G,
+    PROP_HOST_WB_B,
+    PROP_HOST_GAMMA,
+    PROP_CONVERT_THREADS,
+    PROP_TONEMAP_INTERVAL,
+    PROP_TONEMAP_LOW,
+    PROP_TONEMAP_HIGH,
+    PROP_PREVIEW_FACTOR,
+    PROP_PREVIEW_WIDTH,
+    PROP_PREVIEW_MAX_FPS,
+    PROP_MEMFD,
+    PROP_MEMFD_HUGEPAGES,
+    PROP_DROPPED_FRAMES,
+    PROP_STATS,
+    PROP_STATS_INTERVAL,
+    PROP_POST_STATS,
+    PROP_MAX_FRAMERATE,
+    PROP_EXPOSURE_SETTLED,
+    PROP_EXPOSURE_SETTLE_TOLERANCE,
+    PROP_EXPOSURE_SETTLE_FRAMES,
+    PROP_SETTINGS_GENERATION,
+    PROP_SETTINGS_LATENCY,
+    PROP_DROP_STALE,
+    PROP_STALE_FRAMES,
+    PROP_HDR_EXPOSURES,
+    PROP_ENABLE_LAST_SAMPLE,
+    PROP_LAST_SAMPLE,
+    PROP_QOS,
+    PROP_MOTION_DETECT,
+    PROP_MOTION_TOLERANCE,
+    PROP_MOTION_DIFFERENCE,
+    PROP_MOTION_SETTLE_FRAMES,
+    PROP_MOTION_SETTLED,
+    PROP_PYRAMID_LEVELS,
+    PROP_CROP_X,
+    PROP_CROP_Y,
+    PROP_CROP_WIDTH,
+    PROP_CROP_HEIGHT,
+    PROP_ROW_ALIGN,
 
 };
 
@@ -148,6 +233,57 @@ Not sure where the limit comes from
 #define DEFAULT_PROP_BRIGHTNESS CAMSDK_(BRIGHTNESS_DEF)
 #define DEFAULT_PROP_CONTRAST CAMSDK_(CONTRAST_DEF)
 #define DEFAULT_PROP_GAMMA CAMSDK_(GAMMA_DEF)
+#define DEFAULT_PROP_STACK_FRAMES 1
+// Keeps the 32 bit accumulator exact for 16 bit samples
+#define MAX_PROP_STACK_FRAMES 256
+#define DEFAULT_PROP_BEST_OF 1
+#define MAX_PROP_BEST_OF 64
+// Sharpness is scored on every Nth row
+#define SHARPNESS_ROW_STEP 8
+#define MAX_CAPTURE_FRAMES MAX_PROP_STACK_FRAMES
+#define DEFAULT_PROP_DEFECT_SIGMA 6.0
+#define DEFAULT_PROP_HOST_WB 1.0
+#define DEFAULT_PROP_HOST_GAMMA 1.0
+// 0 => one per CPU
+#define DEFAULT_PROP_CONVERT_THREADS 0
+#define DEFAULT_PROP_TONEMAP_INTERVAL 8
+#define DEFAULT_PROP_TONEMAP_LOW 0.1
+#define DEFAULT_PROP_TONEMAP_HIGH 99.9
+// Tone map histogram uses every Nth pixel of every Nth row
+#define TONEMAP_HIST_STEP 8
+// Frames an HDR bracket waits for an exposure change to take effect
+#define HDR_MAX_STALE 8
+#define DEFAULT_PROP_PREVIEW_FACTOR 4
+#define MAX_PROP_PREVIEW_FACTOR 64
+#define DEFAULT_PROP_QOS TRUE
+#define DEFAULT_PROP_MOTION_TOLERANCE 0.5
+#define DEFAULT_PROP_MOTION_DIFFERENCE 0.02
+// Motion projections use every Nth row / column
+#define MOTION_SKIP 8
+// Largest frame to frame shift measured, pixels
+#define MOTION_MAX_SHIFT 32
+#define MAX_PROP_ROW_ALIGN 4096
+// PullImageWithRowPitchV2() rowPitch for rows without padding
+#define ROW_PITCH_PACKED (-1)
+// pull_decode_frame() pulled a frame that isn't to be output, fill pulls
+// another. Never returned to basesrc
+#define FLOW_FRAME_DROPPED GST_FLOW_CUSTOM_SUCCESS
+// QoS steps at most one level per QOS_STEP_US while downstream is late and
+// back one per QOS_RECOVER_US once it keeps up with room to spare
+#define QOS_STEP_US (250 * 1000)
+#define QOS_RECOVER_US (2 * G_USEC_PER_SEC)
+#define QOS_RECOVER_PROPORTION 0.9
+
+// QoS degradation levels, each includes the ones before it
+enum {
+    QOS_FULL,
+    // Skip defect / dark / flat correction and tone map histograms
+    QOS_SKIP_OPTIONAL,
+    // Single exposure instead of stack-frames / best-of, no preview
+    QOS_SINGLE_FRAME,
+    // Drop frames that would be late before converting them
+    QOS_DROP,
+};
 
 // These don't have defined enums for some reason
 #define GST_TOUPCAM_OPTION_BYTEORDER_RGB 0
@@ -155,6 +291,8 @@ Not sure where the limit comes from
 
 int raw = 0;
 int x16 = 0;
+// Pull x16 but output RGB tone mapped to 8 bits, ie for live view
+int x16to8 = 0;
 
 // pad template
 static GstStaticPadTemplate gst_toupcam_src_template_x8 =
@@ -166,6 +304,16 @@ GST_STATIC_PAD_TEMPLATE("src", GST_PAD_SRC, GST_PAD_ALWAYS,
                         GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE
                                         ("{ ARGB64 }")));
 
+// Decimated copy of the main output, same format
+static GstStaticPadTemplate gst_toupcam_src_preview_template_x8 =
+GST_STATIC_PAD_TEMPLATE("preview", GST_PAD_SRC, GST_PAD_REQUEST,
+                        GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE("{ RGB }")));
+
+static GstStaticPadTemplate gst_toupcam_src_preview_template_x16 =
+GST_STATIC_PAD_TEMPLATE("preview", GST_PAD_SRC, GST_PAD_REQUEST,
+                        GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE
+                                        ("{ ARGB64 }")));
+
 /* class initialisation */
 
 G_DEFINE_TYPE(GstToupCamSrc, gst_toupcam_src, GST_TYPE_PUSH_SRC);
@@ -330,7 +478,8 @@ static void install_properties(GObjectClass *gobject_class)
                                                      MAX_PROP_EXPOTIME,
                                                      DEFAULT_PROP_EXPOTIME,
                                                      G_PARAM_READABLE |
-                                                     G_PARAM_WRITABLE));
+                                                     G_PARAM_WRITABLE |
+                                                     GST_PARAM_CONTROLLABLE));
     g_object_class_install_property(gobject_class, PROP_EXPOAGAIN,
                                     g_param_spec_int("expoagain",
                                                      "ExpoAGain as percentage",
@@ -339,7 +488,8 @@ static void install_properties(GObjectClass *gobject_class)
                                                      MAX_PROP_EXPOAGAIN,
                                                      DEFAULT_PROP_EXPOAGAIN,
                                                      G_PARAM_READABLE |
-                                                     G_PARAM_WRITABLE));
+                                                     G_PARAM_WRITABLE |
+                                                     GST_PARAM_CONTROLLABLE));
 
     g_object_class_install_property(gobject_class, PROP_HUE,
                                     g_param_spec_int("hue", "...", "...",
@@ -347,7 +497,8 @@ static void install_properties(GObjectClass *gobject_class)
                                                      CAMSDK_(HUE_MAX),
                                                      CAMSDK_(HUE_DEF),
                                                      G_PARAM_READABLE |
-                                                     G_PARAM_WRITABLE));
+                                                     G_PARAM_WRITABLE |
+                                                     GST_PARAM_CONTROLLABLE));
     g_object_class_install_property(gobject_class, PROP_SATURATION,
                                     g_param_spec_int("saturation", "...",
                                                      "...",
@@ -358,7 +509,8 @@ static void install_properties(GObjectClass *gobject_class)
                                                      CAMSDK_
                                                      (SATURATION_DEF),
                                                      G_PARAM_READABLE |
-                                                     G_PARAM_WRITABLE));
+                                                     G_PARAM_WRITABLE |
+                                                     GST_PARAM_CONTROLLABLE));
     g_object_class_install_property(gobject_class, PROP_BRIGHTNESS,
                                     g_param_spec_int("brightness", "...",
                                                      "...",
@@ -369,7 +521,8 @@ static void install_properties(GObjectClass *gobject_class)
                                                      CAMSDK_
                                                      (BRIGHTNESS_DEF),
                                                      G_PARAM_READABLE |
-                                                     G_PARAM_WRITABLE));
+                                                     G_PARAM_WRITABLE |
+                                                     GST_PARAM_CONTROLLABLE));
     g_object_class_install_property(gobject_class, PROP_CONTRAST,
                                     g_param_spec_int("contrast", "...",
                                                      "...",
@@ -377,14 +530,16 @@ static void install_properties(GObjectClass *gobject_class)
                                                      CAMSDK_(CONTRAST_MAX),
                                                      CAMSDK_(CONTRAST_DEF),
                                                      G_PARAM_READABLE |
-                                                     G_PARAM_WRITABLE));
+                                                     G_PARAM_WRITABLE |
+                                                     GST_PARAM_CONTROLLABLE));
     g_object_class_install_property(gobject_class, PROP_GAMMA,
                                     g_param_spec_int("gamma", "...", "...",
                                                      CAMSDK_(GAMMA_MIN),
                                                      CAMSDK_(GAMMA_MAX),
                                                      CAMSDK_(GAMMA_DEF),
                                                      G_PARAM_READABLE |
-                                                     G_PARAM_WRITABLE));
+                                                     G_PARAM_WRITABLE |
+                                                     GST_PARAM_CONTROLLABLE));
 
     /*
        0: normal, 255 turn channel off
@@ -394,33 +549,39 @@ static void install_properties(GObjectClass *gobject_class)
                                     g_param_spec_int("bb-r", "...", "...",
                                                      0, 255, 0,
                                                      G_PARAM_READABLE |
-                                                     G_PARAM_WRITABLE));
+                                                     G_PARAM_WRITABLE |
+                                                     GST_PARAM_CONTROLLABLE));
     g_object_class_install_property(gobject_class, PROP_BB_G,
                                     g_param_spec_int("bb-g", "...", "...",
                                                      0, 255, 0,
                                                      G_PARAM_READABLE |
-                                                     G_PARAM_WRITABLE));
+                                                     G_PARAM_WRITABLE |
+                                                     GST_PARAM_CONTROLLABLE));
     g_object_class_install_property(gobject_class, PROP_BB_B,
                                     g_param_spec_int("bb-b", "...", "...",
                                                      0, 255, 0,
                                                      G_PARAM_READABLE |
-                                                     G_PARAM_WRITABLE));
+                                                     G_PARAM_WRITABLE |
+                                                     GST_PARAM_CONTROLLABLE));
 
     g_object_class_install_property(gobject_class, PROP_WB_R,
                                     g_param_spec_int("wb-r", "...", "...",
                                                      -255, 255, 0,
                                                      G_PARAM_READABLE |
-                                                     G_PARAM_WRITABLE));
+                                                     G_PARAM_WRITABLE |
+                                                     GST_PARAM_CONTROLLABLE));
     g_object_class_install_property(gobject_class, PROP_WB_G,
                                     g_param_spec_int("wb-g", "...", "...",
                                                      -255, 255, 0,
                                                      G_PARAM_READABLE |
-                                                     G_PARAM_WRITABLE));
+                                                     G_PARAM_WRITABLE |
+                                                     GST_PARAM_CONTROLLABLE));
     g_object_class_install_property(gobject_class, PROP_WB_B,
                                     g_param_spec_int("wb-b", "...", "...",
                                                      -255, 255, 0,
                                                      G_PARAM_READABLE |
-                                                     G_PARAM_WRITABLE));
+                                                     G_PARAM_WRITABLE |
+                                                     GST_PARAM_CONTROLLABLE));
 
     g_object_class_install_property(gobject_class, PROP_AWB_RGB,
                                     g_param_spec_boolean("awb-rgb",
@@ -436,6 +597,425 @@ static void install_properties(GObjectClass *gobject_class)
                                                          0,
                                                          G_PARAM_READABLE |
                                                          G_PARAM_WRITABLE));
+
+    g_object_class_install_property(gobject_class, PROP_STACK_FRAMES,
+                                    g_param_spec_int("stack-frames",
+                                                     "Frames to stack",
+                                                     "Average this many consecutive frames into each output frame (1 => disabled)",
+                                                     1,
+                                                     MAX_PROP_STACK_FRAMES,
+                                                     DEFAULT_PROP_STACK_FRAMES,
+                                                     G_PARAM_READABLE |
+                                                     G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_BEST_OF,
+                                    g_param_spec_int("best-of",
+                                                     "Best of N frames",
+                                                     "Score this many consecutive frames for sharpness and only output the sharpest (1 => disabled). Ignored when stacking",
+                                                     1, MAX_PROP_BEST_OF,
+                                                     DEFAULT_PROP_BEST_OF,
+                                                     G_PARAM_READABLE |
+                                                     G_PARAM_WRITABLE));
+
+    g_object_class_install_property(gobject_class, PROP_DARK_FILE,
+                                    g_param_spec_string("dark-file",
+                                                        "Master dark file",
+                                                        "Master dark frame to load. Captured darks are saved here",
+                                                        NULL,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_FLAT_FILE,
+                                    g_param_spec_string("flat-file",
+                                                        "Master flat file",
+                                                        "Master flat field to load. Captured flats are saved here",
+                                                        NULL,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE));
+
+    g_object_class_install_property(gobject_class, PROP_DEFECT_DIR,
+                                    g_param_spec_string("defect-dir",
+                                                        "Defect map directory",
+                                                        "Directory defect maps are loaded from and saved to, keyed by serial number and esize",
+                                                        NULL,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_DEFECT_SIGMA,
+                                    g_param_spec_double("defect-sigma",
+                                                        "Defect threshold",
+                                                        "Standard deviations from the master mean for a pixel to be considered defective",
+                                                        1.0, 100.0,
+                                                        DEFAULT_PROP_DEFECT_SIGMA,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_DEFECT_COUNT,
+                                    g_param_spec_int("defect-count",
+                                                     "Defect count",
+                                                     "Number of samples in the active defect map",
+                                                     0, G_MAXINT, 0,
+                                                     G_PARAM_READABLE));
+
+    /*
+       Host side color processing for raw / x16, where the SDK ISP controls
+       (hue, saturation, gamma...) don't apply
+       Compiled into a lookup table and done as part of the 16 bit conversion
+     */
+    g_object_class_install_property(gobject_class, PROP_HOST_CCM,
+                                    g_param_spec_string("host-ccm",
+                                                        "Host color matrix",
+                                                        "Row major 3x3 color correction matrix as 9 comma separated values (x16 only, empty => disabled)",
+                                                        NULL,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_HOST_WB_R,
+                                    g_param_spec_double("host-wb-r",
+                                                        "Host red gain",
+                                                        "White balance gain applied before the color matrix",
+                                                        0.0, 16.0,
+                                                        DEFAULT_PROP_HOST_WB,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE |
+                                                        GST_PARAM_CONTROLLABLE));
+    g_object_class_install_property(gobject_class, PROP_HOST_WB_G,
+                                    g_param_spec_double("host-wb-g",
+                                                        "Host green gain",
+                                                        "White balance gain applied before the color matrix",
+                                                        0.0, 16.0,
+                                                        DEFAULT_PROP_HOST_WB,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE |
+                                                        GST_PARAM_CONTROLLABLE));
+    g_object_class_install_property(gobject_class, PROP_HOST_WB_B,
+                                    g_param_spec_double("host-wb-b",
+                                                        "Host blue gain",
+                                                        "White balance gain applied before the color matrix",
+                                                        0.0, 16.0,
+                                                        DEFAULT_PROP_HOST_WB,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE |
+                                                        GST_PARAM_CONTROLLABLE));
+    g_object_class_install_property(gobject_class, PROP_HOST_GAMMA,
+                                    g_param_spec_double("host-gamma",
+                                                        "Host gamma",
+                                                        "Output = input ^ (1 / gamma) (1.0 => linear)",
+                                                        0.1, 10.0,
+                                                        DEFAULT_PROP_HOST_GAMMA,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE |
+                                                        GST_PARAM_CONTROLLABLE));
+    g_object_class_install_property(gobject_class, PROP_CONVERT_THREADS,
+                                    g_param_spec_int("convert-threads",
+                                                     "Conversion threads",
+                                                     "Threads used to convert raw / x16 frames (0 => one per CPU). Takes effect on start",
+                                                     0, TOUPCAM_MAX_WORKERS,
+                                                     DEFAULT_PROP_CONVERT_THREADS,
+                                                     G_PARAM_READABLE |
+                                                     G_PARAM_WRITABLE));
+
+    // x16to8 only
+    g_object_class_install_property(gobject_class, PROP_TONEMAP_INTERVAL,
+                                    g_param_spec_int("tonemap-interval",
+                                                     "Tone map interval",
+                                                     "Re-stretch the 8 bit output curve from a histogram every N frames (0 => fixed full range)",
+                                                     0, G_MAXINT,
+                                                     DEFAULT_PROP_TONEMAP_INTERVAL,
+                                                     G_PARAM_READABLE |
+                                                     G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_TONEMAP_LOW,
+                                    g_param_spec_double("tonemap-low",
+                                                        "Tone map black percentile",
+                                                        "Histogram percentile mapped to black",
+                                                        0.0, 100.0,
+                                                        DEFAULT_PROP_TONEMAP_LOW,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_TONEMAP_HIGH,
+                                    g_param_spec_double("tonemap-high",
+                                                        "Tone map white percentile",
+                                                        "Histogram percentile mapped to white",
+                                                        0.0, 100.0,
+                                                        DEFAULT_PROP_TONEMAP_HIGH,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE));
+
+    // "preview" request pad
+    g_object_class_install_property(gobject_class, PROP_PREVIEW_FACTOR,
+                                    g_param_spec_int("preview-factor",
+                                                     "Preview decimation",
+                                                     "Average factor x factor pixel blocks into each preview pixel",
+                                                     1,
+                                                     MAX_PROP_PREVIEW_FACTOR,
+                                                     DEFAULT_PROP_PREVIEW_FACTOR,
+                                                     G_PARAM_READABLE |
+                                                     G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_PREVIEW_WIDTH,
+                                    g_param_spec_int("preview-width",
+                                                     "Preview target width",
+                                                     "Pick the smallest factor giving a preview no wider than this (0 => use preview-factor)",
+                                                     0, G_MAXINT, 0,
+                                                     G_PARAM_READABLE |
+                                                     G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_PREVIEW_MAX_FPS,
+                                    g_param_spec_double("preview-max-fps",
+                                                        "Preview frame rate cap",
+                                                        "Skip preview frames to stay under this rate (0 => every frame)",
+                                                        0.0, G_MAXDOUBLE,
+                                                        0.0,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE));
+
+    g_object_class_install_property(gobject_class, PROP_MEMFD,
+                                    g_param_spec_boolean("memfd",
+                                                         "memfd buffers",
+                                                         "Output frames in sealed memfd backed GstFdMemory so they can be passed to other processes as an fd",
+                                                         FALSE,
+                                                         G_PARAM_READABLE |
+                                                         G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_MEMFD_HUGEPAGES,
+                                    g_param_spec_boolean("memfd-hugepages",
+                                                         "memfd huge pages",
+                                                         "Back memfd buffers with huge pages when available",
+                                                         FALSE,
+                                                         G_PARAM_READABLE |
+                                                         G_PARAM_WRITABLE));
+
+    g_object_class_install_property(gobject_class, PROP_DROPPED_FRAMES,
+                                    g_param_spec_int("dropped-frames",
+                                                     "Dropped frames",
+                                                     "Camera frames missing from the SDK sequence numbers since start",
+                                                     0, G_MAXINT, 0,
+                                                     G_PARAM_READABLE));
+
+    g_object_class_install_property(gobject_class, PROP_STATS,
+                                    g_param_spec_boxed("stats",
+                                                       "Statistics",
+                                                       "Frame rates, stage latencies (us) and counters over the last stats-interval",
+                                                       GST_TYPE_STRUCTURE,
+                                                       G_PARAM_READABLE));
+    g_object_class_install_property(gobject_class, PROP_STATS_INTERVAL,
+                                    g_param_spec_double("stats-interval",
+                                                        "Statistics interval",
+                                                        "Seconds between stats updates",
+                                                        0.1, G_MAXDOUBLE,
+                                                        1.0,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_POST_STATS,
+                                    g_param_spec_boolean("post-stats",
+                                                         "Post statistics",
+                                                         "Post stats as a toupcamsrc-stats element message on every update",
+                                                         FALSE,
+                                                         G_PARAM_READABLE |
+                                                         G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_MAX_FRAMERATE,
+                                    g_param_spec_double("max-framerate",
+                                                        "Maximum frame rate",
+                                                        "Limit the camera to this many frames per second (0 => no limit)",
+                                                        0.0, G_MAXDOUBLE,
+                                                        0.0,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_EXPOSURE_SETTLED,
+                                    g_param_spec_boolean("exposure-settled",
+                                                         "Exposure settled",
+                                                         "Exposure time and gain have been stable for exposure-settle-frames frames",
+                                                         FALSE,
+                                                         G_PARAM_READABLE));
+    g_object_class_install_property(gobject_class,
+                                    PROP_EXPOSURE_SETTLE_TOLERANCE,
+                                    g_param_spec_double
+                                    ("exposure-settle-tolerance",
+                                     "Exposure settle tolerance",
+                                     "Largest relative change in exposure time or gain still considered stable",
+                                     0.0, 1.0, 0.02,
+                                     G_PARAM_READABLE | G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class,
+                                    PROP_EXPOSURE_SETTLE_FRAMES,
+                                    g_param_spec_int("exposure-settle-frames",
+                                                     "Exposure settle frames",
+                                                     "Frames exposure must stay within tolerance to be settled",
+                                                     1, G_MAXINT, 3,
+                                                     G_PARAM_READABLE |
+                                                     G_PARAM_WRITABLE));
+
+    g_object_class_install_property(gobject_class, PROP_SETTINGS_GENERATION,
+                                    g_param_spec_uint("settings-generation",
+                                                      "Settings generation",
+                                                      "Bumped by every camera control write, buffers carry the generation they were exposed under in their frame meta",
+                                                      0, G_MAXUINT, 0,
+                                                      G_PARAM_READABLE));
+    g_object_class_install_property(gobject_class, PROP_SETTINGS_LATENCY,
+                                    g_param_spec_int("settings-latency",
+                                                     "Settings latency",
+                                                     "Extra microseconds a control write takes to reach the sensor",
+                                                     0, G_MAXINT, 0,
+                                                     G_PARAM_READABLE |
+                                                     G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_DROP_STALE,
+                                    g_param_spec_boolean("drop-stale",
+                                                         "Drop stale frames",
+                                                         "Drop buffers exposed before the latest camera control write",
+                                                         FALSE,
+                                                         G_PARAM_READABLE |
+                                                         G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_STALE_FRAMES,
+                                    g_param_spec_int("stale-frames",
+                                                     "Stale frames",
+                                                     "Buffers dropped by drop-stale since start",
+                                                     0, G_MAXINT, 0,
+                                                     G_PARAM_READABLE));
+    g_object_class_install_property(gobject_class, PROP_HDR_EXPOSURES,
+                                    g_param_spec_string("hdr-exposures",
+                                                        "HDR exposures",
+                                                        "Comma separated exposure times (us) to bracket and merge into each output frame, empty => off. 16 bit modes only",
+                                                        NULL,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_ENABLE_LAST_SAMPLE,
+                                    g_param_spec_boolean("enable-last-sample",
+                                                         "Enable last sample",
+                                                         "Keep a reference to the last pushed buffer for last-sample. Off by default: downstream in place transforms copy a buffer we still hold",
+                                                         FALSE,
+                                                         G_PARAM_READABLE |
+                                                         G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_LAST_SAMPLE,
+                                    g_param_spec_boxed("last-sample",
+                                                       "Last sample",
+                                                       "Last pushed buffer and its caps, NULL unless enable-last-sample",
+                                                       GST_TYPE_SAMPLE,
+                                                       G_PARAM_READABLE));
+    g_object_class_install_property(gobject_class, PROP_QOS,
+                                    g_param_spec_boolean("qos", "QoS",
+                                                         "Degrade processing in steps while downstream QoS reports it is late",
+                                                         DEFAULT_PROP_QOS,
+                                                         G_PARAM_READABLE |
+                                                         G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_MOTION_DETECT,
+                                    g_param_spec_boolean("motion-detect",
+                                                         "Motion detect",
+                                                         "Measure frame to frame motion and post motion-settled messages",
+                                                         FALSE,
+                                                         G_PARAM_READABLE |
+                                                         G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_MOTION_TOLERANCE,
+                                    g_param_spec_double("motion-tolerance",
+                                                        "Motion tolerance",
+                                                        "Largest frame to frame shift (pixels) still considered settled",
+                                                        0.0,
+                                                        MOTION_MAX_SHIFT,
+                                                        DEFAULT_PROP_MOTION_TOLERANCE,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_MOTION_DIFFERENCE,
+                                    g_param_spec_double("motion-difference",
+                                                        "Motion difference",
+                                                        "Largest relative frame to frame difference left after aligning still considered settled",
+                                                        0.0, 1.0,
+                                                        DEFAULT_PROP_MOTION_DIFFERENCE,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class,
+                                    PROP_MOTION_SETTLE_FRAMES,
+                                    g_param_spec_int("motion-settle-frames",
+                                                     "Motion settle frames",
+                                                     "Consecutive frames motion must stay within tolerance to be settled",
+                                                     1, G_MAXINT, 3,
+                                                     G_PARAM_READABLE |
+                                                     G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_MOTION_SETTLED,
+                                    g_param_spec_boolean("motion-settled",
+                                                         "Motion settled",
+                                                         "The image has been still for motion-settle-frames frames",
+                                                         FALSE,
+                                                         G_PARAM_READABLE));
+    g_object_class_install_property(gobject_class, PROP_PYRAMID_LEVELS,
+                                    g_param_spec_int("pyramid-levels",
+                                                     "Pyramid levels",
+                                                     "Half resolution mipmap levels to add to each buffer, see GstToupCamPyramidMeta. Set before start",
+                                                     0,
+                                                     GST_TOUPCAM_PYRAMID_MAX_LEVELS
+                                                     - 1, 0,
+                                                     G_PARAM_READABLE |
+                                                     G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_CROP_X,
+                                    g_param_spec_int("crop-x", "Crop x",
+                                                     "Left of the software crop window in pixels. Set before start",
+                                                     0, G_MAXINT, 0,
+                                                     G_PARAM_READABLE |
+                                                     G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_CROP_Y,
+                                    g_param_spec_int("crop-y", "Crop y",
+                                                     "Top of the software crop window in pixels. Set before start",
+                                                     0, G_MAXINT, 0,
+                                                     G_PARAM_READABLE |
+                                                     G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_CROP_WIDTH,
+                                    g_param_spec_int("crop-width",
+                                                     "Crop width",
+                                                     "Width of the software crop window, 0 => to the right edge. Set before start",
+                                                     0, G_MAXINT, 0,
+                                                     G_PARAM_READABLE |
+                                                     G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_CROP_HEIGHT,
+                                    g_param_spec_int("crop-height",
+                                                     "Crop height",
+                                                     "Height of the software crop window, 0 => to the bottom edge. Set before start",
+                                                     0, G_MAXINT, 0,
+                                                     G_PARAM_READABLE |
+                                                     G_PARAM_WRITABLE));
+    g_object_class_install_property(gobject_class, PROP_ROW_ALIGN,
+                                    g_param_spec_int("row-align",
+                                                     "Row align",
+                                                     "Pad output rows to a multiple of this many bytes when downstream supports GstVideoMeta, 0 => caps default. Set before start",
+                                                     0, MAX_PROP_ROW_ALIGN, 0,
+                                                     G_PARAM_READABLE |
+                                                     G_PARAM_WRITABLE));
+}
+
+static GstStructure *span_field(const char *description)
+{
+    return gst_structure_new("value",
+                             "type", G_TYPE_GTYPE, G_TYPE_UINT64,
+                             "description", G_TYPE_STRING, description,
+                             NULL);
+}
+
+static void span_record_init(void)
+{
+    span_record = gst_tracer_record_new("toupcamsrc-frame.class",
+                                        "element", GST_TYPE_STRUCTURE,
+                                        gst_structure_new("scope",
+                                                          "type",
+                                                          G_TYPE_GTYPE,
+                                                          G_TYPE_STRING,
+                                                          "related-to",
+                                                          GST_TYPE_TRACER_VALUE_SCOPE,
+                                                          GST_TRACER_VALUE_SCOPE_ELEMENT,
+                                                          NULL), "seq",
+                                        GST_TYPE_STRUCTURE,
+                                        gst_structure_new("value", "type",
+                                                          G_TYPE_GTYPE,
+                                                          G_TYPE_UINT,
+                                                          "description",
+                                                          G_TYPE_STRING,
+                                                          "SDK frame sequence number",
+                                                          NULL),
+                                        "callback", GST_TYPE_STRUCTURE,
+                                        span_field
+                                        ("SDK image event, monotonic us"),
+                                        "wake", GST_TYPE_STRUCTURE,
+                                        span_field
+                                        ("streaming thread woke up"),
+                                        "pull-start", GST_TYPE_STRUCTURE,
+                                        span_field("first pull started"),
+                                        "pull-end", GST_TYPE_STRUCTURE,
+                                        span_field("last pull finished"),
+                                        "convert-end", GST_TYPE_STRUCTURE,
+                                        span_field
+                                        ("host processing finished"),
+                                        "push", GST_TYPE_STRUCTURE,
+                                        span_field
+                                        ("buffer handed to GstBaseSrc"),
+                                        NULL);
+    GST_OBJECT_FLAG_SET(span_record, GST_OBJECT_FLAG_MAY_BE_LEAKED);
 }
 
 static void gst_toupcam_src_class_init(GstToupCamSrcClass * klass)
@@ -453,16 +1033,30 @@ static void gst_toupcam_src_class_init(GstToupCamSrcClass * klass)
     gobject_class->dispose = gst_toupcam_src_dispose;
     gobject_class->finalize = gst_toupcam_src_finalize;
 
-    if (raw || x16) {
+    span_record_init();
+
+    if ((raw || x16) && !x16to8) {
         GST_DEBUG("select x16 template");
         gst_element_class_add_pad_template(gstelement_class,
                                            gst_static_pad_template_get
                                            (&gst_toupcam_src_template_x16));
+        gst_element_class_add_pad_template(gstelement_class,
+                                           gst_static_pad_template_get
+                                           (&gst_toupcam_src_preview_template_x16));
     } else {
         gst_element_class_add_pad_template(gstelement_class,
                                            gst_static_pad_template_get
                                            (&gst_toupcam_src_template_x8));
+        gst_element_class_add_pad_template(gstelement_class,
+                                           gst_static_pad_template_get
+                                           (&gst_toupcam_src_preview_template_x8));
     }
+    gstelement_class->request_new_pad =
+        GST_DEBUG_FUNCPTR(gst_toupcam_src_request_new_pad);
+    gstelement_class->release_pad =
+        GST_DEBUG_FUNCPTR(gst_toupcam_src_release_pad);
+    gstelement_class->send_event =
+        GST_DEBUG_FUNCPTR(gst_toupcam_src_send_event);
 
     gst_element_class_set_static_metadata(gstelement_class,
                                           "ToupCam Video Source",
@@ -476,19 +1070,77 @@ static void gst_toupcam_src_class_init(GstToupCamSrcClass * klass)
         GST_DEBUG_FUNCPTR(gst_toupcam_src_get_caps);
     gstbasesrc_class->set_caps =
         GST_DEBUG_FUNCPTR(gst_toupcam_src_set_caps);
+    gstbasesrc_class->event = GST_DEBUG_FUNCPTR(gst_toupcam_src_event);
+    gstbasesrc_class->decide_allocation =
+        GST_DEBUG_FUNCPTR(gst_toupcam_src_decide_allocation);
 
-    gstpushsrc_class->alloc = GST_DEBUG_FUNCPTR(gst_toupcam_src_alloc);
     gstpushsrc_class->fill = GST_DEBUG_FUNCPTR(gst_toupcam_src_fill);
     GST_DEBUG("Using gst_toupcam_src_fill");
 
 
     install_properties(gobject_class);
+
+    /*
+       Average the next N frames into a new master
+       Capture darks with the sensor covered and flats of a uniformly lit
+       target, in the mode / esize / exposure they will be used with
+       A "master-captured" element message is posted when done
+     */
+    klass->capture_dark = gst_toupcam_src_capture_dark;
+    klass->capture_flat = gst_toupcam_src_capture_flat;
+    gst_toupcam_src_signals[SIGNAL_CAPTURE_DARK] =
+        g_signal_new("capture-dark", G_TYPE_FROM_CLASS(klass),
+                     G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+                     G_STRUCT_OFFSET(GstToupCamSrcClass, capture_dark),
+                     NULL, NULL, NULL, G_TYPE_NONE, 1, G_TYPE_INT);
+    gst_toupcam_src_signals[SIGNAL_CAPTURE_FLAT] =
+        g_signal_new("capture-flat", G_TYPE_FROM_CLASS(klass),
+                     G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+                     G_STRUCT_OFFSET(GstToupCamSrcClass, capture_flat),
+                     NULL, NULL, NULL, G_TYPE_NONE, 1, G_TYPE_INT);
+
+    /*
+       Build a hot / dead pixel map from the current master dark (hot) and
+       master flat (dead, stuck) and save it to defect-dir
+       A "defect-map-built" element message is posted when done
+     */
+    klass->build_defect_map = gst_toupcam_src_build_defect_map;
+    gst_toupcam_src_signals[SIGNAL_BUILD_DEFECT_MAP] =
+        g_signal_new("build-defect-map", G_TYPE_FROM_CLASS(klass),
+                     G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+                     G_STRUCT_OFFSET(GstToupCamSrcClass, build_defect_map),
+                     NULL, NULL, NULL, G_TYPE_NONE, 0);
+
+    /*
+       Return the last pushed frame as a GstSample, or wait up to timeout ns
+       (GST_CLOCK_TIME_NONE => forever) for the next one
+       timeout 0 needs enable-last-sample, NULL on timeout / stop
+     */
+    klass->grab = gst_toupcam_src_grab;
+    gst_toupcam_src_signals[SIGNAL_GRAB] =
+        g_signal_new("grab", G_TYPE_FROM_CLASS(klass),
+                     G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+                     G_STRUCT_OFFSET(GstToupCamSrcClass, grab),
+                     NULL, NULL, NULL, GST_TYPE_SAMPLE, 1, G_TYPE_UINT64);
+
+    /*
+       Restart motion settling, ex right after commanding a stage move
+       A "motion-settled" element message is posted once the image has been
+       still for motion-settle-frames frames
+     */
+    klass->rearm_motion = gst_toupcam_src_rearm_motion;
+    gst_toupcam_src_signals[SIGNAL_REARM_MOTION] =
+        g_signal_new("rearm-motion", G_TYPE_FROM_CLASS(klass),
+                     G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+                     G_STRUCT_OFFSET(GstToupCamSrcClass, rearm_motion),
+                     NULL, NULL, NULL, G_TYPE_NONE, 0);
 }
 
 static void gst_toupcam_src_init(GstToupCamSrc * src)
 {
     src->raw = raw;
-    src->x16 = x16;
+    src->x16 = x16 || x16to8;
+    src->x16to8 = x16to8;
     src->auto_exposure = DEFAULT_PROP_AUTO_EXPOSURE;
     src->expotime = DEFAULT_PROP_EXPOTIME;
     src->expoagain = DEFAULT_PROP_EXPOAGAIN;
@@ -510,6 +1162,114 @@ static void gst_toupcam_src_init(GstToupCamSrc * src)
     src->awb_rgb = 0;
     src->awb_tt = 0;
 
+    src->stack_frames = DEFAULT_PROP_STACK_FRAMES;
+    src->stack_acc = NULL;
+    src->frame_buff = NULL;
+    src->best_of = DEFAULT_PROP_BEST_OF;
+    src->best_buff = NULL;
+
+    src->hdr_exposures_str = NULL;
+    src->hdr_request_count = 0;
+    src->hdr_dirty = FALSE;
+    src->hdr_count = 0;
+    src->hdr_frames = NULL;
+    src->hdr_curve = NULL;
+
+    src->dark = NULL;
+    src->flat = NULL;
+    src->cal_warned = FALSE;
+    src->capture_kind = TOUPCAM_MASTER_NONE;
+    src->capture_acc = NULL;
+    src->dark_file = NULL;
+    src->flat_file = NULL;
+    src->pending_dark = NULL;
+    src->dark_pending = FALSE;
+    src->pending_flat = NULL;
+    src->flat_pending = FALSE;
+    src->capture_request = TOUPCAM_MASTER_NONE;
+
+    src->defects = NULL;
+    src->defect_dir = NULL;
+    src->defect_sigma = DEFAULT_PROP_DEFECT_SIGMA;
+    src->defect_request = FALSE;
+
+    src->host_ccm_str = NULL;
+    src->host_ccm_set = FALSE;
+    for (int i = 0; i < 3; ++i) {
+        src->host_wb[i] = DEFAULT_PROP_HOST_WB;
+    }
+    src->host_gamma = DEFAULT_PROP_HOST_GAMMA;
+    src->color_dirty = TRUE;
+    src->convert_threads = DEFAULT_PROP_CONVERT_THREADS;
+    src->color = NULL;
+    src->workers = NULL;
+
+    src->tonemap_interval = DEFAULT_PROP_TONEMAP_INTERVAL;
+    src->tonemap_low = DEFAULT_PROP_TONEMAP_LOW;
+    src->tonemap_high = DEFAULT_PROP_TONEMAP_HIGH;
+    src->tonemap = NULL;
+    src->tonemap_hist = NULL;
+
+    src->preview_pad = NULL;
+    src->preview_new = FALSE;
+    src->preview_factor = DEFAULT_PROP_PREVIEW_FACTOR;
+    src->preview_width = 0;
+    src->preview_max_fps = 0.0;
+
+    src->memfd = FALSE;
+    src->memfd_hugepages = FALSE;
+    src->pyramid_levels = 0;
+    src->pyramid_count = 1;
+    src->pyramid_bytes = 0;
+    src->crop_x = 0;
+    src->crop_y = 0;
+    src->crop_width = 0;
+    src->crop_height = 0;
+    src->cropping = FALSE;
+    src->crop_meta = FALSE;
+    src->row_align = 0;
+    src->video_meta = FALSE;
+
+    src->dropped_frames = 0;
+
+    src->stats_interval = 1.0;
+    src->post_stats = FALSE;
+
+    src->framerate = 0.0;
+    src->maxframerate = 0.0;
+    src->framerate_dirty = FALSE;
+    src->camera_framerate = 0.0;
+
+    src->settle_tolerance = 0.02;
+    src->settle_frames = 3;
+    src->settle_rearm = FALSE;
+    src->exposure_settled = 0;
+
+    src->motion_detect = FALSE;
+    src->motion_tolerance = DEFAULT_PROP_MOTION_TOLERANCE;
+    src->motion_difference = DEFAULT_PROP_MOTION_DIFFERENCE;
+    src->motion_frames = 3;
+    src->motion_rearm = FALSE;
+    src->motion_prev = NULL;
+    src->motion_cur = NULL;
+    src->motion_have_prev = FALSE;
+    src->motion_width = 0;
+    src->motion_height = 0;
+    src->motion_settled = 0;
+
+    src->settings_gen = 0;
+    memset(src->gen_time, 0, sizeof(src->gen_time));
+    src->settings_latency = 0;
+    src->drop_stale = FALSE;
+    src->readout_us = 0;
+    src->stale_frames = 0;
+    src->stats = NULL;
+
+    src->image_event_time = 0;
+    src->span_ring = NULL;
+    src->span_thread = NULL;
+    src->span_file = NULL;
+
     /* set source as live (no preroll) */
     gst_base_src_set_live(GST_BASE_SRC(src), TRUE);
 
@@ -518,6 +1278,9 @@ static void gst_toupcam_src_init(GstToupCamSrc * src)
 
     g_mutex_init(&src->mutex);
     g_cond_init(&src->cond);
+    g_mutex_init(&src->last_lock);
+    g_cond_init(&src->last_cond);
+    src->qos = DEFAULT_PROP_QOS;
     gst_toupcam_src_reset(src);
 }
 
@@ -545,273 +1308,977 @@ static void my_tt_cb(const int nTemp, const int nTint, void *pCtx)
     src->awb_tt = 0;
 }
 
-void gst_toupcam_src_set_property(GObject * object, guint property_id,
-                                  const GValue * value, GParamSpec * pspec)
+static void gst_toupcam_src_capture_master(GstToupCamSrc * src,
+                                           ToupcamMasterKind kind,
+                                           gint frames)
 {
-    GstToupCamSrc *src;
+    GST_OBJECT_LOCK(src);
+    src->capture_request = kind;
+    src->capture_request_frames = CLAMP(frames, 1, MAX_CAPTURE_FRAMES);
+    GST_OBJECT_UNLOCK(src);
+}
 
-    src = GST_TOUPCAM_SRC(object);
+static void gst_toupcam_src_capture_dark(GstToupCamSrc * src, gint frames)
+{
+    gst_toupcam_src_capture_master(src, TOUPCAM_MASTER_DARK, frames);
+}
 
-    switch (property_id) {
-    case PROP_ESIZE:
-        // Only set before start
-        src->esize = g_value_get_int(value);
-        break;
-    case PROP_HFLIP:
-        src->hflip = g_value_get_boolean(value);
-        if (src->hCam) {
-            camsdk_(put_HFlip) (src->hCam, src->hflip);
-        }
-        break;
-    case PROP_VFLIP:
-        src->vflip = g_value_get_boolean(value);
-        if (src->hCam) {
-            camsdk_(put_VFlip) (src->hCam, src->vflip);
-        }
-        break;
-    case PROP_AUTO_EXPOSURE:
-        src->auto_exposure = g_value_get_boolean(value);
-        if (src->hCam) {
-            camsdk_(put_AutoExpoEnable) (src->hCam, src->auto_exposure);
-        }
-        break;
-    case PROP_EXPOTIME:
-        src->expotime = g_value_get_int(value);
-        if (src->hCam) {
-            camsdk_(put_ExpoTime) (src->hCam, src->expotime);
-        }
-        break;
-    case PROP_EXPOAGAIN:
-        src->expoagain = g_value_get_int(value);
-        if (src->hCam) {
-            camsdk_(put_ExpoAGain) (src->hCam, src->expoagain);
-        }
-        break;
-    case PROP_HUE:
-        src->hue = g_value_get_int(value);
-        if (src->hCam) {
-            camsdk_(put_Hue) (src->hCam, src->hue);
-        }
-        break;
-    case PROP_SATURATION:
-        src->saturation = g_value_get_int(value);
-        if (src->hCam) {
-            camsdk_(put_Saturation) (src->hCam, src->saturation);
-        }
-        break;
-    case PROP_BRIGHTNESS:
-        src->brightness = g_value_get_int(value);
-        if (src->hCam) {
-            camsdk_(put_Brightness) (src->hCam, src->brightness);
-        }
-        break;
-    case PROP_CONTRAST:
-        src->contrast = g_value_get_int(value);
-        if (src->hCam) {
-            camsdk_(put_Contrast) (src->hCam, src->contrast);
-        }
-        break;
-    case PROP_GAMMA:
-        src->gamma = g_value_get_int(value);
-        if (src->hCam) {
-            camsdk_(put_Gamma) (src->hCam, src->gamma);
-        }
-        break;
+static void gst_toupcam_src_capture_flat(GstToupCamSrc * src, gint frames)
+{
+    gst_toupcam_src_capture_master(src, TOUPCAM_MASTER_FLAT, frames);
+}
 
-    case PROP_BB_R:
-        src->black_balance[0] = g_value_get_int(value);
-        if (src->hCam) {
-            camsdk_(put_BlackBalance) (src->hCam, src->black_balance);
-        }
-        break;
-    case PROP_BB_G:
-        src->black_balance[1] = g_value_get_int(value);
-        if (src->hCam) {
-            camsdk_(put_BlackBalance) (src->hCam, src->black_balance);
-        }
-        break;
-    case PROP_BB_B:
-        src->black_balance[2] = g_value_get_int(value);
-        if (src->hCam) {
-            camsdk_(put_BlackBalance) (src->hCam, src->black_balance);
-        }
-        break;
+// Parse "a,b,c,d,e,f,g,h,i" (comma and / or space separated)
+static void set_host_ccm(GstToupCamSrc * src, const gchar * str)
+{
+    gchar **tokens;
+    gdouble ccm[9];
+    gint n = 0;
+    gboolean ok = TRUE;
+
+    if (!str || !str[0]) {
+        GST_OBJECT_LOCK(src);
+        g_free(src->host_ccm_str);
+        src->host_ccm_str = NULL;
+        src->host_ccm_set = FALSE;
+        src->color_dirty = TRUE;
+        GST_OBJECT_UNLOCK(src);
+        return;
+    }
 
-    case PROP_WB_R:
-        src->white_balance[0] = g_value_get_int(value);
-        if (src->hCam) {
-            camsdk_(put_WhiteBalanceGain) (src->hCam, src->white_balance);
+    tokens = g_strsplit_set(str, ", ", -1);
+    for (gchar ** t = tokens; *t && ok; ++t) {
+        gchar *end;
+        if (!(*t)[0]) {
+            continue;
         }
-        break;
-    case PROP_WB_G:
-        src->white_balance[1] = g_value_get_int(value);
-        if (src->hCam) {
-            camsdk_(put_WhiteBalanceGain) (src->hCam, src->white_balance);
+        if (n >= 9) {
+            ok = FALSE;
+            break;
         }
-        break;
-    case PROP_WB_B:
-        src->white_balance[2] = g_value_get_int(value);
-        if (src->hCam) {
-            camsdk_(put_WhiteBalanceGain) (src->hCam, src->white_balance);
+        ccm[n++] = g_ascii_strtod(*t, &end);
+        if (*end) {
+            ok = FALSE;
         }
-        break;
+    }
+    g_strfreev(tokens);
+    if (!ok || n != 9) {
+        GST_WARNING_OBJECT(src, "invalid host-ccm \"%s\", need 9 values",
+                           str);
+        return;
+    }
 
-    case PROP_AWB_RGB:
-        if (!(src->awb_rgb || src->awb_tt)) {
-            // fail...
-            if (FAILED(camsdk_(AwbInit) (src->hCam, my_rgb_cb, src))) {
-                GST_ERROR_OBJECT(src, "failed to awb rgb");
-                src->awb_rgb = 0;
-            } else {
-                src->awb_rgb = 1;
+    GST_OBJECT_LOCK(src);
+    g_free(src->host_ccm_str);
+    src->host_ccm_str = g_strdup(str);
+    memcpy(src->host_ccm, ccm, sizeof(ccm));
+    src->host_ccm_set = TRUE;
+    src->color_dirty = TRUE;
+    GST_OBJECT_UNLOCK(src);
+}
+
+// Empty / NULL turns bracketing off
+static void set_hdr_exposures(GstToupCamSrc * src, const gchar * str)
+{
+    gchar **tokens;
+    guint32 expotime[TOUPCAM_HDR_MAX];
+    gint n = 0;
+    gboolean ok = TRUE;
+
+    if (str) {
+        tokens = g_strsplit_set(str, ", ", -1);
+        for (gchar ** t = tokens; *t && ok; ++t) {
+            gchar *end;
+            guint64 v;
+            if (!(*t)[0]) {
+                continue;
+            }
+            if (n >= TOUPCAM_HDR_MAX) {
+                ok = FALSE;
+                break;
+            }
+            v = g_ascii_strtoull(*t, &end, 10);
+            if (*end || v == 0 || v > G_MAXUINT32) {
+                ok = FALSE;
             }
+            expotime[n++] = v;
         }
-        break;
+        g_strfreev(tokens);
+    }
+    if (!ok || n == 1) {
+        GST_WARNING_OBJECT(src, "invalid hdr-exposures \"%s\", need 2 to %d "
+                           "exposure times", str, TOUPCAM_HDR_MAX);
+        return;
+    }
 
-    case PROP_AWB_TT:
-        if (!(src->awb_rgb || src->awb_tt)) {
-            // ok
-            if (FAILED(camsdk_(AwbOnce) (src->hCam, my_tt_cb, src))) {
-                GST_ERROR_OBJECT(src, "failed to awb tt");
-                src->awb_tt = 0;
-            } else {
-                src->awb_tt = 1;
+    GST_OBJECT_LOCK(src);
+    g_free(src->hdr_exposures_str);
+    src->hdr_exposures_str = n ? g_strdup(str) : NULL;
+    memcpy(src->hdr_request, expotime, n * sizeof(guint32));
+    src->hdr_request_count = n;
+    src->hdr_dirty = TRUE;
+    GST_OBJECT_UNLOCK(src);
+}
+
+// New sample of last_buffer with the current caps, NULL if none
+// Call with last_lock held
+static GstSample *last_sample_locked(GstToupCamSrc * src)
+{
+    if (!src->last_buffer) {
+        return NULL;
+    }
+    GstCaps *caps = gst_pad_get_current_caps(GST_BASE_SRC_PAD(src));
+    GstSample *sample = gst_sample_new(src->last_buffer, caps, NULL, NULL);
+    if (caps) {
+        gst_caps_unref(caps);
+    }
+    return sample;
+}
+
+static GstSample *gst_toupcam_src_grab(GstToupCamSrc * src,
+                                       guint64 timeout)
+{
+    GstSample *sample = NULL;
+
+    g_mutex_lock(&src->last_lock);
+    if (timeout == 0) {
+        sample = last_sample_locked(src);
+        g_mutex_unlock(&src->last_lock);
+        return sample;
+    }
+
+    gint64 deadline = 0;
+    if (timeout != GST_CLOCK_TIME_NONE) {
+        deadline = g_get_monotonic_time() + timeout / 1000;
+    }
+    guint64 count = src->last_count;
+    src->grab_waiters++;
+    while (src->last_count == count && !src->last_flushing) {
+        if (!deadline) {
+            g_cond_wait(&src->last_cond, &src->last_lock);
+        } else if (!g_cond_wait_until(&src->last_cond, &src->last_lock,
+                                      deadline)) {
+            break;
+        }
+    }
+    src->grab_waiters--;
+    if (src->last_count != count) {
+        sample = last_sample_locked(src);
+    }
+    // Only held for this grab, don't pin a buffer until the next one
+    if (!src->enable_last_sample && !src->grab_waiters) {
+        gst_buffer_replace(&src->last_buffer, NULL);
+    }
+    g_mutex_unlock(&src->last_lock);
+
+    if (!sample) {
+        GST_DEBUG_OBJECT(src, "grab: no frame within timeout");
+    }
+    return sample;
+}
+
+static void gst_toupcam_src_build_defect_map(GstToupCamSrc * src)
+{
+    GST_OBJECT_LOCK(src);
+    src->defect_request = TRUE;
+    GST_OBJECT_UNLOCK(src);
+}
+
+static GstPad *gst_toupcam_src_request_new_pad(GstElement * element,
+                                               GstPadTemplate * templ,
+                                               const gchar * name,
+                                               const GstCaps * caps)
+{
+    GstToupCamSrc *src = GST_TOUPCAM_SRC(element);
+    GstPad *pad;
+
+    GST_OBJECT_LOCK(src);
+    if (src->preview_pad) {
+        GST_OBJECT_UNLOCK(src);
+        GST_WARNING_OBJECT(src, "only one preview pad is supported");
+        return NULL;
+    }
+    pad = gst_pad_new_from_template(templ, "preview");
+    src->preview_pad = pad;
+    src->preview_new = TRUE;
+    GST_OBJECT_UNLOCK(src);
+
+    // Activated here if we are already running
+    gst_element_add_pad(element, pad);
+    return pad;
+}
+
+static void gst_toupcam_src_release_pad(GstElement * element, GstPad * pad)
+{
+    GstToupCamSrc *src = GST_TOUPCAM_SRC(element);
+
+    GST_OBJECT_LOCK(src);
+    if (pad == src->preview_pad) {
+        src->preview_pad = NULL;
+    }
+    GST_OBJECT_UNLOCK(src);
+
+    gst_pad_set_active(pad, FALSE);
+    gst_element_remove_pad(element, pad);
+}
+
+// basesrc only forwards EOS to its own pad
+static gboolean gst_toupcam_src_send_event(GstElement * element,
+                                           GstEvent * event)
+{
+    GstToupCamSrc *src = GST_TOUPCAM_SRC(element);
+
+    if (GST_EVENT_TYPE(event) == GST_EVENT_EOS) {
+        GstPad *pad = NULL;
+
+        GST_OBJECT_LOCK(src);
+        if (src->preview_pad) {
+            pad = gst_object_ref(src->preview_pad);
+        }
+        GST_OBJECT_UNLOCK(src);
+        if (pad) {
+            gst_pad_push_event(pad, gst_event_new_eos());
+            gst_object_unref(pad);
+        }
+    }
+    return
+        GST_ELEMENT_CLASS(gst_toupcam_src_parent_class)->send_event(element,
+                                                                    event);
+}
+
+// Latest downstream QoS, acted on by the streaming thread in qos_update()
+static gboolean gst_toupcam_src_event(GstBaseSrc * bsrc, GstEvent * event)
+{
+    GstToupCamSrc *src = GST_TOUPCAM_SRC(bsrc);
+
+    if (GST_EVENT_TYPE(event) == GST_EVENT_QOS) {
+        GstQOSType type;
+        gdouble proportion;
+        GstClockTimeDiff diff;
+        GstClockTime timestamp;
+
+        gst_event_parse_qos(event, &type, &proportion, &diff, &timestamp);
+        GST_LOG_OBJECT(src, "QoS proportion %f diff %" G_GINT64_FORMAT,
+                       proportion, diff);
+        // Throttling is a request to slow down, not lateness
+        if (type == GST_QOS_TYPE_THROTTLE) {
+            return TRUE;
+        }
+        GST_OBJECT_LOCK(src);
+        src->qos_proportion = proportion;
+        src->qos_diff = diff;
+        src->qos_timestamp = timestamp;
+        src->qos_event_time = g_get_monotonic_time();
+        GST_OBJECT_UNLOCK(src);
+        return TRUE;
+    }
+    return GST_BASE_SRC_CLASS(gst_toupcam_src_parent_class)->event(bsrc,
+                                                                   event);
+}
+
+// Configure a downstream pool for our frames, FALSE if it can't take them
+static gboolean configure_downstream_pool(GstToupCamSrc * src,
+                                          GstBufferPool * pool,
+                                          GstCaps * caps, guint size,
+                                          guint min, guint max,
+                                          GstAllocator * allocator,
+                                          const GstAllocationParams * params)
+{
+    GstStructure *config = gst_buffer_pool_get_config(pool);
+    GstAllocationParams got;
+
+    gst_buffer_pool_config_set_params(config, caps, size, min, max);
+    gst_buffer_pool_config_set_allocator(config, allocator, params);
+    if (gst_buffer_pool_set_config(pool, config)) {
+        return TRUE;
+    }
+    // The pool adjusted the config, take it if it still fits
+    GST_DEBUG_OBJECT(src, "downstream pool changed our config");
+    config = gst_buffer_pool_get_config(pool);
+    if (gst_buffer_pool_config_validate_params(config, caps, size, min, max)
+        && gst_buffer_pool_config_get_allocator(config, NULL, &got)
+        && got.align >= params->align) {
+        return gst_buffer_pool_set_config(pool, config);
+    }
+    gst_structure_free(config);
+    return FALSE;
+}
+
+/*
+Frames go to a downstream pool when it takes our buffer size and alignment,
+else to our own pool (memfd with memfd=true) using the downstream allocator
+The base class allocates from the pool in the query, so the SDK pulls
+straight into downstream memory
+If downstream reads GstVideoMeta, output rows can be padded to row-align and
+a crop window handed over as full frames plus GstVideoCropMeta instead of
+being copied out
+*/
+static gboolean gst_toupcam_src_decide_allocation(GstBaseSrc * bsrc,
+                                                  GstQuery * query)
+{
+    GstToupCamSrc *src = GST_TOUPCAM_SRC(bsrc);
+    GstBufferPool *pool = NULL;
+    GstAllocator *allocator = NULL;
+    GstAllocationParams params;
+    GstStructure *config;
+    GstCaps *caps;
+    guint size, min = 0, max = 0;
+
+    src->video_meta = gst_query_find_allocation_meta(query,
+                                                     GST_VIDEO_META_API_TYPE,
+                                                     NULL);
+    src->crop_meta = src->cropping && src->video_meta
+        && gst_query_find_allocation_meta(query,
+                                          GST_VIDEO_CROP_META_API_TYPE,
+                                          NULL);
+    output_layout(src);
+    GST_INFO_OBJECT(src, "output stride %d, crop window %s", src->out_stride,
+                    !src->cropping ? "off" : src->crop_meta ?
+                    "as GstVideoCropMeta" : "copied");
+    // Pyramid levels follow the frame in the same memory
+    size = src->image_bytes_out + src->pyramid_bytes;
+
+    gst_query_parse_allocation(query, &caps, NULL);
+    if (gst_query_get_n_allocation_params(query) > 0) {
+        gst_query_parse_nth_allocation_param(query, 0, &allocator, &params);
+    } else {
+        gst_allocation_params_init(&params);
+    }
+    // Padded rows only help SIMD consumers if the first row is aligned too
+    if (src->row_align > 1 && !(src->row_align & (src->row_align - 1))) {
+        params.align = MAX(params.align, (gsize) src->row_align - 1);
+    }
+
+    if (!src->memfd && gst_query_get_n_allocation_pools(query) > 0) {
+        gst_query_parse_nth_allocation_pool(query, 0, &pool, NULL, &min,
+                                            &max);
+        if (pool && !configure_downstream_pool(src, pool, caps, size, min,
+                                               max, allocator, &params)) {
+            GST_INFO_OBJECT(src,
+                            "downstream pool can't take %u byte frames, "
+                            "using our own", size);
+            gst_object_unref(pool);
+            pool = NULL;
+        }
+    }
+    if (!pool) {
+        if (src->memfd) {
+            pool = gst_toupcam_pool_new(src->memfd_hugepages);
+            if (!pool) {
+                GST_ERROR_OBJECT(src, "memfd not supported on this system");
+                goto fail;
             }
+            min = MAX(min, 2);
+        } else {
+            pool = gst_buffer_pool_new();
         }
-        break;
+        config = gst_buffer_pool_get_config(pool);
+        gst_buffer_pool_config_set_params(config, caps, size, min, max);
+        // The memfd pool brings its own allocator
+        if (!src->memfd) {
+            gst_buffer_pool_config_set_allocator(config, allocator, &params);
+        }
+        if (!gst_buffer_pool_set_config(pool, config)) {
+            GST_ERROR_OBJECT(src, "failed to configure buffer pool");
+            gst_object_unref(pool);
+            goto fail;
+        }
+    }
 
-    default:
-        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
-        break;
+    if (gst_query_get_n_allocation_pools(query) > 0) {
+        gst_query_set_nth_allocation_pool(query, 0, pool, size, min, max);
+    } else {
+        gst_query_add_allocation_pool(query, pool, size, min, max);
+    }
+    gst_object_unref(pool);
+    if (allocator) {
+        gst_object_unref(allocator);
+    }
+    return TRUE;
+
+  fail:
+    if (allocator) {
+        gst_object_unref(allocator);
     }
+    return FALSE;
 }
 
-static void try_get_black_balance(GstToupCamSrc * src)
+/*
+Load a master to be installed by the streaming thread
+An empty file name clears the master
+If the file can't be loaded the current master is kept so a path can be set
+before capturing
+*/
+static void set_master_file(GstToupCamSrc * src, ToupcamMasterKind kind,
+                            const gchar * fn)
 {
-    if (src->hCam) {
-        camsdk_(get_BlackBalance) (src->hCam, src->black_balance);
+    ToupcamMaster *master = NULL;
+
+    if (fn && fn[0]) {
+        master = toupcam_master_load(fn, kind);
+        if (!master) {
+            GST_WARNING_OBJECT(src, "failed to load master %s", fn);
+        }
+    }
+
+    GST_OBJECT_LOCK(src);
+    if (kind == TOUPCAM_MASTER_DARK) {
+        g_free(src->dark_file);
+        src->dark_file = g_strdup(fn);
+        if (master || !(fn && fn[0])) {
+            toupcam_master_free(src->pending_dark);
+            src->pending_dark = master;
+            src->dark_pending = TRUE;
+        }
+    } else {
+        g_free(src->flat_file);
+        src->flat_file = g_strdup(fn);
+        if (master || !(fn && fn[0])) {
+            toupcam_master_free(src->pending_flat);
+            src->pending_flat = master;
+            src->flat_pending = TRUE;
+        }
     }
+    GST_OBJECT_UNLOCK(src);
 }
 
-static void try_get_white_balance(GstToupCamSrc * src)
+// Properties written to the camera that change the image
+static gboolean is_camera_control(guint property_id)
 {
-    if (src->hCam) {
-        camsdk_(get_WhiteBalanceGain) (src->hCam, src->white_balance);
+    switch (property_id) {
+    case PROP_HFLIP:
+    case PROP_VFLIP:
+    case PROP_AUTO_EXPOSURE:
+    case PROP_EXPOTIME:
+    case PROP_EXPOAGAIN:
+    case PROP_HUE:
+    case PROP_SATURATION:
+    case PROP_BRIGHTNESS:
+    case PROP_CONTRAST:
+    case PROP_GAMMA:
+    case PROP_BB_R:
+    case PROP_BB_G:
+    case PROP_BB_B:
+    case PROP_WB_R:
+    case PROP_WB_G:
+    case PROP_WB_B:
+    case PROP_AWB_RGB:
+    case PROP_AWB_TT:
+        return TRUE;
+    default:
+        return FALSE;
     }
 }
 
-void gst_toupcam_src_get_property(GObject * object, guint property_id,
-                                  GValue * value, GParamSpec * pspec)
+// Controlled properties are set on every frame, true if value wouldn't
+// change anything
+// Auto exposure moves the exposure behind our back, so that is read back
+static gboolean control_unchanged(GstToupCamSrc * src, guint property_id,
+                                  const GValue * value)
+{
+    unsigned expotime;
+    unsigned short expoagain;
+
+    switch (property_id) {
+    case PROP_EXPOTIME:
+        return !FAILED(camsdk_(get_ExpoTime) (src->hCam, &expotime))
+            && expotime == (unsigned) g_value_get_int(value);
+    case PROP_EXPOAGAIN:
+        return !FAILED(camsdk_(get_ExpoAGain) (src->hCam, &expoagain))
+            && expoagain == g_value_get_int(value);
+    case PROP_HUE:
+        return src->hue == g_value_get_int(value);
+    case PROP_SATURATION:
+        return src->saturation == g_value_get_int(value);
+    case PROP_BRIGHTNESS:
+        return src->brightness == g_value_get_int(value);
+    case PROP_CONTRAST:
+        return src->contrast == g_value_get_int(value);
+    case PROP_GAMMA:
+        return src->gamma == g_value_get_int(value);
+    case PROP_BB_R:
+    case PROP_BB_G:
+    case PROP_BB_B:
+        return src->black_balance[property_id - PROP_BB_R] ==
+            g_value_get_int(value);
+    case PROP_WB_R:
+    case PROP_WB_G:
+    case PROP_WB_B:
+        return src->white_balance[property_id - PROP_WB_R] ==
+            g_value_get_int(value);
+    default:
+        return FALSE;
+    }
+}
+
+// New settings generation, call once the control is written to the camera
+static void settings_changed(GstToupCamSrc * src)
+{
+    gint64 now = g_get_monotonic_time();
+
+    GST_OBJECT_LOCK(src);
+    src->settings_gen++;
+    src->gen_time[src->settings_gen % TOUPCAM_GEN_HISTORY] = now;
+    GST_OBJECT_UNLOCK(src);
+}
+
+void gst_toupcam_src_set_property(GObject * object, guint property_id,
+                                  const GValue * value, GParamSpec * pspec)
 {
     GstToupCamSrc *src;
-    char buff[64] = "";
-    int tempi = 0;
 
-    g_return_if_fail(GST_IS_TOUPCAM_SRC(object));
     src = GST_TOUPCAM_SRC(object);
 
     switch (property_id) {
-    case PROP_SDK_BRAND:
-        g_value_set_string(value, CAMDSK_BRAND);
-        break;
-    case PROP_SDK_VERSION:
-        g_value_set_string(value, camsdk_(Version) ());
+    case PROP_ESIZE:
+        // Only set before start
+        src->esize = g_value_get_int(value);
         break;
-
-    case PROP_SERIAL_NUMBER:
+    case PROP_HFLIP:
+        src->hflip = g_value_get_boolean(value);
         if (src->hCam) {
-            camsdk_(get_SerialNumber) (src->hCam, buff);
+            camsdk_(put_HFlip) (src->hCam, src->hflip);
         }
-        g_value_set_string(value, buff);
         break;
-    case PROP_FW_VERSION:
+    case PROP_VFLIP:
+        src->vflip = g_value_get_boolean(value);
         if (src->hCam) {
-            camsdk_(get_FwVersion) (src->hCam, buff);
+            camsdk_(put_VFlip) (src->hCam, src->vflip);
         }
-        g_value_set_string(value, buff);
         break;
-    case PROP_HW_VERSION:
+    case PROP_AUTO_EXPOSURE:
+        src->auto_exposure = g_value_get_boolean(value);
         if (src->hCam) {
-            camsdk_(get_HwVersion) (src->hCam, buff);
+            camsdk_(put_AutoExpoEnable) (src->hCam, src->auto_exposure);
         }
-        g_value_set_string(value, buff);
+        rearm_exposure_settle(src);
         break;
-    case PROP_PRODUCTION_DATE:
+    case PROP_EXPOTIME:
+        src->expotime = g_value_get_int(value);
         if (src->hCam) {
-            camsdk_(get_ProductionDate) (src->hCam, buff);
+            camsdk_(put_ExpoTime) (src->hCam, src->expotime);
         }
-        g_value_set_string(value, buff);
+        rearm_exposure_settle(src);
         break;
-    case PROP_FPGA_VERSION:
+    case PROP_EXPOAGAIN:
+        src->expoagain = g_value_get_int(value);
         if (src->hCam) {
-            camsdk_(get_FpgaVersion) (src->hCam, buff);
+            camsdk_(put_ExpoAGain) (src->hCam, src->expoagain);
         }
-        g_value_set_string(value, buff);
+        rearm_exposure_settle(src);
         break;
-
-#if CAMSDK_VERSION >= 53
-    case PROP_MODEL_NAME:
-    case PROP_MODEL_FLAG:
-    case PROP_MODEL_MAXSPEED:
-    case PROP_MODEL_PREVIEW:
-    case PROP_MODEL_STILL:
-    case PROP_MODEL_MAXFANSPEED:
-    case PROP_MODEL_XPIXSZ:
-    case PROP_MODEL_YPIXSZ:
+    case PROP_HUE:
+        src->hue = g_value_get_int(value);
         if (src->hCam) {
-            //maybe just move to struct?
-            const camsdk(ModelV2) * model =
-                camsdk_(query_Model) (src->hCam);
-            if (model) {
-                switch (property_id) {
-                case PROP_MODEL_NAME:
-                    g_value_set_string(value, model->name);
-                    break;
-                case PROP_MODEL_FLAG:
-                    g_value_set_uint64(value, model->flag);
-                    break;
-                case PROP_MODEL_MAXSPEED:
-                    g_value_set_uint(value, model->maxspeed);
-                    break;
-                case PROP_MODEL_PREVIEW:
-                    g_value_set_uint(value, model->preview);
-                    break;
-                case PROP_MODEL_STILL:
-                    g_value_set_uint(value, model->still);
-                    break;
-                case PROP_MODEL_MAXFANSPEED:
-                    g_value_set_uint(value, model->maxfanspeed);
-                    break;
-                case PROP_MODEL_XPIXSZ:
-                    g_value_set_float(value, model->xpixsz);
-                    break;
-                case PROP_MODEL_YPIXSZ:
-                    g_value_set_float(value, model->ypixsz);
-                    break;
-                }
-            }
+            camsdk_(put_Hue) (src->hCam, src->hue);
         }
         break;
-#endif
-
-    case PROP_REVISION:
+    case PROP_SATURATION:
+        src->saturation = g_value_get_int(value);
         if (src->hCam) {
-            unsigned short ustmp;
-            if (!FAILED(camsdk_(get_Revision) (src->hCam, &ustmp))) {
-                tempi = ustmp;
-            }
+            camsdk_(put_Saturation) (src->hCam, src->saturation);
         }
-        g_value_set_int(value, tempi);
         break;
-
-    case PROP_MAX_BIT_DEPTH:
+    case PROP_BRIGHTNESS:
+        src->brightness = g_value_get_int(value);
         if (src->hCam) {
-            tempi = camsdk_(get_MaxBitDepth) (src->hCam);
+            camsdk_(put_Brightness) (src->hCam, src->brightness);
         }
-        g_value_set_int(value, tempi);
         break;
-
-    case PROP_EXPOSURE_TIME_MIN:
+    case PROP_CONTRAST:
+        src->contrast = g_value_get_int(value);
+        if (src->hCam) {
+            camsdk_(put_Contrast) (src->hCam, src->contrast);
+        }
+        break;
+    case PROP_GAMMA:
+        src->gamma = g_value_get_int(value);
+        if (src->hCam) {
+            camsdk_(put_Gamma) (src->hCam, src->gamma);
+        }
+        break;
+
+    case PROP_BB_R:
+        src->black_balance[0] = g_value_get_int(value);
+        if (src->hCam) {
+            camsdk_(put_BlackBalance) (src->hCam, src->black_balance);
+        }
+        break;
+    case PROP_BB_G:
+        src->black_balance[1] = g_value_get_int(value);
+        if (src->hCam) {
+            camsdk_(put_BlackBalance) (src->hCam, src->black_balance);
+        }
+        break;
+    case PROP_BB_B:
+        src->black_balance[2] = g_value_get_int(value);
+        if (src->hCam) {
+            camsdk_(put_BlackBalance) (src->hCam, src->black_balance);
+        }
+        break;
+
+    case PROP_WB_R:
+        src->white_balance[0] = g_value_get_int(value);
+        if (src->hCam) {
+            camsdk_(put_WhiteBalanceGain) (src->hCam, src->white_balance);
+        }
+        break;
+    case PROP_WB_G:
+        src->white_balance[1] = g_value_get_int(value);
+        if (src->hCam) {
+            camsdk_(put_WhiteBalanceGain) (src->hCam, src->white_balance);
+        }
+        break;
+    case PROP_WB_B:
+        src->white_balance[2] = g_value_get_int(value);
+        if (src->hCam) {
+            camsdk_(put_WhiteBalanceGain) (src->hCam, src->white_balance);
+        }
+        break;
+
+    case PROP_AWB_RGB:
+        if (!(src->awb_rgb || src->awb_tt)) {
+            // fail...
+            if (FAILED(camsdk_(AwbInit) (src->hCam, my_rgb_cb, src))) {
+                GST_ERROR_OBJECT(src, "failed to awb rgb");
+                src->awb_rgb = 0;
+            } else {
+                src->awb_rgb = 1;
+            }
+        }
+        break;
+
+    case PROP_AWB_TT:
+        if (!(src->awb_rgb || src->awb_tt)) {
+            // ok
+            if (FAILED(camsdk_(AwbOnce) (src->hCam, my_tt_cb, src))) {
+                GST_ERROR_OBJECT(src, "failed to awb tt");
+                src->awb_tt = 0;
+            } else {
+                src->awb_tt = 1;
+            }
+        }
+        break;
+
+    case PROP_STACK_FRAMES:
+        // Takes effect on the next output frame
+        src->stack_frames = g_value_get_int(value);
+        break;
+    case PROP_BEST_OF:
+        src->best_of = g_value_get_int(value);
+        break;
+    case PROP_DARK_FILE:
+        set_master_file(src, TOUPCAM_MASTER_DARK,
+                        g_value_get_string(value));
+        break;
+    case PROP_FLAT_FILE:
+        set_master_file(src, TOUPCAM_MASTER_FLAT,
+                        g_value_get_string(value));
+        break;
+    case PROP_DEFECT_DIR:
+        // Only set before start
+        GST_OBJECT_LOCK(src);
+        g_free(src->defect_dir);
+        src->defect_dir = g_value_dup_string(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_DEFECT_SIGMA:
+        GST_OBJECT_LOCK(src);
+        src->defect_sigma = g_value_get_double(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_HOST_CCM:
+        set_host_ccm(src, g_value_get_string(value));
+        break;
+    case PROP_HDR_EXPOSURES:
+        set_hdr_exposures(src, g_value_get_string(value));
+        break;
+    case PROP_QOS:
+        GST_OBJECT_LOCK(src);
+        src->qos = g_value_get_boolean(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_MOTION_DETECT:
+        GST_OBJECT_LOCK(src);
+        src->motion_detect = g_value_get_boolean(value);
+        GST_OBJECT_UNLOCK(src);
+        gst_toupcam_src_rearm_motion(src);
+        break;
+    case PROP_MOTION_TOLERANCE:
+        GST_OBJECT_LOCK(src);
+        src->motion_tolerance = g_value_get_double(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_MOTION_DIFFERENCE:
+        GST_OBJECT_LOCK(src);
+        src->motion_difference = g_value_get_double(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_MOTION_SETTLE_FRAMES:
+        GST_OBJECT_LOCK(src);
+        src->motion_frames = g_value_get_int(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_ENABLE_LAST_SAMPLE:
+        g_mutex_lock(&src->last_lock);
+        src->enable_last_sample = g_value_get_boolean(value);
+        if (!src->enable_last_sample && !src->grab_waiters) {
+            gst_buffer_replace(&src->last_buffer, NULL);
+        }
+        g_mutex_unlock(&src->last_lock);
+        break;
+    case PROP_HOST_WB_R:
+    case PROP_HOST_WB_G:
+    case PROP_HOST_WB_B:
+        GST_OBJECT_LOCK(src);
+        // Don't rebuild the LUTs when a controller sets the same value
+        if (src->host_wb[property_id - PROP_HOST_WB_R] !=
+            g_value_get_double(value)) {
+            src->host_wb[property_id - PROP_HOST_WB_R] =
+                g_value_get_double(value);
+            src->color_dirty = TRUE;
+        }
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_HOST_GAMMA:
+        GST_OBJECT_LOCK(src);
+        if (src->host_gamma != g_value_get_double(value)) {
+            src->host_gamma = g_value_get_double(value);
+            src->color_dirty = TRUE;
+        }
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_CONVERT_THREADS:
+        src->convert_threads = g_value_get_int(value);
+        break;
+    case PROP_TONEMAP_INTERVAL:
+        GST_OBJECT_LOCK(src);
+        src->tonemap_interval = g_value_get_int(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_TONEMAP_LOW:
+        GST_OBJECT_LOCK(src);
+        src->tonemap_low = g_value_get_double(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_TONEMAP_HIGH:
+        GST_OBJECT_LOCK(src);
+        src->tonemap_high = g_value_get_double(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_PREVIEW_FACTOR:
+        GST_OBJECT_LOCK(src);
+        src->preview_factor = g_value_get_int(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_PREVIEW_WIDTH:
+        GST_OBJECT_LOCK(src);
+        src->preview_width = g_value_get_int(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_PREVIEW_MAX_FPS:
+        GST_OBJECT_LOCK(src);
+        src->preview_max_fps = g_value_get_double(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_MEMFD:
+        src->memfd = g_value_get_boolean(value);
+        break;
+    case PROP_PYRAMID_LEVELS:
+        src->pyramid_levels = g_value_get_int(value);
+        break;
+    case PROP_CROP_X:
+        src->crop_x = g_value_get_int(value);
+        break;
+    case PROP_CROP_Y:
+        src->crop_y = g_value_get_int(value);
+        break;
+    case PROP_CROP_WIDTH:
+        src->crop_width = g_value_get_int(value);
+        break;
+    case PROP_CROP_HEIGHT:
+        src->crop_height = g_value_get_int(value);
+        break;
+    case PROP_ROW_ALIGN:
+        src->row_align = g_value_get_int(value);
+        break;
+    case PROP_MEMFD_HUGEPAGES:
+        src->memfd_hugepages = g_value_get_boolean(value);
+        break;
+    case PROP_STATS_INTERVAL:
+        GST_OBJECT_LOCK(src);
+        src->stats_interval = g_value_get_double(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_POST_STATS:
+        GST_OBJECT_LOCK(src);
+        src->post_stats = g_value_get_boolean(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_MAX_FRAMERATE:
+        // Applied by the streaming thread, see update_framerate()
+        GST_OBJECT_LOCK(src);
+        src->maxframerate = g_value_get_double(value);
+        src->framerate_dirty = TRUE;
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_EXPOSURE_SETTLE_TOLERANCE:
+        GST_OBJECT_LOCK(src);
+        src->settle_tolerance = g_value_get_double(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_EXPOSURE_SETTLE_FRAMES:
+        GST_OBJECT_LOCK(src);
+        src->settle_frames = g_value_get_int(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_SETTINGS_LATENCY:
+        GST_OBJECT_LOCK(src);
+        src->settings_latency = g_value_get_int(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_DROP_STALE:
+        GST_OBJECT_LOCK(src);
+        src->drop_stale = g_value_get_boolean(value);
+        GST_OBJECT_UNLOCK(src);
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+        break;
+    }
+
+    if (src->hCam && is_camera_control(property_id)) {
+        settings_changed(src);
+    }
+}
+
+static void try_get_black_balance(GstToupCamSrc * src)
+{
+    if (src->hCam) {
+        camsdk_(get_BlackBalance) (src->hCam, src->black_balance);
+    }
+}
+
+static void try_get_white_balance(GstToupCamSrc * src)
+{
+    if (src->hCam) {
+        camsdk_(get_WhiteBalanceGain) (src->hCam, src->white_balance);
+    }
+}
+
+void gst_toupcam_src_get_property(GObject * object, guint property_id,
+                                  GValue * value, GParamSpec * pspec)
+{
+    GstToupCamSrc *src;
+    char buff[64] = "";
+    int tempi = 0;
+
+    g_return_if_fail(GST_IS_TOUPCAM_SRC(object));
+    src = GST_TOUPCAM_SRC(object);
+
+    switch (property_id) {
+    case PROP_SDK_BRAND:
+        g_value_set_string(value, CAMDSK_BRAND);
+        break;
+    case PROP_SDK_VERSION:
+        g_value_set_string(value, camsdk_(Version) ());
+        break;
+
+    case PROP_SERIAL_NUMBER:
+        if (src->hCam) {
+            camsdk_(get_SerialNumber) (src->hCam, buff);
+        }
+        g_value_set_string(value, buff);
+        break;
+    case PROP_FW_VERSION:
+        if (src->hCam) {
+            camsdk_(get_FwVersion) (src->hCam, buff);
+        }
+        g_value_set_string(value, buff);
+        break;
+    case PROP_HW_VERSION:
+        if (src->hCam) {
+            camsdk_(get_HwVersion) (src->hCam, buff);
+        }
+        g_value_set_string(value, buff);
+        break;
+    case PROP_PRODUCTION_DATE:
+        if (src->hCam) {
+            camsdk_(get_ProductionDate) (src->hCam, buff);
+        }
+        g_value_set_string(value, buff);
+        break;
+    case PROP_FPGA_VERSION:
+        if (src->hCam) {
+            camsdk_(get_FpgaVersion) (src->hCam, buff);
+        }
+        g_value_set_string(value, buff);
+        break;
+
+#if CAMSDK_VERSION >= 53
+    case PROP_MODEL_NAME:
+    case PROP_MODEL_FLAG:
+    case PROP_MODEL_MAXSPEED:
+    case PROP_MODEL_PREVIEW:
+    case PROP_MODEL_STILL:
+    case PROP_MODEL_MAXFANSPEED:
+    case PROP_MODEL_XPIXSZ:
+    case PROP_MODEL_YPIXSZ:
+        if (src->hCam) {
+            //maybe just move to struct?
+            const camsdk(ModelV2) * model =
+                camsdk_(query_Model) (src->hCam);
+            if (model) {
+                switch (property_id) {
+                case PROP_MODEL_NAME:
+                    g_value_set_string(value, model->name);
+                    break;
+                case PROP_MODEL_FLAG:
+                    g_value_set_uint64(value, model->flag);
+                    break;
+                case PROP_MODEL_MAXSPEED:
+                    g_value_set_uint(value, model->maxspeed);
+                    break;
+                case PROP_MODEL_PREVIEW:
+                    g_value_set_uint(value, model->preview);
+                    break;
+                case PROP_MODEL_STILL:
+                    g_value_set_uint(value, model->still);
+                    break;
+                case PROP_MODEL_MAXFANSPEED:
+                    g_value_set_uint(value, model->maxfanspeed);
+                    break;
+                case PROP_MODEL_XPIXSZ:
+                    g_value_set_float(value, model->xpixsz);
+                    break;
+                case PROP_MODEL_YPIXSZ:
+                    g_value_set_float(value, model->ypixsz);
+                    break;
+                }
+            }
+        }
+        break;
+#endif
+
+    case PROP_REVISION:
+        if (src->hCam) {
+            unsigned short ustmp;
+            if (!FAILED(camsdk_(get_Revision) (src->hCam, &ustmp))) {
+                tempi = ustmp;
+            }
+        }
+        g_value_set_int(value, tempi);
+        break;
+
+    case PROP_MAX_BIT_DEPTH:
+        if (src->hCam) {
+            tempi = camsdk_(get_MaxBitDepth) (src->hCam);
+        }
+        g_value_set_int(value, tempi);
+        break;
+
+    case PROP_EXPOSURE_TIME_MIN:
         if (src->hCam) {
             unsigned nMin, nMax, nDef;
             if (!FAILED
@@ -972,677 +2439,2684 @@ void gst_toupcam_src_get_property(GObject * object, guint property_id,
         g_value_set_int(value, src->white_balance[2]);
         break;
 
-    case PROP_AWB_RGB:
-        g_value_set_boolean(value, src->awb_rgb);
-        break;
+    case PROP_AWB_RGB:
+        g_value_set_boolean(value, src->awb_rgb);
+        break;
+
+    case PROP_AWB_TT:
+        g_value_set_boolean(value, src->awb_tt);
+        break;
+
+    case PROP_STACK_FRAMES:
+        g_value_set_int(value, src->stack_frames);
+        break;
+    case PROP_BEST_OF:
+        g_value_set_int(value, src->best_of);
+        break;
+    case PROP_DARK_FILE:
+        GST_OBJECT_LOCK(src);
+        g_value_set_string(value, src->dark_file);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_FLAT_FILE:
+        GST_OBJECT_LOCK(src);
+        g_value_set_string(value, src->flat_file);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_DEFECT_DIR:
+        GST_OBJECT_LOCK(src);
+        g_value_set_string(value, src->defect_dir);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_DEFECT_SIGMA:
+        GST_OBJECT_LOCK(src);
+        g_value_set_double(value, src->defect_sigma);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_DEFECT_COUNT:
+        // Racy read of a size, good enough for status
+        g_value_set_int(value, src->defects ? src->defects->count : 0);
+        break;
+    case PROP_HOST_CCM:
+        GST_OBJECT_LOCK(src);
+        g_value_set_string(value, src->host_ccm_str);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_HOST_WB_R:
+    case PROP_HOST_WB_G:
+    case PROP_HOST_WB_B:
+        GST_OBJECT_LOCK(src);
+        g_value_set_double(value,
+                           src->host_wb[property_id - PROP_HOST_WB_R]);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_HOST_GAMMA:
+        GST_OBJECT_LOCK(src);
+        g_value_set_double(value, src->host_gamma);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_CONVERT_THREADS:
+        g_value_set_int(value, src->convert_threads);
+        break;
+    case PROP_TONEMAP_INTERVAL:
+        GST_OBJECT_LOCK(src);
+        g_value_set_int(value, src->tonemap_interval);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_TONEMAP_LOW:
+        GST_OBJECT_LOCK(src);
+        g_value_set_double(value, src->tonemap_low);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_TONEMAP_HIGH:
+        GST_OBJECT_LOCK(src);
+        g_value_set_double(value, src->tonemap_high);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_PREVIEW_FACTOR:
+        GST_OBJECT_LOCK(src);
+        g_value_set_int(value, src->preview_factor);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_PREVIEW_WIDTH:
+        GST_OBJECT_LOCK(src);
+        g_value_set_int(value, src->preview_width);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_PREVIEW_MAX_FPS:
+        GST_OBJECT_LOCK(src);
+        g_value_set_double(value, src->preview_max_fps);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_MEMFD:
+        g_value_set_boolean(value, src->memfd);
+        break;
+    case PROP_PYRAMID_LEVELS:
+        g_value_set_int(value, src->pyramid_levels);
+        break;
+    case PROP_CROP_X:
+        g_value_set_int(value, src->crop_x);
+        break;
+    case PROP_CROP_Y:
+        g_value_set_int(value, src->crop_y);
+        break;
+    case PROP_CROP_WIDTH:
+        g_value_set_int(value, src->crop_width);
+        break;
+    case PROP_CROP_HEIGHT:
+        g_value_set_int(value, src->crop_height);
+        break;
+    case PROP_ROW_ALIGN:
+        g_value_set_int(value, src->row_align);
+        break;
+    case PROP_MEMFD_HUGEPAGES:
+        g_value_set_boolean(value, src->memfd_hugepages);
+        break;
+    case PROP_DROPPED_FRAMES:
+        g_value_set_int(value, g_atomic_int_get(&src->dropped_frames));
+        break;
+    case PROP_STATS:
+        GST_OBJECT_LOCK(src);
+        g_value_set_boxed(value, src->stats);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_STATS_INTERVAL:
+        GST_OBJECT_LOCK(src);
+        g_value_set_double(value, src->stats_interval);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_POST_STATS:
+        GST_OBJECT_LOCK(src);
+        g_value_set_boolean(value, src->post_stats);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_MAX_FRAMERATE:
+        GST_OBJECT_LOCK(src);
+        g_value_set_double(value, src->maxframerate);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_EXPOSURE_SETTLED:
+        g_value_set_boolean(value,
+                            g_atomic_int_get(&src->exposure_settled));
+        break;
+    case PROP_EXPOSURE_SETTLE_TOLERANCE:
+        GST_OBJECT_LOCK(src);
+        g_value_set_double(value, src->settle_tolerance);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_EXPOSURE_SETTLE_FRAMES:
+        GST_OBJECT_LOCK(src);
+        g_value_set_int(value, src->settle_frames);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_SETTINGS_GENERATION:
+        GST_OBJECT_LOCK(src);
+        g_value_set_uint(value, src->settings_gen);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_SETTINGS_LATENCY:
+        GST_OBJECT_LOCK(src);
+        g_value_set_int(value, src->settings_latency);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_DROP_STALE:
+        GST_OBJECT_LOCK(src);
+        g_value_set_boolean(value, src->drop_stale);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_STALE_FRAMES:
+        g_value_set_int(value, g_atomic_int_get(&src->stale_frames));
+        break;
+    case PROP_HDR_EXPOSURES:
+        GST_OBJECT_LOCK(src);
+        g_value_set_string(value, src->hdr_exposures_str);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_ENABLE_LAST_SAMPLE:
+        g_mutex_lock(&src->last_lock);
+        g_value_set_boolean(value, src->enable_last_sample);
+        g_mutex_unlock(&src->last_lock);
+        break;
+    case PROP_LAST_SAMPLE:
+        g_mutex_lock(&src->last_lock);
+        g_value_take_boxed(value, last_sample_locked(src));
+        g_mutex_unlock(&src->last_lock);
+        break;
+    case PROP_QOS:
+        GST_OBJECT_LOCK(src);
+        g_value_set_boolean(value, src->qos);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_MOTION_DETECT:
+        GST_OBJECT_LOCK(src);
+        g_value_set_boolean(value, src->motion_detect);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_MOTION_TOLERANCE:
+        GST_OBJECT_LOCK(src);
+        g_value_set_double(value, src->motion_tolerance);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_MOTION_DIFFERENCE:
+        GST_OBJECT_LOCK(src);
+        g_value_set_double(value, src->motion_difference);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_MOTION_SETTLE_FRAMES:
+        GST_OBJECT_LOCK(src);
+        g_value_set_int(value, src->motion_frames);
+        GST_OBJECT_UNLOCK(src);
+        break;
+    case PROP_MOTION_SETTLED:
+        g_value_set_boolean(value, g_atomic_int_get(&src->motion_settled));
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+        break;
+    }
+}
+
+void gst_toupcam_src_dispose(GObject * object)
+{
+    GstToupCamSrc *src;
+
+    g_return_if_fail(GST_IS_TOUPCAM_SRC(object));
+    src = GST_TOUPCAM_SRC(object);
+
+    GST_DEBUG_OBJECT(src, "dispose");
+
+    // clean up as possible.  may be called multiple times
+
+    G_OBJECT_CLASS(gst_toupcam_src_parent_class)->dispose(object);
+}
+
+void gst_toupcam_src_finalize(GObject * object)
+{
+    GstToupCamSrc *src;
+
+    g_return_if_fail(GST_IS_TOUPCAM_SRC(object));
+    src = GST_TOUPCAM_SRC(object);
+
+    GST_DEBUG_OBJECT(src, "finalize");
+
+    /* clean up object here */
+    toupcam_master_free(src->dark);
+    toupcam_master_free(src->flat);
+    toupcam_master_free(src->pending_dark);
+    toupcam_master_free(src->pending_flat);
+    g_free(src->dark_file);
+    g_free(src->flat_file);
+    g_free(src->defect_dir);
+    g_free(src->host_ccm_str);
+    g_free(src->hdr_exposures_str);
+    if (src->stats) {
+        gst_structure_free(src->stats);
+    }
+    gst_buffer_replace(&src->last_buffer, NULL);
+    g_mutex_clear(&src->last_lock);
+    g_cond_clear(&src->last_cond);
+
+    G_OBJECT_CLASS(gst_toupcam_src_parent_class)->finalize(object);
+}
+
+static void sdk_callback_PullMode(unsigned nEvent, void *pCallbackCtx)
+{
+    GstToupCamSrc *src = GST_TOUPCAM_SRC(pCallbackCtx);
+    //Note: lots of 1 => EVENT_EXPOSURE
+    GST_DEBUG_OBJECT(src,
+                     "sdk_callback_PullMode(nEvent=%d) begin, want %d",
+                     nEvent, CAMSDK_(EVENT_IMAGE));
+    if (CAMSDK_(EVENT_IMAGE) == nEvent) {
+        gint64 now = g_get_monotonic_time();
+
+        g_mutex_lock(&src->mutex);
+        src->imagesAvailable++;
+        src->image_event_time = now;
+        g_cond_signal(&src->cond);
+        g_mutex_unlock(&src->mutex);
+    } else if (CAMSDK_(EVENT_EXPOSURE) == nEvent) {
+        // Snapshot for frame metadata so we don't query per frame
+        unsigned expotime = 0;
+        unsigned short expoagain = 0;
+
+        camsdk_(get_ExpoTime) (src->hCam, &expotime);
+        camsdk_(get_ExpoAGain) (src->hCam, &expoagain);
+        g_mutex_lock(&src->mutex);
+        src->cur_expotime = expotime;
+        src->cur_expoagain = expoagain;
+        g_mutex_unlock(&src->mutex);
+    }
+    GST_DEBUG_OBJECT(src,
+                     "sdk_callback_PullMode(nEvent=%d) end, images now %u",
+                     nEvent, src->imagesAvailable);
+}
+
+void gst_toupcam_pdebug(GstToupCamSrc * src)
+{
+    int itmp;
+    short stmp;
+    unsigned short ustmp;
+    char buff[64];
+
+    printf("toupcam debug info for Version(): %s\n", camsdk_(Version) ());
+    printf("  SDK_Brand: " CAMDSK_BRAND "\n");
+    printf("  MaxBitDepth(): %d\n", camsdk_(get_MaxBitDepth) (src->hCam));
+    printf("  FanMaxSpeed(): %d\n", camsdk_(get_FanMaxSpeed) (src->hCam));
+    //Max frame rate
+    printf("  MaxSpeed(): %d\n", camsdk_(get_MaxSpeed) (src->hCam));
+    printf("  MonoMode(): %d\n", camsdk_(get_MonoMode) (src->hCam));
+    int resn = camsdk_(get_StillResolutionNumber) (src->hCam);
+    printf("  StillResolutionNumber(): %d\n", resn);
+    if (resn < 0) {
+        printf("    Failed :(\n");
+    } else {
+        for (int resi = 0; resi < resn; ++resi) {
+            printf("    eSize=%d\n", resi);
+            int width, height;
+            if (!FAILED(camsdk_(get_StillResolution)
+                        (src->hCam, resi, &width, &height))) {
+                printf("          StillResolution(): %iw x %ih\n", width,
+                       height);
+            }
+            float pixx, pixy;
+            if (!FAILED
+                (camsdk_(get_PixelSize) (src->hCam, resi, &pixx, &pixy))) {
+                printf("          PixelSize(): %0.1fw x %0.1fh um\n", pixx,
+                       pixy);
+            }
+        }
+    }
+
+    {
+        unsigned nMin, nMax, nDef;
+        if (!FAILED
+            (camsdk_(get_ExpTimeRange) (src->hCam, &nMin, &nMax, &nDef))) {
+            printf("  ExpTimeRange(): min %d, max %d, def %d\n", nMin,
+                   nMax, nDef);
+        }
+    }
+    {
+        unsigned short nMin, nMax, nDef;
+        if (!FAILED
+            (camsdk_(get_ExpoAGainRange) (src->hCam, &nMin, &nMax, &nDef)))
+        {
+            printf("  ExpoAGainRange(): min %d, max %d, def %d\n", nMin,
+                   nMax, nDef);
+        }
+    }
+
+    if (!FAILED(camsdk_(get_Negative) (src->hCam, &itmp))) {
+        printf("  Negative(): %d\n", itmp);
+    }
+    if (!FAILED(camsdk_(get_Chrome) (src->hCam, &itmp))) {
+        printf("  Chrome(): %d\n", itmp);
+    }
+    if (!FAILED(camsdk_(get_HZ) (src->hCam, &itmp))) {
+        printf("  HZ(): %d\n", itmp);
+    }
+    if (!FAILED(camsdk_(get_Mode) (src->hCam, &itmp))) {
+        printf("  Mode(): %d\n", itmp);
+    }
+    if (!FAILED(camsdk_(get_RealTime) (src->hCam, &itmp))) {
+        printf("  RealTime(): %d\n", itmp);
+    }
+
+    if (!FAILED(camsdk_(get_Temperature) (src->hCam, &stmp))) {
+        printf("  Temperature(): %d\n", stmp);
+    }
+    if (!FAILED(camsdk_(get_Revision) (src->hCam, &ustmp))) {
+        printf("  Revision(): %d\n", ustmp);
+    }
+
+    if (!FAILED(camsdk_(get_SerialNumber) (src->hCam, buff))) {
+        printf("  SerialNumber(): %s\n", buff);
+    }
+    if (!FAILED(camsdk_(get_FwVersion) (src->hCam, buff))) {
+        printf("  FwVersion(): %s\n", buff);
+    }
+    if (!FAILED(camsdk_(get_HwVersion) (src->hCam, buff))) {
+        printf("  HwVersion(): %s\n", buff);
+    }
+    if (!FAILED(camsdk_(get_ProductionDate) (src->hCam, buff))) {
+        printf("  ProductionDate(): %s\n", buff);
+    }
+    if (!FAILED(camsdk_(get_FpgaVersion) (src->hCam, buff))) {
+        printf("  FpgaVersion(): %s\n", buff);
+    }
+
+    //Not supported in version 50
+#if CAMSDK_VERSION >= 53
+    const camsdk(ModelV2) * model = camsdk_(query_Model) (src->hCam);
+    if (model) {
+        printf("  ToupcamModelV2():\n");
+        printf("    name: %s\n", model->name);
+        printf("    flag: 0x%08llX\n", model->flag);
+        printf("    maxspeed: %u\n", model->maxspeed);
+        printf("    preview: %u\n", model->preview);
+        printf("    still: %u\n", model->still);
+    }
+#endif
+
+    /*
+       if (!FAILED(camsdk_(get_Name)(id, buff))) {
+       printf("  name: %s\n", buff);
+       }
+     */
+    // 0 => #define TOUPCAM_PIXELFORMAT_RAW8             0x00
+    camsdk_(get_Option) (src->hCam, CAMSDK_(OPTION_PIXEL_FORMAT), &itmp);
+    printf("  Option(PIXEL_FORMAT): %i\n", itmp);
+
+    char nFourCC[4];
+    unsigned bitsperpixel;
+    camsdk_(get_RawFormat) (src->hCam, (unsigned *) &nFourCC,
+                            &bitsperpixel);
+    // raw code GBRG, bpp 8
+    // needs this to get the full 12 bit
+    // camsdk_(put_Option)(src->hCam, CAMSDK_(OPTION_PIXEL_FORMAT),
+    // CAMSDK_(PIXELFORMAT_RAW12)); raw code GBRG, bpp 12
+    printf("    RawFormat(): FourCC %c%c%c%c, BitsPerPixel %u\n",
+           nFourCC[0], nFourCC[1], nFourCC[2], nFourCC[3], bitsperpixel);
+}
+
+
+// Defect maps are per sensor (serial number) and esize
+static gchar *defect_map_path(GstToupCamSrc * src)
+{
+    char serial[64] = "";
+    gchar *base;
+    gchar *path = NULL;
+
+    if (FAILED(camsdk_(get_SerialNumber) (src->hCam, serial))) {
+        return NULL;
+    }
+    base = g_strdup_printf("%s-esize%d.defects", serial, src->esize);
+    GST_OBJECT_LOCK(src);
+    if (src->defect_dir && src->defect_dir[0]) {
+        path = g_build_filename(src->defect_dir, base, NULL);
+    }
+    GST_OBJECT_UNLOCK(src);
+    g_free(base);
+    return path;
+}
+
+static void load_defect_map(GstToupCamSrc * src)
+{
+    gchar *path = defect_map_path(src);
+
+    toupcam_defect_map_free(src->defects);
+    src->defects = NULL;
+    if (!path) {
+        return;
+    }
+    src->defects = toupcam_defect_map_load(path);
+    if (src->defects) {
+        GST_INFO_OBJECT(src, "loaded %" G_GSIZE_FORMAT " defects from %s",
+                        src->defects->count, path);
+    } else {
+        GST_INFO_OBJECT(src, "no defect map at %s", path);
+    }
+    g_free(path);
+}
+
+// Write out spans queued by the streaming thread
+static void span_drain(GstToupCamSrc * src)
+{
+    ToupcamSpan s;
+
+    while (toupcam_span_ring_pop(src->span_ring, &s)) {
+        fprintf(src->span_file,
+                "%u,%" G_GINT64_FORMAT ",%" G_GINT64_FORMAT ",%"
+                G_GINT64_FORMAT ",%" G_GINT64_FORMAT ",%" G_GINT64_FORMAT
+                ",%" G_GINT64_FORMAT ",%" G_GINT64_FORMAT "\n", s.seq,
+                s.callback, s.wake, s.pull_start, s.pull_end,
+                s.convert_end, s.push,
+                s.callback ? s.push - s.callback : 0);
+    }
+}
+
+// File I/O stays off the streaming thread
+static gpointer span_thread_func(gpointer data)
+{
+    GstToupCamSrc *src = data;
+
+    while (g_atomic_int_get(&src->span_running)) {
+        g_usleep(G_USEC_PER_SEC / 10);
+        span_drain(src);
+    }
+    span_drain(src);
+    return NULL;
+}
+
+static void span_dump_start(GstToupCamSrc * src)
+{
+    const gchar *fn = g_getenv("GST_TOUPCAMSRC_TRACE");
+
+    if (!fn || !fn[0]) {
+        return;
+    }
+    src->span_file = fopen(fn, "w");
+    if (!src->span_file) {
+        GST_WARNING_OBJECT(src, "failed to open %s: %s", fn,
+                           g_strerror(errno));
+        return;
+    }
+    fprintf(src->span_file, "seq,callback_us,wake_us,pull_start_us,"
+            "pull_end_us,convert_end_us,push_us,callback_to_push_us\n");
+    src->span_ring = toupcam_span_ring_new();
+    g_atomic_int_set(&src->span_running, 1);
+    src->span_thread = g_thread_new("toupcamsrc-trace", span_thread_func,
+                                    src);
+    GST_INFO_OBJECT(src, "writing frame timing spans to %s", fn);
+}
+
+static void span_dump_stop(GstToupCamSrc * src)
+{
+    if (!src->span_thread) {
+        return;
+    }
+    g_atomic_int_set(&src->span_running, 0);
+    g_thread_join(src->span_thread);
+    src->span_thread = NULL;
+    if (src->span_ring->lost) {
+        GST_WARNING_OBJECT(src, "%u frame spans lost, trace writer fell "
+                           "behind", src->span_ring->lost);
+    }
+    fclose(src->span_file);
+    src->span_file = NULL;
+    toupcam_span_ring_free(src->span_ring);
+    src->span_ring = NULL;
+}
+
+// Start a new statistics window
+static void stats_reset(GstToupCamSrc * src, gint64 now)
+{
+    src->stats_start = now;
+    src->stats_frames = 0;
+    g_mutex_lock(&src->mutex);
+    src->stats_images = src->imagesAvailable;
+    g_mutex_unlock(&src->mutex);
+    src->stats_bytes = 0;
+    src->stats_queue_max = 0;
+    toupcam_time_hist_reset(&src->stats_wait);
+    toupcam_time_hist_reset(&src->stats_pull);
+    toupcam_time_hist_reset(&src->stats_convert);
+    toupcam_time_hist_reset(&src->stats_push);
+}
+
+// Limit the camera itself to limit fps (0 => no limit) so fewer frames cross
+// the bus: the precise (0.1 fps) limit if the camera has one, else the whole
+// fps one, else a lower USB speed level
+static void apply_max_framerate(GstToupCamSrc * src, gdouble limit)
+{
+    int max10;
+    int val;
+    HRESULT hr;
+
+    src->camera_framerate = 0.0;
+    src->readout_us = 0;
+    hr = camsdk_(get_Option) (src->hCam,
+                              CAMSDK_(OPTION_MAX_PRECISE_FRAMERATE), &max10);
+    if (SUCCEEDED(hr) && max10 > 0) {
+        // At the maximum rate reading out the sensor takes the whole frame
+        src->readout_us = 10 * G_USEC_PER_SEC / max10;
+        // The maximum means no limit
+        val = max10;
+        if (limit > 0.0) {
+            val = CLAMP((int) (limit * 10.0 + 0.5), 1, max10);
+        }
+        hr = camsdk_(put_Option) (src->hCam,
+                                  CAMSDK_(OPTION_PRECISE_FRAMERATE), val);
+        if (SUCCEEDED(hr)) {
+            src->camera_framerate = val / 10.0;
+            GST_INFO_OBJECT(src, "Precise frame rate %0.1f, max %0.1f",
+                            val / 10.0, max10 / 10.0);
+            return;
+        }
+    }
+
+    val = limit > 0.0 ? CLAMP((int) (limit + 0.5), 1, 63) : 0;
+    hr = camsdk_(put_Option) (src->hCam, CAMSDK_(OPTION_FRAMERATE), val);
+    if (SUCCEEDED(hr)) {
+        src->camera_framerate = val;
+        GST_INFO_OBJECT(src, "Frame rate limit %d", val);
+        return;
+    }
+
+    // Speed level to frame rate isn't linear, scale from the measured rate
+    // and accept an approximate result
+    unsigned maxspeed = camsdk_(get_MaxSpeed) (src->hCam);
+    unsigned short speed;
+    unsigned nFrame, nTime, nTotalFrame;
+
+    if (maxspeed == 0
+        || FAILED(camsdk_(get_Speed) (src->hCam, &speed))) {
+        if (limit > 0.0) {
+            GST_WARNING_OBJECT(src, "Camera can't limit its frame rate");
+        }
+        return;
+    }
+    if (limit <= 0.0) {
+        speed = maxspeed;
+    } else if (SUCCEEDED(camsdk_(get_FrameRate) (src->hCam, &nFrame,
+                                                  &nTime, &nTotalFrame))
+               && nFrame > 0 && nTime > 0) {
+        gdouble measured = nFrame * 1000.0 / nTime;
+        speed = CLAMP((int) ceil((speed + 1) * limit / measured) - 1, 0,
+                      (int) maxspeed);
+    } else {
+        GST_WARNING_OBJECT(src, "No frame rate measured yet, keeping speed "
+                           "level %u", speed);
+        return;
+    }
+    camsdk_(put_Speed) (src->hCam, speed);
+    GST_INFO_OBJECT(src, "Speed level %u / %u", speed, maxspeed);
+}
+
+// Nominal frame rate: the camera limit, slower if the exposure is longer
+// than a frame. 0 => unknown
+static gdouble nominal_framerate(GstToupCamSrc * src, unsigned expotime)
+{
+    gdouble fps = src->camera_framerate;
+
+    if (fps <= 0.0) {
+        return 0.0;
+    }
+    if (src->hdr_count) {
+        // Bracketing: the whole bracket's exposures make one frame
+        gint64 bracket = 0;
+        for (gint i = 0; i < src->hdr_count; ++i) {
+            bracket += MAX((gint64) (G_USEC_PER_SEC / fps),
+                           src->hdr_expotime[i]);
+        }
+        fps = (gdouble) G_USEC_PER_SEC / bracket;
+    } else if (expotime > 0) {
+        fps = MIN(fps, (gdouble) G_USEC_PER_SEC / expotime);
+    }
+    // 0.1 fps keeps the caps fraction readable
+    return MAX(floor(fps * 10.0 + 0.5) / 10.0, 0.1);
+}
+
+// Apply a new max-framerate and track the nominal rate, renegotiating caps
+// when it moves. Streaming thread
+static void update_framerate(GstToupCamSrc * src)
+{
+    gboolean dirty;
+    gdouble limit;
+    gdouble fps;
+    unsigned expotime;
+
+    GST_OBJECT_LOCK(src);
+    dirty = src->framerate_dirty;
+    src->framerate_dirty = FALSE;
+    limit = src->maxframerate;
+    GST_OBJECT_UNLOCK(src);
+    if (dirty) {
+        apply_max_framerate(src, limit);
+    }
+
+    g_mutex_lock(&src->mutex);
+    expotime = src->cur_expotime;
+    g_mutex_unlock(&src->mutex);
+    fps = nominal_framerate(src, expotime);
+    // Auto exposure moves in small steps, ignore jitter under 1%
+    if (fabs(fps - src->framerate) <= src->framerate * 0.01) {
+        return;
+    }
+    GST_INFO_OBJECT(src, "Nominal frame rate %0.1f => %0.1f",
+                    src->framerate, fps);
+    GST_OBJECT_LOCK(src);
+    src->framerate = fps;
+    GST_OBJECT_UNLOCK(src);
+    src->duration = fps > 0.0 ? (GstClockTime) (GST_SECOND / fps)
+        : GST_CLOCK_TIME_NONE;
+    // basesrc renegotiates before the next buffer
+    gst_pad_mark_reconfigure(GST_BASE_SRC_PAD(src));
+}
+
+static gboolean gst_toupcam_src_start(GstBaseSrc * bsrc)
+{
+    camsdk(DeviceV2) arr[CAMSDK_(MAX)];
+
+    unsigned cnt = 0;
+    char at_id[128];
+
+    // Start will open the device but not start it, set_caps starts it, stop
+    // should stop and close it (as v4l2src)
+
+    GstToupCamSrc *src = GST_TOUPCAM_SRC(bsrc);
+
+    GST_DEBUG_OBJECT(src, "gst_toupcam_src_start(): begin");
+
+    // Turn on automatic timestamping, if so we do not need to do it manually, BUT
+    // there is some evidence that automatic timestamping is laggy
+    //    gst_base_src_set_do_timestamp(bsrc, TRUE);
+
+    // read libversion (for informational purposes only)
+    GST_INFO_OBJECT(src, "ToupCam Library Ver %s", camsdk_(Version) ());
+
+    // enumerate devices (needed to get device id in order to prepend with "@" to
+    // enable RGB gain functions)
+    cnt = camsdk_(EnumV2) (arr);
+    GST_INFO_OBJECT(src, "Found %d devices", cnt);
+    if (cnt < 1) {
+        GST_ERROR_OBJECT(src, "No ToupCam devices found");
+        goto fail;
+    }
+
+    GST_DEBUG_OBJECT(src, "Toupcam_Open()");
+    // open first usable device id preprended with "@"
+    snprintf(at_id, sizeof(at_id), "@%s", arr[0].id);
+    src->hCam = camsdk_(Open) (at_id);
+    if (NULL == src->hCam) {
+        GST_ERROR_OBJECT(src, "open failed");
+        goto fail;
+    }
+
+    if (getenv("GST_TOUPCAMSRC_INFO")) {
+        gst_toupcam_pdebug(src);
+    }
+
+    HRESULT hr;
+
+    hr = camsdk_(put_eSize) (src->hCam, src->esize);
+    if (FAILED(hr)) {
+        GST_ERROR_OBJECT(src, "failed to set size, hr = %08x", hr);
+        goto fail;
+    }
+    hr = camsdk_(get_Size) (src->hCam, &src->nWidth, &src->nHeight);
+    if (FAILED(hr)) {
+        GST_ERROR_OBJECT(src, "failed to get size, hr = %08x", hr);
+        goto fail;
+    }
+
+    load_defect_map(src);
+
+    toupcam_workers_free(src->workers);
+    src->workers = toupcam_workers_new(src->convert_threads);
+    src->tonemap_frames = 0;
+    src->tonemap_black = 0;
+    src->tonemap_white = 4095;
+    src->tonemap_dirty = TRUE;
+    // Pads lose their sticky events when deactivated
+    src->preview_started = FALSE;
+    src->preview_cur_factor = 0;
+    src->preview_last = 0;
+    GST_DEBUG_OBJECT(src, "converting with %d threads",
+                     toupcam_workers_count(src->workers));
+
+    if (src->raw) {
+        // can set raw8 and raw12, but not raw16
+        // default raw8
+        GST_DEBUG_OBJECT(src, "setup image mode: raw");
+        if (1) {
+            hr = camsdk_(put_Option) (src->hCam,
+                                      CAMSDK_(OPTION_PIXEL_FORMAT),
+                                      CAMSDK_(PIXELFORMAT_RAW12));
+            if (FAILED(hr)) {
+                GST_ERROR_OBJECT(src,
+                                 "failed to set pixel format, hr = %08x",
+                                 hr);
+                goto fail;
+            }
+        }
+        // no output when this is enabled...why?
+        if (1) {
+            // enable raw
+            hr = camsdk_(put_Option) (src->hCam, CAMSDK_(OPTION_RAW), 1);
+            if (FAILED(hr)) {
+                GST_ERROR_OBJECT(src, "failed to enable raw, hr = %08x",
+                                 hr);
+                goto fail;
+            }
+        }
+        if (1) {
+            // 16 bit output
+            hr = camsdk_(put_Option) (src->hCam, CAMSDK_(OPTION_BITDEPTH),
+                                      1);
+            if (FAILED(hr)) {
+                GST_ERROR_OBJECT(src, "failed to enable 16 bit, hr = %08x",
+                                 hr);
+                goto fail;
+            }
+        }
+    } else if (src->x16) {
+        // can set raw8 and raw12, but not raw16
+        // default raw8
+        GST_DEBUG_OBJECT(src, "setup image mode: x16");
+
+        // 16 bit output
+        hr = camsdk_(put_Option) (src->hCam, CAMSDK_(OPTION_BITDEPTH), 1);
+        if (FAILED(hr)) {
+            GST_ERROR_OBJECT(src, "failed to enable 16 bit, hr = %08x",
+                             hr);
+            goto fail;
+        }
+
+        // RGB48
+        hr = camsdk_(put_Option) (src->hCam, CAMSDK_(OPTION_RGB), 1);
+        if (FAILED(hr)) {
+            GST_ERROR_OBJECT(src, "failed to enable raw, hr = %08x", hr);
+            goto fail;
+        }
+    } else {
+        GST_DEBUG_OBJECT(src, "setup image mode: regular");
+        camsdk_(put_Option) (src->hCam, CAMSDK_(OPTION_BYTEORDER),
+                             GST_TOUPCAM_OPTION_BYTEORDER_RGB);
+        camsdk_(put_Hue) (src->hCam, src->hue);
+        camsdk_(put_Saturation) (src->hCam, src->saturation);
+        camsdk_(put_Brightness) (src->hCam, src->brightness);
+        camsdk_(put_Contrast) (src->hCam, src->contrast);
+        camsdk_(put_Gamma) (src->hCam, src->gamma);
+    }
+
+    camsdk_(put_HFlip) (src->hCam, src->hflip);
+    camsdk_(put_VFlip) (src->hCam, src->vflip);
+    hr = camsdk_(put_AutoExpoEnable) (src->hCam, src->auto_exposure);
+    if (FAILED(hr)) {
+        GST_ERROR_OBJECT(src, "failed to auto exposure, hr = %08x", hr);
+        goto fail;
+    }
+    if (!src->auto_exposure) {
+        // setting this severely interferes with auto exposure
+        camsdk_(put_ExpoTime) (src->hCam, src->expotime);
+    }
+
+    // BGR 24-bit is primarily supported
+    // Some attempts at 16 bit
+    if (src->x16to8) {
+        src->bits_per_pix_out = 24;
+        src->bytes_per_pix_out = 3;
+        src->bytes_per_pix_in = 6;
+    } else if (src->raw || src->x16) {
+        src->bits_per_pix_out = 64;
+        src->bytes_per_pix_out = 8;
+        src->bytes_per_pix_in = 6;
+    } else {
+        src->bits_per_pix_out = 24;
+        src->bytes_per_pix_out = 3;
+        src->bytes_per_pix_in = 3;
+    }
+
+    src->image_bytes_in =
+        src->nWidth * src->nHeight * src->bytes_per_pix_in;
+    // Until downstream says otherwise in the allocation query
+    src->crop_meta = FALSE;
+    src->video_meta = FALSE;
+    crop_window(src);
+    output_layout(src);
+    // GST_DEBUG_OBJECT (src, "Image is %d x %d, pitch %d, bpp %d, Bpp %d",
+    // src->nWidth, src->nHeight, src->bits_per_pix_out, src->bytes_per_pix_out);
+    GST_DEBUG_OBJECT(src,
+                     "Image %d w x %d h, in %d bytes / pix => %d bytes (%0.1f "
+                     "MB), out %d bytes / pix => %d bytes (%0.1f MB)",
+                     src->nWidth, src->nHeight, src->bytes_per_pix_in,
+                     src->image_bytes_in, src->image_bytes_in / 1e6,
+                     src->bytes_per_pix_out, src->image_bytes_out,
+                     src->image_bytes_out / 1e6);
+
+    // Allocated on first use as x8 without post processing pulls directly
+    // into the output buffer
+    src->frame_buff = NULL;
+    src->stack_acc = NULL;
+    src->best_buff = NULL;
+
+    camsdk_(get_ExpoTime) (src->hCam, &src->cur_expotime);
+    camsdk_(get_ExpoAGain) (src->hCam, &src->cur_expoagain);
+    if (FAILED(camsdk_(get_Roi) (src->hCam, &src->roi[0], &src->roi[1],
+                                 &src->roi[2], &src->roi[3]))) {
+        src->roi[0] = 0;
+        src->roi[1] = 0;
+        src->roi[2] = src->nWidth;
+        src->roi[3] = src->nHeight;
+    }
+    GST_OBJECT_LOCK(src);
+    src->framerate = 0.0;
+    src->framerate_dirty = TRUE;
+    GST_OBJECT_UNLOCK(src);
+    src->duration = GST_CLOCK_TIME_NONE;
+    update_framerate(src);
+    src->have_seq = FALSE;
+    src->seq_dropped = 0;
+    g_atomic_int_set(&src->dropped_frames, 0);
+    src->stats_fill_end = 0;
+    stats_reset(src, g_get_monotonic_time());
+    span_dump_stop(src);
+    span_dump_start(src);
+    rearm_exposure_settle(src);
+    gst_toupcam_src_rearm_motion(src);
+    GST_OBJECT_LOCK(src);
+    src->settings_gen = 0;
+    src->gen_time[0] = 0;
+    src->hdr_dirty = TRUE;
+    GST_OBJECT_UNLOCK(src);
+    src->hdr_count = 0;
+    src->have_clock_offset = FALSE;
+    src->frame_gen = 0;
+    src->frame_stale = FALSE;
+    g_atomic_int_set(&src->stale_frames, 0);
+    g_mutex_lock(&src->last_lock);
+    src->last_flushing = FALSE;
+    g_mutex_unlock(&src->last_lock);
+    GST_OBJECT_LOCK(src);
+    src->qos_event_time = 0;
+    GST_OBJECT_UNLOCK(src);
+    src->qos_level = QOS_FULL;
+    src->qos_changed = 0;
+    src->qos_late_time = 0;
+    src->qos_degrades = 0;
+    src->qos_restores = 0;
+    src->qos_processed = 0;
+    src->qos_dropped = 0;
+    GST_OBJECT_LOCK(src);
+    if (src->stats) {
+        gst_structure_free(src->stats);
+        src->stats = NULL;
+    }
+    GST_OBJECT_UNLOCK(src);
+
+    hr = camsdk_(StartPullModeWithCallback) (src->hCam,
+                                             sdk_callback_PullMode, src);
+    if (FAILED(hr)) {
+        GST_ERROR_OBJECT(src, "failed to start camera, hr = %08x", hr);
+        goto fail;
+    }
+
+
+    GST_DEBUG_OBJECT(src, "gst_toupcam_src_start(): ok");
+    return TRUE;
+
+  fail:
+    if (src->hCam) {
+        src->hCam = NULL;
+    }
+
+    return FALSE;
+}
+
+static gboolean gst_toupcam_src_stop(GstBaseSrc * bsrc)
+{
+    // Start will open the device but not start it, set_caps starts it, stop
+    // should stop and close it (as v4l2src)
+
+    GstToupCamSrc *src = GST_TOUPCAM_SRC(bsrc);
+
+    GST_DEBUG_OBJECT(src, "gst_toupcam_src_stop()");
+    camsdk_(Close) (src->hCam);
+
+    // Release waiting grabs, the last buffer may belong to our pool
+    g_mutex_lock(&src->last_lock);
+    src->last_flushing = TRUE;
+    gst_buffer_replace(&src->last_buffer, NULL);
+    g_cond_broadcast(&src->last_cond);
+    g_mutex_unlock(&src->last_lock);
+
+    g_free(src->frame_buff);
+    src->frame_buff = NULL;
+    g_free(src->stack_acc);
+    src->stack_acc = NULL;
+    g_free(src->best_buff);
+    src->best_buff = NULL;
+    g_free(src->hdr_frames);
+    src->hdr_frames = NULL;
+    g_free(src->hdr_curve);
+    src->hdr_curve = NULL;
+    g_free(src->motion_prev);
+    src->motion_prev = NULL;
+    g_free(src->motion_cur);
+    src->motion_cur = NULL;
+    src->motion_width = 0;
+    g_free(src->capture_acc);
+    src->capture_acc = NULL;
+    src->capture_kind = TOUPCAM_MASTER_NONE;
+    toupcam_defect_map_free(src->defects);
+    src->defects = NULL;
+    toupcam_workers_free(src->workers);
+    src->workers = NULL;
+    g_free(src->color);
+    src->color = NULL;
+    src->color_dirty = TRUE;
+    g_free(src->tonemap);
+    src->tonemap = NULL;
+    g_free(src->tonemap_hist);
+    src->tonemap_hist = NULL;
+
+    span_dump_stop(src);
+    gst_toupcam_src_reset(src);
+
+    return TRUE;
+}
+
+static GstCaps *gst_toupcam_src_get_caps(GstBaseSrc * bsrc,
+                                         GstCaps * filter)
+{
+    GstToupCamSrc *src = GST_TOUPCAM_SRC(bsrc);
+    GstCaps *caps;
+
+    if (src->hCam == 0) {
+        caps = gst_pad_get_pad_template_caps(GST_BASE_SRC_PAD(src));
+    } else {
+        GstVideoInfo vinfo;
+
+        // Create video info
+        gst_video_info_init(&vinfo);
+
+        vinfo.width = src->crop[2];
+        vinfo.height = src->crop[3];
+
+        // Frames per second fraction n/d, 0/1 indicates a frame rate may vary
+        GST_OBJECT_LOCK(src);
+        gdouble framerate = src->framerate;
+        GST_OBJECT_UNLOCK(src);
+        if (framerate > 0.0) {
+            gst_util_double_to_fraction(framerate, &vinfo.fps_n,
+                                        &vinfo.fps_d);
+        } else {
+            vinfo.fps_n = 0;
+            vinfo.fps_d = 1;
+        }
+        vinfo.interlace_mode = GST_VIDEO_INTERLACE_MODE_PROGRESSIVE;
+
+        if ((src->raw || src->x16) && !src->x16to8) {
+            vinfo.finfo =
+                gst_video_format_get_info(GST_VIDEO_FORMAT_ARGB64);
+        } else {
+            vinfo.finfo = gst_video_format_get_info(GST_VIDEO_FORMAT_RGB);
+        }
+
+        caps = gst_video_info_to_caps(&vinfo);
+    }
+
+    //this func is called a lot and spams the output
+    //GST_INFO_OBJECT(src, "The caps are %" GST_PTR_FORMAT, caps);
+
+    if (filter) {
+        GstCaps *tmp = gst_caps_intersect(caps, filter);
+        gst_caps_unref(caps);
+        caps = tmp;
+
+        GST_INFO_OBJECT(src,
+                        "The caps after filtering are %" GST_PTR_FORMAT,
+                        caps);
+    }
+
+    return caps;
+}
+
+static gboolean gst_toupcam_src_set_caps(GstBaseSrc * bsrc, GstCaps * caps)
+{
+    // Start will open the device but not start it, set_caps starts it, stop
+    // should stop and close it (as v4l2src)
+
+    GstToupCamSrc *src = GST_TOUPCAM_SRC(bsrc);
+    GstVideoInfo vinfo;
+    // GstStructure *s = gst_caps_get_structure (caps, 0);
+
+    GST_INFO_OBJECT(src, "The caps being set are %" GST_PTR_FORMAT, caps);
+
+    gst_video_info_from_caps(&vinfo, caps);
+
+    if (GST_VIDEO_INFO_FORMAT(&vinfo) != GST_VIDEO_FORMAT_UNKNOWN) {
+        g_assert(src->hCam != 0);
+        //  src->vrm_stride = get_pitch (src->device);  // wait for image to arrive
+        //  for this
+        // Buffer layout is decided with downstream, see output_layout()
+    } else {
+        goto unsupported_caps;
+    }
+
+    return TRUE;
+
+  unsupported_caps:
+    GST_ERROR_OBJECT(src, "Unsupported caps: %" GST_PTR_FORMAT, caps);
+    return FALSE;
+}
+
+// Account the time since t0 to a wait / pull histogram, returns now
+static gint64 stats_add_io(GstToupCamSrc * src, ToupcamTimeHist * h,
+                           gint64 t0)
+{
+    gint64 now = g_get_monotonic_time();
 
-    case PROP_AWB_TT:
-        g_value_set_boolean(value, src->awb_tt);
-        break;
+    toupcam_time_hist_add(h, now - t0);
+    src->stats_io += now - t0;
+    return now;
+}
 
-    default:
-        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
-        break;
+static GstFlowReturn wait_new_frame(GstToupCamSrc * src)
+{
+    gint64 t0 = g_get_monotonic_time();
+    //printf("Waiting for new frame...\n");
+    // Wait for the next image to be ready
+    int timeout = 5;
+    while (src->imagesAvailable <= src->imagesPulled) {
+        gint64 end_time;
+        g_mutex_lock(&src->mutex);
+        end_time = g_get_monotonic_time() + G_TIME_SPAN_SECOND;
+        if (!g_cond_wait_until(&src->cond, &src->mutex, end_time)) {
+            GST_DEBUG_OBJECT(src,
+                             "timed out waiting for image, timeout=%u",
+                             timeout);
+            src->total_timeouts++;
+            // timeout has passed.
+            // g_mutex_unlock (&src->mutex); // return here if needed
+            // return NULL;
+        }
+        g_mutex_unlock(&src->mutex);
+        timeout--;
+        if (timeout <= 0) {
+            // did not return an image. why?
+            // ----------------------------------------------------------
+            GST_ERROR_OBJECT(src, "WaitEvent timed out.");
+            return GST_FLOW_ERROR;
+        }
+    }
+    gint64 now = stats_add_io(src, &src->stats_wait, t0);
+    // Stacking / best of N wait several times per output frame
+    if (!src->span.wake) {
+        src->span.wake = now;
+        g_mutex_lock(&src->mutex);
+        src->span.callback = src->image_event_time;
+        g_mutex_unlock(&src->mutex);
     }
+    return GST_FLOW_OK;
 }
 
-void gst_toupcam_src_dispose(GObject * object)
+// Count frames the SDK sequence numbers say we never saw
+static void check_sequence(GstToupCamSrc * src,
+                           const camsdk(FrameInfoV2) * info)
 {
-    GstToupCamSrc *src;
-
-    g_return_if_fail(GST_IS_TOUPCAM_SRC(object));
-    src = GST_TOUPCAM_SRC(object);
+    if (!(info->flag & CAMSDK_(FRAMEINFO_FLAG_SEQ))) {
+        return;
+    }
+    // Going backwards => camera restarted, just resync
+    if (src->have_seq && info->seq > src->last_seq + 1) {
+        guint gap = info->seq - src->last_seq - 1;
+
+        GST_WARNING_OBJECT(src, "%u frames dropped before seq %u", gap,
+                           info->seq);
+        src->seq_dropped += gap;
+        g_atomic_int_add(&src->dropped_frames, gap);
+    }
+    src->have_seq = TRUE;
+    src->last_seq = info->seq;
+}
 
-    GST_DEBUG_OBJECT(src, "dispose");
+// Host time the frame's exposure started, erring early so a frame is never
+// credited with settings written after it started
+static gint64 exposure_start(GstToupCamSrc * src,
+                             const camsdk(FrameInfoV2) * info,
+                             unsigned expotime)
+{
+    gint64 end;
+
+    g_mutex_lock(&src->mutex);
+    end = src->image_event_time;
+    g_mutex_unlock(&src->mutex);
+    if (info->flag & CAMSDK_(FRAMEINFO_FLAG_TIMESTAMP)) {
+        // Map the device clock onto ours using the fastest delivery seen,
+        // creeping up so clock drift can't wedge it
+        gint64 offset = end - (gint64) info->timestamp;
+        if (!src->have_clock_offset || offset < src->clock_offset) {
+            src->clock_offset = offset;
+            src->have_clock_offset = TRUE;
+        } else {
+            src->clock_offset++;
+        }
+        end = (gint64) info->timestamp + src->clock_offset;
+    }
+    return end - expotime - src->readout_us;
+}
 
-    // clean up as possible.  may be called multiple times
+// Newest settings generation written before the frame started exposing
+static void resolve_generation(GstToupCamSrc * src, gint64 start)
+{
+    guint gen;
+    guint oldest;
+
+    GST_OBJECT_LOCK(src);
+    gen = src->settings_gen;
+    oldest = gen >= TOUPCAM_GEN_HISTORY ? gen - TOUPCAM_GEN_HISTORY + 1 : 0;
+    while (gen > oldest
+           && src->gen_time[gen % TOUPCAM_GEN_HISTORY] +
+           src->settings_latency > start) {
+        gen--;
+    }
+    src->frame_stale = gen < src->settings_gen;
+    GST_OBJECT_UNLOCK(src);
+    // Never go backwards if the estimate jitters
+    src->frame_gen = MAX(src->frame_gen, gen);
+}
 
-    G_OBJECT_CLASS(gst_toupcam_src_parent_class)->dispose(object);
+static void add_frame_meta(GstToupCamSrc * src, GstBuffer * buf,
+                           const camsdk(FrameInfoV2) * info)
+{
+    GstToupCamFrameMeta *meta = gst_buffer_add_toupcam_frame_meta(buf);
+
+    meta->seq = info->seq;
+    meta->timestamp = info->timestamp;
+    meta->flags = info->flag;
+    g_mutex_lock(&src->mutex);
+    meta->expotime = src->cur_expotime;
+    meta->expoagain = src->cur_expoagain;
+    g_mutex_unlock(&src->mutex);
+    meta->esize = src->esize;
+    meta->roi_x = src->roi[0];
+    meta->roi_y = src->roi[1];
+    meta->roi_width = src->roi[2];
+    meta->roi_height = src->roi[3];
+    meta->dropped = src->seq_dropped;
+    src->seq_dropped = 0;
+    // Resolved when the frame was pulled, see pull_decode_frame()
+    meta->generation = src->frame_gen;
+    meta->stale = src->frame_stale;
 }
 
-void gst_toupcam_src_finalize(GObject * object)
+// Start looking for a new settled exposure, ex after the application changed
+// the exposure settings. Any thread
+static void rearm_exposure_settle(GstToupCamSrc * src)
 {
-    GstToupCamSrc *src;
+    GST_OBJECT_LOCK(src);
+    src->settle_rearm = TRUE;
+    GST_OBJECT_UNLOCK(src);
+    g_atomic_int_set(&src->exposure_settled, 0);
+}
 
-    g_return_if_fail(GST_IS_TOUPCAM_SRC(object));
-    src = GST_TOUPCAM_SRC(object);
+static gboolean within_tolerance(unsigned val, unsigned ref,
+                                 gdouble tolerance)
+{
+    return fabs((gdouble) val - ref) <= ref * tolerance;
+}
 
-    GST_DEBUG_OBJECT(src, "finalize");
+// Follow the exposure in effect for each camera frame and post an
+// exposure-settled element message once time and gain stay within tolerance
+// of the first frame of a run for settle_frames frames
+static void track_exposure(GstToupCamSrc * src, unsigned seq)
+{
+    unsigned expotime;
+    unsigned short expoagain;
+    gdouble tolerance;
+    gint frames;
+    gboolean rearm;
+    gint64 now = g_get_monotonic_time();
+
+    g_mutex_lock(&src->mutex);
+    expotime = src->cur_expotime;
+    expoagain = src->cur_expoagain;
+    g_mutex_unlock(&src->mutex);
+    GST_OBJECT_LOCK(src);
+    tolerance = src->settle_tolerance;
+    frames = src->settle_frames;
+    rearm = src->settle_rearm;
+    src->settle_rearm = FALSE;
+    GST_OBJECT_UNLOCK(src);
+
+    if (rearm) {
+        src->settle_count = 0;
+        src->settle_moving = 0;
+        src->settle_start = now;
+    }
+    if (src->settle_count == 0
+        || !within_tolerance(expotime, src->settle_expotime, tolerance)
+        || !within_tolerance(expoagain, src->settle_expoagain, tolerance)) {
+        // Start a new run from this frame
+        if (src->settle_count
+            && g_atomic_int_get(&src->exposure_settled)) {
+            GST_DEBUG_OBJECT(src, "Exposure moving: %u us, gain %u",
+                             expotime, expoagain);
+            g_atomic_int_set(&src->exposure_settled, 0);
+            src->settle_moving = 0;
+            src->settle_start = now;
+        }
+        src->settle_expotime = expotime;
+        src->settle_expoagain = expoagain;
+        src->settle_count = 0;
+    }
+    src->settle_count++;
+    src->settle_moving++;
+    if (src->settle_count < frames
+        || g_atomic_int_get(&src->exposure_settled)) {
+        return;
+    }
 
-    /* clean up object here */
-    G_OBJECT_CLASS(gst_toupcam_src_parent_class)->finalize(object);
+    g_atomic_int_set(&src->exposure_settled, 1);
+    GST_INFO_OBJECT(src, "Exposure settled after %d frames: %u us, gain %u",
+                    src->settle_moving, expotime, expoagain);
+    gst_element_post_message(GST_ELEMENT(src),
+                             gst_message_new_element(GST_OBJECT(src),
+                                                     gst_structure_new
+                                                     ("exposure-settled",
+                                                      "expotime",
+                                                      G_TYPE_UINT,
+                                                      expotime,
+                                                      "expoagain",
+                                                      G_TYPE_UINT,
+                                                      (guint) expoagain,
+                                                      "seq", G_TYPE_UINT,
+                                                      seq, "frames",
+                                                      G_TYPE_INT,
+                                                      src->settle_moving,
+                                                      "settle-time",
+                                                      G_TYPE_INT64,
+                                                      now -
+                                                      src->settle_start,
+                                                      NULL)));
 }
 
-static void sdk_callback_PullMode(unsigned nEvent, void *pCallbackCtx)
+// Any thread
+static void gst_toupcam_src_rearm_motion(GstToupCamSrc * src)
 {
-    GstToupCamSrc *src = GST_TOUPCAM_SRC(pCallbackCtx);
-    //Note: lots of 1 => EVENT_EXPOSURE
-    GST_DEBUG_OBJECT(src,
-                     "sdk_callback_PullMode(nEvent=%d) begin, want %d",
-                     nEvent, CAMSDK_(EVENT_IMAGE));
-    if (CAMSDK_(EVENT_IMAGE) == nEvent) {
-        g_mutex_lock(&src->mutex);
-        src->imagesAvailable++;
-        g_cond_signal(&src->cond);
-        g_mutex_unlock(&src->mutex);
-    }
-    GST_DEBUG_OBJECT(src,
-                     "sdk_callback_PullMode(nEvent=%d) end, images now %u",
-                     nEvent, src->imagesAvailable);
+    GST_OBJECT_LOCK(src);
+    src->motion_rearm = TRUE;
+    GST_OBJECT_UNLOCK(src);
+    g_atomic_int_set(&src->motion_settled, 0);
 }
 
-void gst_toupcam_pdebug(GstToupCamSrc * src)
+// Green (x8, x16) or green / blue (raw) projections of frame into motion_cur
+static void motion_profile(GstToupCamSrc * src, const unsigned char *frame)
 {
-    int itmp;
-    short stmp;
-    unsigned short ustmp;
-    char buff[64];
+    guint32 *cols = src->motion_cur;
+    guint32 *rows = cols + src->motion_width;
 
-    printf("toupcam debug info for Version(): %s\n", camsdk_(Version) ());
-    printf("  SDK_Brand: " CAMDSK_BRAND "\n");
-    printf("  MaxBitDepth(): %d\n", camsdk_(get_MaxBitDepth) (src->hCam));
-    printf("  FanMaxSpeed(): %d\n", camsdk_(get_FanMaxSpeed) (src->hCam));
-    //Max frame rate
-    printf("  MaxSpeed(): %d\n", camsdk_(get_MaxSpeed) (src->hCam));
-    printf("  MonoMode(): %d\n", camsdk_(get_MonoMode) (src->hCam));
-    int resn = camsdk_(get_StillResolutionNumber) (src->hCam);
-    printf("  StillResolutionNumber(): %d\n", resn);
-    if (resn < 0) {
-        printf("    Failed :(\n");
+    if (src->raw) {
+        toupcam_profile_u16((const guint16 *) frame, src->nWidth,
+                            src->motion_width, src->nHeight, 0, 2,
+                            MOTION_SKIP, cols, rows);
+    } else if (src->x16) {
+        toupcam_profile_u16((const guint16 *) frame, src->nWidth * 3,
+                            src->motion_width, src->nHeight, 1, 3,
+                            MOTION_SKIP, cols, rows);
     } else {
-        for (int resi = 0; resi < resn; ++resi) {
-            printf("    eSize=%d\n", resi);
-            int width, height;
-            if (!FAILED(camsdk_(get_StillResolution)
-                        (src->hCam, resi, &width, &height))) {
-                printf("          StillResolution(): %iw x %ih\n", width,
-                       height);
-            }
-            float pixx, pixy;
-            if (!FAILED
-                (camsdk_(get_PixelSize) (src->hCam, resi, &pixx, &pixy))) {
-                printf("          PixelSize(): %0.1fw x %0.1fh um\n", pixx,
-                       pixy);
-            }
-        }
+        toupcam_profile_u8(frame, src->nWidth * 3, src->motion_width,
+                           src->nHeight, 1, 3, MOTION_SKIP, cols, rows);
     }
+}
 
-    {
-        unsigned nMin, nMax, nDef;
-        if (!FAILED
-            (camsdk_(get_ExpTimeRange) (src->hCam, &nMin, &nMax, &nDef))) {
-            printf("  ExpTimeRange(): min %d, max %d, def %d\n", nMin,
-                   nMax, nDef);
-        }
+/*
+Estimate the shift between this frame and the last from row / column
+projections and post a motion-settled element message once shift and the
+difference left after aligning stay within tolerance for motion_frames frames
+settle-time runs from the rearm or from when motion was last seen
+*/
+static void track_motion(GstToupCamSrc * src, const unsigned char *frame,
+                         unsigned seq)
+{
+    gboolean enabled;
+    gdouble tolerance;
+    gdouble difference;
+    gint frames;
+    gboolean rearm;
+    gint64 now = g_get_monotonic_time();
+    gint width = src->raw ? src->nWidth / 2 : src->nWidth;
+
+    GST_OBJECT_LOCK(src);
+    enabled = src->motion_detect;
+    tolerance = src->motion_tolerance;
+    difference = src->motion_difference;
+    frames = src->motion_frames;
+    rearm = src->motion_rearm;
+    src->motion_rearm = FALSE;
+    GST_OBJECT_UNLOCK(src);
+
+    if (!enabled) {
+        src->motion_have_prev = FALSE;
+        return;
     }
-    {
-        unsigned short nMin, nMax, nDef;
-        if (!FAILED
-            (camsdk_(get_ExpoAGainRange) (src->hCam, &nMin, &nMax, &nDef)))
-        {
-            printf("  ExpoAGainRange(): min %d, max %d, def %d\n", nMin,
-                   nMax, nDef);
-        }
+    if (width != src->motion_width || src->nHeight != src->motion_height) {
+        g_free(src->motion_prev);
+        g_free(src->motion_cur);
+        src->motion_prev = g_new(guint32, width + src->nHeight);
+        src->motion_cur = g_new(guint32, width + src->nHeight);
+        src->motion_width = width;
+        src->motion_height = src->nHeight;
+        src->motion_have_prev = FALSE;
+    }
+    if (rearm) {
+        src->motion_count = 0;
+        src->motion_moving = 0;
+        src->motion_start = now;
     }
 
-    if (!FAILED(camsdk_(get_Negative) (src->hCam, &itmp))) {
-        printf("  Negative(): %d\n", itmp);
+    motion_profile(src, frame);
+    if (src->motion_have_prev) {
+        gdouble res_x, res_y;
+        // Raw columns are 2 pixels apart
+        gint col_step = src->raw ? 2 : 1;
+        gdouble dx = toupcam_profile_shift(src->motion_prev,
+                                           src->motion_cur, width,
+                                           MOTION_MAX_SHIFT / col_step,
+                                           &res_x) * col_step;
+        gdouble dy = toupcam_profile_shift(src->motion_prev + width,
+                                           src->motion_cur + width,
+                                           src->nHeight, MOTION_MAX_SHIFT,
+                                           &res_y);
+        gdouble shift = hypot(dx, dy);
+        gdouble diff = MAX(res_x, res_y);
+
+        GST_LOG_OBJECT(src, "motion %.2f, %.2f px, difference %.4f", dx, dy,
+                       diff);
+        src->motion_moving++;
+        if (shift > tolerance || diff > difference) {
+            if (g_atomic_int_get(&src->motion_settled)) {
+                GST_DEBUG_OBJECT(src, "Motion: %.2f px, difference %.4f",
+                                 shift, diff);
+                g_atomic_int_set(&src->motion_settled, 0);
+                src->motion_moving = 1;
+                src->motion_start = now;
+            }
+            src->motion_count = 0;
+        } else if (++src->motion_count >= frames
+                   && !g_atomic_int_get(&src->motion_settled)) {
+            g_atomic_int_set(&src->motion_settled, 1);
+            GST_INFO_OBJECT(src, "Motion settled after %" G_GINT64_FORMAT
+                            " us", now - src->motion_start);
+            gst_element_post_message(GST_ELEMENT(src),
+                                     gst_message_new_element(GST_OBJECT
+                                                             (src),
+                                                             gst_structure_new
+                                                             ("motion-settled",
+                                                              "shift",
+                                                              G_TYPE_DOUBLE,
+                                                              shift,
+                                                              "difference",
+                                                              G_TYPE_DOUBLE,
+                                                              diff, "seq",
+                                                              G_TYPE_UINT,
+                                                              seq, "frames",
+                                                              G_TYPE_INT,
+                                                              src->motion_moving,
+                                                              "settle-time",
+                                                              G_TYPE_INT64,
+                                                              now -
+                                                              src->motion_start,
+                                                              NULL)));
+        }
     }
-    if (!FAILED(camsdk_(get_Chrome) (src->hCam, &itmp))) {
-        printf("  Chrome(): %d\n", itmp);
+
+    guint32 *tmp = src->motion_prev;
+    src->motion_prev = src->motion_cur;
+    src->motion_cur = tmp;
+    src->motion_have_prev = TRUE;
+}
+
+/*
+Pull the next frame from the SDK in the native format for our mode
+pitch is the bytes per row in dst, ROW_PITCH_PACKED for no padding
+*/
+static GstFlowReturn pull_frame(GstToupCamSrc * src, unsigned char *dst,
+                                gint pitch, camsdk(FrameInfoV2) * info)
+{
+    int bits;
+
+    if (src->raw) {
+        /*
+           RGBA, 16 bit => 4 * 2 => 64 bit
+           Source data raw => densely packed into 16 bit areas
+         */
+        GST_DEBUG_OBJECT(src, "pulling raw image");
+        bits = 0;
+    } else if (src->x16) {
+        GST_DEBUG_OBJECT(src, "pulling x16 image");
+        bits = 48;
+    } else {
+        GST_DEBUG_OBJECT(src, "pulling x8 image");
+        bits = 24;
     }
-    if (!FAILED(camsdk_(get_HZ) (src->hCam, &itmp))) {
-        printf("  HZ(): %d\n", itmp);
+
+    // From the grabber source we get 1 progressive frame
+    gint64 t0 = g_get_monotonic_time();
+    HRESULT hr = camsdk_(PullImageWithRowPitchV2) (src->hCam, dst, bits,
+                                                   pitch, info);
+    if (FAILED(hr)) {
+        GST_ERROR_OBJECT(src, "failed to pull image, hr = %08x", hr);
+        return GST_FLOW_ERROR;
     }
-    if (!FAILED(camsdk_(get_Mode) (src->hCam, &itmp))) {
-        printf("  Mode(): %d\n", itmp);
+    src->span.pull_end = stats_add_io(src, &src->stats_pull, t0);
+    if (!src->span.pull_start) {
+        src->span.pull_start = t0;
     }
-    if (!FAILED(camsdk_(get_RealTime) (src->hCam, &itmp))) {
-        printf("  RealTime(): %d\n", itmp);
+    src->span.seq = info->seq;
+    src->imagesPulled += 1;
+    check_sequence(src, info);
+    track_exposure(src, info->seq);
+    return GST_FLOW_OK;
+}
+
+static unsigned char *get_frame_buff(GstToupCamSrc * src)
+{
+    if (!src->frame_buff) {
+        src->frame_buff = g_malloc(src->image_bytes_in);
     }
+    return src->frame_buff;
+}
 
-    if (!FAILED(camsdk_(get_Temperature) (src->hCam, &stmp))) {
-        printf("  Temperature(): %d\n", stmp);
+// Samples per row of a pulled frame
+static gsize frame_row_samples_in(GstToupCamSrc * src)
+{
+    return src->raw ? src->nWidth : src->nWidth * 3;
+}
+
+/*
+Number of 8 bit (x8) or 16 bit (raw, x16) samples in a pulled frame
+Not derived from image_bytes_in: raw frames are one sample per pixel but
+frame_buff is sized for the 6 byte / pixel worst case
+*/
+static gsize frame_samples_in(GstToupCamSrc * src)
+{
+    return frame_row_samples_in(src) * src->nHeight;
+}
+
+// Swap in masters loaded from the application thread
+static void install_pending_masters(GstToupCamSrc * src)
+{
+    ToupcamMaster *old_dark = NULL;
+    ToupcamMaster *old_flat = NULL;
+
+    GST_OBJECT_LOCK(src);
+    if (src->dark_pending) {
+        old_dark = src->dark;
+        src->dark = src->pending_dark;
+        src->pending_dark = NULL;
+        src->dark_pending = FALSE;
+        src->cal_warned = FALSE;
     }
-    if (!FAILED(camsdk_(get_Revision) (src->hCam, &ustmp))) {
-        printf("  Revision(): %d\n", ustmp);
+    if (src->flat_pending) {
+        old_flat = src->flat;
+        src->flat = src->pending_flat;
+        src->pending_flat = NULL;
+        src->flat_pending = FALSE;
+        src->cal_warned = FALSE;
     }
+    GST_OBJECT_UNLOCK(src);
 
-    if (!FAILED(camsdk_(get_SerialNumber) (src->hCam, buff))) {
-        printf("  SerialNumber(): %s\n", buff);
-    }
-    if (!FAILED(camsdk_(get_FwVersion) (src->hCam, buff))) {
-        printf("  FwVersion(): %s\n", buff);
+    toupcam_master_free(old_dark);
+    toupcam_master_free(old_flat);
+}
+
+/*
+Is master valid for the current mode / esize / exposure?
+Called several times per frame, so compares against the size set at start
+and the exposure cached from EVENT_EXPOSURE rather than asking the SDK
+*/
+static gboolean master_usable(GstToupCamSrc * src, ToupcamMaster * master)
+{
+    unsigned expotime;
+    unsigned short expoagain;
+
+    if (!master) {
+        return FALSE;
     }
-    if (!FAILED(camsdk_(get_HwVersion) (src->hCam, buff))) {
-        printf("  HwVersion(): %s\n", buff);
+    if (master->esize != src->esize || master->width != src->nWidth
+        || master->height != src->nHeight
+        || master->n != frame_samples_in(src)) {
+        goto mismatch;
     }
-    if (!FAILED(camsdk_(get_ProductionDate) (src->hCam, buff))) {
-        printf("  ProductionDate(): %s\n", buff);
+    // Dark current depends on exposure and gain, flat response doesn't
+    if (master->kind == TOUPCAM_MASTER_DARK) {
+        g_mutex_lock(&src->mutex);
+        expotime = src->cur_expotime;
+        expoagain = src->cur_expoagain;
+        g_mutex_unlock(&src->mutex);
+        if (master->expotime != expotime || master->expoagain != expoagain) {
+            goto mismatch;
+        }
     }
-    if (!FAILED(camsdk_(get_FpgaVersion) (src->hCam, buff))) {
-        printf("  FpgaVersion(): %s\n", buff);
+    return TRUE;
+
+  mismatch:
+    if (!src->cal_warned) {
+        GST_WARNING_OBJECT(src,
+                           "master %s doesn't match current settings, skipping",
+                           master->kind ==
+                           TOUPCAM_MASTER_DARK ? "dark" : "flat");
+        src->cal_warned = TRUE;
     }
+    return FALSE;
+}
 
-    //Not supported in version 50
-#if CAMSDK_VERSION >= 53
-    const camsdk(ModelV2) * model = camsdk_(query_Model) (src->hCam);
-    if (model) {
-        printf("  ToupcamModelV2():\n");
-        printf("    name: %s\n", model->name);
-        printf("    flag: 0x%08llX\n", model->flag);
-        printf("    maxspeed: %u\n", model->maxspeed);
-        printf("    preview: %u\n", model->preview);
-        printf("    still: %u\n", model->still);
+// Rebuild the color tables if the host color properties changed
+static void update_color(GstToupCamSrc * src)
+{
+    gdouble ccm[9];
+    gdouble wb[3];
+    gdouble gamma;
+    gboolean ccm_set;
+
+    GST_OBJECT_LOCK(src);
+    if (!src->color_dirty) {
+        GST_OBJECT_UNLOCK(src);
+        return;
     }
-#endif
+    src->color_dirty = FALSE;
+    // A matrix needs all three channels at every pixel
+    ccm_set = src->host_ccm_set && src->x16;
+    memcpy(ccm, src->host_ccm, sizeof(ccm));
+    memcpy(wb, src->host_wb, sizeof(wb));
+    gamma = src->host_gamma;
+    GST_OBJECT_UNLOCK(src);
+
+    g_free(src->color);
+    src->color = NULL;
+    src->tonemap_dirty = TRUE;
+    // Identity: keep the plain shift conversion
+    if (!ccm_set && wb[0] == 1.0 && wb[1] == 1.0 && wb[2] == 1.0
+        && gamma == 1.0) {
+        return;
+    }
+    src->color = g_new(ToupcamColor, 1);
+    toupcam_color_init(src->color, ccm_set ? ccm : NULL, wb, gamma, 4095);
+}
 
-    /*
-       if (!FAILED(camsdk_(get_Name)(id, buff))) {
-       printf("  name: %s\n", buff);
-       }
-     */
-    // 0 => #define TOUPCAM_PIXELFORMAT_RAW8             0x00
-    camsdk_(get_Option) (src->hCam, CAMSDK_(OPTION_PIXEL_FORMAT), &itmp);
-    printf("  Option(PIXEL_FORMAT): %i\n", itmp);
+/*
+Software crop window from crop-x / y / width / height, clamped to the frame
+raw windows start on even pixels to keep the mosaic phase
+*/
+static void crop_window(GstToupCamSrc * src)
+{
+    gint x = MIN(src->crop_x, src->nWidth - 1);
+    gint y = MIN(src->crop_y, src->nHeight - 1);
 
-    char nFourCC[4];
-    unsigned bitsperpixel;
-    camsdk_(get_RawFormat) (src->hCam, (unsigned *) &nFourCC,
-                            &bitsperpixel);
-    // raw code GBRG, bpp 8
-    // needs this to get the full 12 bit
-    // camsdk_(put_Option)(src->hCam, CAMSDK_(OPTION_PIXEL_FORMAT),
-    // CAMSDK_(PIXELFORMAT_RAW12)); raw code GBRG, bpp 12
-    printf("    RawFormat(): FourCC %c%c%c%c, BitsPerPixel %u\n",
-           nFourCC[0], nFourCC[1], nFourCC[2], nFourCC[3], bitsperpixel);
+    if (src->raw) {
+        x &= ~1;
+        y &= ~1;
+    }
+    src->crop[0] = x;
+    src->crop[1] = y;
+    src->crop[2] = src->nWidth - x;
+    src->crop[3] = src->nHeight - y;
+    if (src->crop_width) {
+        src->crop[2] = MIN(src->crop_width, src->crop[2]);
+    }
+    if (src->crop_height) {
+        src->crop[3] = MIN(src->crop_height, src->crop[3]);
+    }
+    src->cropping = src->crop[2] != src->nWidth
+        || src->crop[3] != src->nHeight;
+    if (src->cropping) {
+        GST_INFO_OBJECT(src, "crop %d x %d at %d, %d", src->crop[2],
+                        src->crop[3], src->crop[0], src->crop[1]);
+    }
 }
 
-
-static gboolean gst_toupcam_src_start(GstBaseSrc * bsrc)
+// Byte offset of the crop window in memory 0 of an output buffer
+static gsize crop_offset(GstToupCamSrc * src)
 {
-    camsdk(DeviceV2) arr[CAMSDK_(MAX)];
-
-    unsigned cnt = 0;
-    char at_id[128];
+    if (!src->crop_meta) {
+        return 0;
+    }
+    return (gsize) src->crop[1] * src->out_stride +
+        (gsize) src->crop[0] * src->bytes_per_pix_out;
+}
 
-    // Start will open the device but not start it, set_caps starts it, stop
-    // should stop and close it (as v4l2src)
+static void get_conv_params(GstToupCamSrc * src, ToupcamConvParams * p)
+{
+    // Only the crop window is converted
+    p->width = src->crop[2];
+    p->height = src->crop[3];
+    p->in_x = src->crop[0];
+    p->in_y = src->crop[1];
+    p->in_width = src->nWidth;
+    p->out_stride = src->out_stride;
+    p->max = src->raw || src->x16 ? 4095 : 255;
+    p->shift = 4;
+    p->dark = master_usable(src, src->dark) ? src->dark->data : NULL;
+    p->flat = master_usable(src, src->flat) ? src->flat->data : NULL;
+    p->color = NULL;
+    p->workers = src->workers;
+    p->tonemap = NULL;
+    p->hist = NULL;
+    p->hist_step = TONEMAP_HIST_STEP;
+    if (src->qos_level >= QOS_SKIP_OPTIONAL) {
+        p->dark = NULL;
+        p->flat = NULL;
+    }
+    if (src->hdr_count) {
+        // Masters and the color LUTs are for single 12 bit exposures
+        p->dark = NULL;
+        p->flat = NULL;
+        if (!src->x16to8) {
+            // Radiance is already full range 16 bit
+            p->max = G_MAXUINT16;
+            p->shift = 0;
+        }
+    } else if (src->raw || src->x16) {
+        update_color(src);
+        p->color = src->color;
+    }
+}
 
-    GstToupCamSrc *src = GST_TOUPCAM_SRC(bsrc);
+/*
+x16 to 8 bit output
+Every tonemap_interval frames a histogram is collected during conversion and
+the curve for the following frames is stretched to its percentiles
+*/
+static void decode_tonemap(GstToupCamSrc * src, ToupcamConvParams * p,
+                           const unsigned char *bufin,
+                           unsigned char *bufout)
+{
+    gint interval;
+    gdouble low, high;
+    gdouble gain[3];
+    gdouble gamma;
+
+    GST_OBJECT_LOCK(src);
+    interval = src->tonemap_interval;
+    low = src->tonemap_low;
+    high = src->tonemap_high;
+    // White balance is in the matrix when there is one
+    for (int i = 0; i < 3; ++i) {
+        gain[i] = p->color && p->color->ccm_enabled ? 1.0 : src->host_wb[i];
+    }
+    gamma = src->host_gamma;
+    GST_OBJECT_UNLOCK(src);
 
-    GST_DEBUG_OBJECT(src, "gst_toupcam_src_start(): begin");
+    if (!interval && (src->tonemap_black || src->tonemap_white != 4095)) {
+        src->tonemap_black = 0;
+        src->tonemap_white = 4095;
+        src->tonemap_dirty = TRUE;
+    }
+    if (!src->tonemap) {
+        src->tonemap = g_new(ToupcamTonemap, 1);
+        src->tonemap_dirty = TRUE;
+    }
+    if (src->tonemap_dirty) {
+        toupcam_tonemap_init(src->tonemap, src->tonemap_black,
+                             src->tonemap_white, gain, gamma);
+        src->tonemap_dirty = FALSE;
+    }
 
-    // Turn on automatic timestamping, if so we do not need to do it manually, BUT
-    // there is some evidence that automatic timestamping is laggy
-    //    gst_base_src_set_do_timestamp(bsrc, TRUE);
+    p->tonemap = src->tonemap;
+    // Under QoS pressure keep the last curve
+    if (interval && src->qos_level < QOS_SKIP_OPTIONAL
+        && src->tonemap_frames++ % interval == 0) {
+        if (!src->tonemap_hist) {
+            src->tonemap_hist = g_new(guint32, TOUPCAM_LUT_SIZE);
+        }
+        p->hist = src->tonemap_hist;
+    }
+    RGB48_to_RGB24_tonemap(p, bufin, bufout);
+
+    if (p->hist) {
+        src->tonemap_black =
+            toupcam_hist_percentile(p->hist, TOUPCAM_LUT_SIZE, low);
+        src->tonemap_white =
+            toupcam_hist_percentile(p->hist, TOUPCAM_LUT_SIZE, high);
+        src->tonemap_dirty = TRUE;
+        GST_LOG_OBJECT(src, "tone map stretch %u to %u",
+                       src->tonemap_black, src->tonemap_white);
+    }
+}
 
-    // read libversion (for informational purposes only)
-    GST_INFO_OBJECT(src, "ToupCam Library Ver %s", camsdk_(Version) ());
+/*
+Returns a ref to the preview pad if this frame should also be output there
+*factor is set to the decimation to use
+*/
+static GstPad *preview_due(GstToupCamSrc * src, gint * factor)
+{
+    gint64 now = g_get_monotonic_time();
+    GstPad *pad = NULL;
+    gint f;
+
+    GST_OBJECT_LOCK(src);
+    if (src->preview_pad && src->qos_level < QOS_SINGLE_FRAME
+        && (src->preview_max_fps <= 0 || !src->preview_last
+                             || now - src->preview_last >=
+                             G_USEC_PER_SEC / src->preview_max_fps)) {
+        pad = gst_object_ref(src->preview_pad);
+        if (src->preview_new) {
+            src->preview_started = FALSE;
+            src->preview_cur_factor = 0;
+            src->preview_new = FALSE;
+        }
+    }
+    if (src->preview_width > 0) {
+        f = (src->crop[2] + src->preview_width - 1) / src->preview_width;
+    } else {
+        f = src->preview_factor;
+    }
+    GST_OBJECT_UNLOCK(src);
 
-    // enumerate devices (needed to get device id in order to prepend with "@" to
-    // enable RGB gain functions)
-    cnt = camsdk_(EnumV2) (arr);
-    GST_INFO_OBJECT(src, "Found %d devices", cnt);
-    if (cnt < 1) {
-        GST_ERROR_OBJECT(src, "No ToupCam devices found");
-        goto fail;
+    if (!pad) {
+        return NULL;
     }
+    f = CLAMP(f, 1, MAX_PROP_PREVIEW_FACTOR);
+    if (src->crop[2] / f == 0 || src->crop[3] / f == 0) {
+        gst_object_unref(pad);
+        return NULL;
+    }
+    src->preview_last = now;
+    *factor = f;
+    return pad;
+}
 
-    GST_DEBUG_OBJECT(src, "Toupcam_Open()");
-    // open first usable device id preprended with "@"
-    snprintf(at_id, sizeof(at_id), "@%s", arr[0].id);
-    src->hCam = camsdk_(Open) (at_id);
-    if (NULL == src->hCam) {
-        GST_ERROR_OBJECT(src, "open failed");
-        goto fail;
+static GstVideoFormat output_format(GstToupCamSrc * src)
+{
+    if ((src->raw || src->x16) && !src->x16to8) {
+        return GST_VIDEO_FORMAT_ARGB64;
     }
+    return GST_VIDEO_FORMAT_RGB;
+}
 
-    if (getenv("GST_TOUPCAMSRC_INFO")) {
-        gst_toupcam_pdebug(src);
+// Push sticky events ahead of the first buffer / after a size change
+static void preview_configure(GstToupCamSrc * src, GstPad * pad, gint factor,
+                              GstVideoInfo * vinfo)
+{
+    gst_video_info_init(vinfo);
+    gst_video_info_set_format(vinfo, output_format(src),
+                              src->crop[2] / factor, src->crop[3] / factor);
+    vinfo->fps_n = 0;
+    vinfo->fps_d = 1;
+
+    if (!src->preview_started) {
+        gchar *stream_id = gst_pad_create_stream_id(pad, GST_ELEMENT(src),
+                                                    "preview");
+        gst_pad_push_event(pad, gst_event_new_stream_start(stream_id));
+        g_free(stream_id);
     }
+    if (factor != src->preview_cur_factor) {
+        GstCaps *caps = gst_video_info_to_caps(vinfo);
+        gst_pad_push_event(pad, gst_event_new_caps(caps));
+        gst_caps_unref(caps);
+        src->preview_cur_factor = factor;
+    }
+    if (!src->preview_started) {
+        GstSegment segment;
+        gst_segment_init(&segment, GST_FORMAT_TIME);
+        gst_pad_push_event(pad, gst_event_new_segment(&segment));
+        src->preview_started = TRUE;
+    }
+}
 
-    HRESULT hr;
+static void preview_push(GstToupCamSrc * src, GstPad * pad,
+                         GstBuffer * preview)
+{
+    GstClock *clock = gst_element_get_clock(GST_ELEMENT(src));
+    GstFlowReturn ret;
 
-    hr = camsdk_(put_eSize) (src->hCam, src->esize);
-    if (FAILED(hr)) {
-        GST_ERROR_OBJECT(src, "failed to set size, hr = %08x", hr);
-        goto fail;
+    // Running time, as do-timestamp would give
+    if (clock) {
+        GST_BUFFER_PTS(preview) = gst_clock_get_time(clock) -
+            gst_element_get_base_time(GST_ELEMENT(src));
+        gst_object_unref(clock);
     }
-    hr = camsdk_(get_Size) (src->hCam, &src->nWidth, &src->nHeight);
-    if (FAILED(hr)) {
-        GST_ERROR_OBJECT(src, "failed to get size, hr = %08x", hr);
-        goto fail;
+    ret = gst_pad_push(pad, preview);
+    if (ret != GST_FLOW_OK && ret != GST_FLOW_NOT_LINKED
+        && ret != GST_FLOW_FLUSHING) {
+        GST_WARNING_OBJECT(src, "preview push failed: %s",
+                           gst_flow_get_name(ret));
     }
+}
 
-    if (src->raw) {
-        // can set raw8 and raw12, but not raw16
-        // default raw8
-        GST_DEBUG_OBJECT(src, "setup image mode: raw");
-        if (1) {
-            hr = camsdk_(put_Option) (src->hCam,
-                                      CAMSDK_(OPTION_PIXEL_FORMAT),
-                                      CAMSDK_(PIXELFORMAT_RAW12));
-            if (FAILED(hr)) {
-                GST_ERROR_OBJECT(src,
-                                 "failed to set pixel format, hr = %08x",
-                                 hr);
-                goto fail;
-            }
+/*
+basesrc only sends EOS down its own pad when streaming stops, so the
+preview branch would otherwise wait forever after EOS or an error
+*/
+static void preview_eos(GstToupCamSrc * src)
+{
+    GstPad *pad = NULL;
+
+    GST_OBJECT_LOCK(src);
+    if (src->preview_pad) {
+        pad = gst_object_ref(src->preview_pad);
+        if (src->preview_new) {
+            src->preview_started = FALSE;
+            src->preview_cur_factor = 0;
+            src->preview_new = FALSE;
         }
-        // no output when this is enabled...why?
-        if (1) {
-            // enable raw
-            hr = camsdk_(put_Option) (src->hCam, CAMSDK_(OPTION_RAW), 1);
-            if (FAILED(hr)) {
-                GST_ERROR_OBJECT(src, "failed to enable raw, hr = %08x",
-                                 hr);
-                goto fail;
-            }
+    }
+    GST_OBJECT_UNLOCK(src);
+    if (!pad) {
+        return;
+    }
+    if (gst_pad_is_linked(pad)) {
+        // EOS must still follow stream-start / segment
+        if (!src->preview_started) {
+            gchar *stream_id = gst_pad_create_stream_id(pad,
+                                                        GST_ELEMENT(src),
+                                                        "preview");
+            GstSegment segment;
+
+            gst_pad_push_event(pad, gst_event_new_stream_start(stream_id));
+            g_free(stream_id);
+            gst_segment_init(&segment, GST_FORMAT_TIME);
+            gst_pad_push_event(pad, gst_event_new_segment(&segment));
+            src->preview_started = TRUE;
         }
-        if (1) {
-            // 16 bit output
-            hr = camsdk_(put_Option) (src->hCam, CAMSDK_(OPTION_BITDEPTH),
-                                      1);
-            if (FAILED(hr)) {
-                GST_ERROR_OBJECT(src, "failed to enable 16 bit, hr = %08x",
-                                 hr);
-                goto fail;
+        gst_pad_push_event(pad, gst_event_new_eos());
+    }
+    gst_object_unref(pad);
+}
+
+// Convert a frame in the pull format to the output format
+// If preview is set, also box filter it into preview
+static void decode_frame(GstToupCamSrc * src, const unsigned char *bufin,
+                         unsigned char *bufout, unsigned char *preview,
+                         gsize preview_stride, gint preview_factor)
+{
+    ToupcamConvParams p;
+    // Crop window origin, with crop meta the window is written in place
+    unsigned char *out = bufout + crop_offset(src);
+
+    GST_DEBUG_OBJECT(src, "decoding image");
+    get_conv_params(src, &p);
+    p.preview = preview;
+    p.preview_stride = preview_stride;
+    p.preview_factor = preview_factor;
+    if (src->raw) {
+        GBRG12_to_ARGB64_x4(&p, bufin, out);
+    } else if (src->x16to8) {
+        decode_tonemap(src, &p, bufin, out);
+    } else if (src->x16) {
+        RGB48_to_ARGB64_x4(&p, bufin, out);
+    } else {
+        if (p.dark || p.flat) {
+            toupcam_correct_u8(&p, bufin, out);
+        } else if (bufin != bufout) {
+            for (gint y = 0; y < p.height; ++y) {
+                memcpy(out + y * p.out_stride,
+                       bufin + ((gsize) (p.in_y + y) * p.in_width +
+                                p.in_x) * 3, (gsize) p.width * 3);
             }
         }
-    } else if (src->x16) {
-        // can set raw8 and raw12, but not raw16
-        // default raw8
-        GST_DEBUG_OBJECT(src, "setup image mode: x16");
-
-        // 16 bit output
-        hr = camsdk_(put_Option) (src->hCam, CAMSDK_(OPTION_BITDEPTH), 1);
-        if (FAILED(hr)) {
-            GST_ERROR_OBJECT(src, "failed to enable 16 bit, hr = %08x",
-                             hr);
-            goto fail;
+        // Nothing to fuse with, decimate on its own
+        if (preview) {
+            toupcam_decimate_rgb24(p.workers, out, p.out_stride, p.width,
+                                   p.height, preview, preview_stride,
+                                   preview_factor);
         }
+    }
+}
 
-        // RGB48
-        hr = camsdk_(put_Option) (src->hCam, CAMSDK_(OPTION_RGB), 1);
-        if (FAILED(hr)) {
-            GST_ERROR_OBJECT(src, "failed to enable raw, hr = %08x", hr);
-            goto fail;
-        }
+static void finish_master_capture(GstToupCamSrc * src)
+{
+    gsize n = frame_samples_in(src);
+    ToupcamMaster *master = toupcam_master_new(src->capture_kind, n);
+    const gchar *kind_name;
+    gchar *fn;
+
+    master->esize = src->esize;
+    master->width = src->nWidth;
+    master->height = src->nHeight;
+    // Same source as master_usable() compares against
+    g_mutex_lock(&src->mutex);
+    master->expotime = src->cur_expotime;
+    master->expoagain = src->cur_expoagain;
+    g_mutex_unlock(&src->mutex);
+
+    if (src->capture_kind == TOUPCAM_MASTER_DARK) {
+        toupcam_stack_mean_u16(master->data, src->capture_acc, n,
+                               src->capture_count);
+        toupcam_master_free(src->dark);
+        src->dark = master;
+        kind_name = "dark";
+        GST_OBJECT_LOCK(src);
+        fn = g_strdup(src->dark_file);
+        GST_OBJECT_UNLOCK(src);
     } else {
-        GST_DEBUG_OBJECT(src, "setup image mode: regular");
-        camsdk_(put_Option) (src->hCam, CAMSDK_(OPTION_BYTEORDER),
-                             GST_TOUPCAM_OPTION_BYTEORDER_RGB);
-        camsdk_(put_Hue) (src->hCam, src->hue);
-        camsdk_(put_Saturation) (src->hCam, src->saturation);
-        camsdk_(put_Brightness) (src->hCam, src->brightness);
-        camsdk_(put_Contrast) (src->hCam, src->contrast);
-        camsdk_(put_Gamma) (src->hCam, src->gamma);
-    }
+        guint16 *mean = g_new(guint16, n);
+        const guint16 *dark = NULL;
 
-    camsdk_(put_HFlip) (src->hCam, src->hflip);
-    camsdk_(put_VFlip) (src->hCam, src->vflip);
-    hr = camsdk_(put_AutoExpoEnable) (src->hCam, src->auto_exposure);
-    if (FAILED(hr)) {
-        GST_ERROR_OBJECT(src, "failed to auto exposure, hr = %08x", hr);
-        goto fail;
-    }
-    if (!src->auto_exposure) {
-        // setting this severely interferes with auto exposure
-        camsdk_(put_ExpoTime) (src->hCam, src->expotime);
+        toupcam_stack_mean_u16(mean, src->capture_acc, n,
+                               src->capture_count);
+        if (master_usable(src, src->dark)) {
+            dark = src->dark->data;
+        }
+        toupcam_flat_gain(master->data, mean, dark,
+                          frame_row_samples_in(src), src->nHeight,
+                          src->raw);
+        g_free(mean);
+        toupcam_master_free(src->flat);
+        src->flat = master;
+        kind_name = "flat";
+        GST_OBJECT_LOCK(src);
+        fn = g_strdup(src->flat_file);
+        GST_OBJECT_UNLOCK(src);
     }
+    src->cal_warned = FALSE;
+    GST_INFO_OBJECT(src, "captured master %s from %d frames", kind_name,
+                    src->capture_count);
 
-    // BGR 24-bit is primarily supported
-    // Some attempts at 16 bit
-    if (src->raw || src->x16) {
-        src->bits_per_pix_out = 64;
-        src->bytes_per_pix_out = 8;
-        src->bytes_per_pix_in = 6;
-    } else {
-        src->bits_per_pix_out = 24;
-        src->bytes_per_pix_out = 3;
-        src->bytes_per_pix_in = 3;
+    if (fn && fn[0] && !toupcam_master_save(master, fn)) {
+        GST_ERROR_OBJECT(src, "failed to save master %s to %s", kind_name,
+                         fn);
     }
+    g_free(fn);
+
+    g_free(src->capture_acc);
+    src->capture_acc = NULL;
+    src->capture_kind = TOUPCAM_MASTER_NONE;
+
+    gst_element_post_message(GST_ELEMENT(src),
+                             gst_message_new_element(GST_OBJECT(src),
+                                                     gst_structure_new
+                                                     ("master-captured",
+                                                      "kind",
+                                                      G_TYPE_STRING,
+                                                      kind_name, NULL)));
+}
 
-    unsigned nFrame, nTime, nTotalFrame;
-    camsdk_(get_FrameRate) (src->hCam, &nFrame, &nTime, &nTotalFrame);
-    src->framerate = nFrame * 1000.0 / nTime;
-    src->duration = 1000000000.0 / src->framerate;
+static gint cmp_index(gconstpointer a, gconstpointer b)
+{
+    guint32 va = *(const guint32 *) a;
+    guint32 vb = *(const guint32 *) b;
+    return va < vb ? -1 : va > vb;
+}
 
-    src->image_bytes_in =
-        src->nWidth * src->nHeight * src->bytes_per_pix_in;
-    src->image_bytes_out =
-        src->nWidth * src->nHeight * src->bytes_per_pix_out;
-    // GST_DEBUG_OBJECT (src, "Image is %d x %d, pitch %d, bpp %d, Bpp %d",
-    // src->nWidth, src->nHeight, src->bits_per_pix_out, src->bytes_per_pix_out);
-    GST_DEBUG_OBJECT(src,
-                     "Image %d w x %d h, in %d bytes / pix => %d bytes (%0.1f "
-                     "MB), out %d bytes / pix => %d bytes (%0.1f MB)",
-                     src->nWidth, src->nHeight, src->bytes_per_pix_in,
-                     src->image_bytes_in, src->image_bytes_in / 1e6,
-                     src->bytes_per_pix_out, src->image_bytes_out,
-                     src->image_bytes_out / 1e6);
+// Detect defects from the current masters and save the result
+static void build_defect_map(GstToupCamSrc * src)
+{
+    gsize n = frame_samples_in(src);
+    GArray *index = g_array_new(FALSE, FALSE, sizeof(guint32));
+    ToupcamDefectMap *map;
+    gboolean dark = master_usable(src, src->dark);
+    gboolean flat = master_usable(src, src->flat);
+    gdouble sigma;
+    gchar *path;
+
+    // Keep whatever map is loaded (and on disk) rather than replacing it
+    // with an empty one
+    if (!dark && !flat) {
+        GST_WARNING_OBJECT(src, "no usable masters to build defect map from");
+        g_array_unref(index);
+        return;
+    }
 
-    // TODO: move from static buff to frame_buff
-    src->frame_buff = NULL;
+    GST_OBJECT_LOCK(src);
+    sigma = src->defect_sigma;
+    GST_OBJECT_UNLOCK(src);
 
-    hr = camsdk_(StartPullModeWithCallback) (src->hCam,
-                                             sdk_callback_PullMode, src);
-    if (FAILED(hr)) {
-        GST_ERROR_OBJECT(src, "failed to start camera, hr = %08x", hr);
-        goto fail;
+    // Hot pixels stick out in the dark, dead / stuck pixels need an
+    // unusual flat gain to correct
+    if (dark) {
+        toupcam_defects_detect(index, src->dark->data, n, sigma, FALSE);
+    }
+    if (flat) {
+        toupcam_defects_detect(index, src->flat->data, n, sigma, TRUE);
     }
 
+    // Merge the two sorted lists
+    g_array_sort(index, cmp_index);
+    map = toupcam_defect_map_new(index->len);
+    map->count = 0;
+    for (guint i = 0; i < index->len; ++i) {
+        guint32 v = g_array_index(index, guint32, i);
+        if (!map->count || map->index[map->count - 1] != v) {
+            map->index[map->count++] = v;
+        }
+    }
+    g_array_unref(index);
+    map->esize = src->esize;
+    map->width = src->nWidth;
+    map->height = src->nHeight;
+    map->n = n;
+
+    toupcam_defect_map_free(src->defects);
+    src->defects = map;
+    GST_INFO_OBJECT(src, "defect map has %" G_GSIZE_FORMAT " entries",
+                    map->count);
+
+    path = defect_map_path(src);
+    if (path && !toupcam_defect_map_save(map, path)) {
+        GST_ERROR_OBJECT(src, "failed to save defect map to %s", path);
+    }
+    g_free(path);
+
+    gst_element_post_message(GST_ELEMENT(src),
+                             gst_message_new_element(GST_OBJECT(src),
+                                                     gst_structure_new
+                                                     ("defect-map-built",
+                                                      "count", G_TYPE_UINT,
+                                                      (guint) map->count,
+                                                      NULL)));
+}
 
-    GST_DEBUG_OBJECT(src, "gst_toupcam_src_start(): ok");
-    return TRUE;
+// Fix up defects in a pulled frame in place
+static void correct_defects(GstToupCamSrc * src, unsigned char *frame)
+{
+    gboolean request;
+    ToupcamDefectMap *map;
+
+    GST_OBJECT_LOCK(src);
+    request = src->defect_request;
+    src->defect_request = FALSE;
+    GST_OBJECT_UNLOCK(src);
+    if (request) {
+        build_defect_map(src);
+    }
 
-  fail:
-    if (src->hCam) {
-        src->hCam = NULL;
+    map = src->defects;
+    if (!map || !map->count) {
+        return;
     }
+    if (map->esize != src->esize || map->width != src->nWidth
+        || map->height != src->nHeight || map->n != frame_samples_in(src)) {
+        return;
+    }
+    if (src->raw) {
+        // Same color neighbors are 2 samples / rows away in the mosaic
+        toupcam_defects_correct_u16((guint16 *) frame, map->index,
+                                    map->count, src->nWidth, src->nHeight,
+                                    2, 2);
+    } else if (src->x16) {
+        toupcam_defects_correct_u16((guint16 *) frame, map->index,
+                                    map->count, src->nWidth * 3,
+                                    src->nHeight, 3, 1);
+    } else {
+        toupcam_defects_correct_u8(frame, map->index, map->count,
+                                   src->nWidth * 3, src->nHeight, 3, 1);
+    }
+}
 
-    return FALSE;
+// Accumulate an uncorrected frame into a master capture, if one is running
+static void capture_master_frame(GstToupCamSrc * src,
+                                 const unsigned char *frame)
+{
+    gsize n = frame_samples_in(src);
+
+    GST_OBJECT_LOCK(src);
+    if (src->capture_request != TOUPCAM_MASTER_NONE) {
+        src->capture_kind = src->capture_request;
+        src->capture_frames = src->capture_request_frames;
+        src->capture_count = 0;
+        src->capture_request = TOUPCAM_MASTER_NONE;
+    }
+    GST_OBJECT_UNLOCK(src);
+
+    if (src->capture_kind == TOUPCAM_MASTER_NONE) {
+        return;
+    }
+    if (src->capture_count == 0) {
+        if (!src->capture_acc) {
+            src->capture_acc = g_new(guint32, n);
+        }
+        memset(src->capture_acc, 0, n * sizeof(guint32));
+    }
+    if (src->raw || src->x16) {
+        toupcam_stack_add_u16(src->capture_acc, (const guint16 *) frame, n);
+    } else {
+        toupcam_stack_add_u8(src->capture_acc, frame, n);
+    }
+    src->capture_count += 1;
+    if (src->capture_count >= src->capture_frames) {
+        finish_master_capture(src);
+    }
 }
 
-static gboolean gst_toupcam_src_stop(GstBaseSrc * bsrc)
+// Apply hdr-exposures changes
+static void update_hdr(GstToupCamSrc * src)
 {
-    // Start will open the device but not start it, set_caps starts it, stop
-    // should stop and close it (as v4l2src)
+    guint32 expotime[TOUPCAM_HDR_MAX];
+    gint count;
 
-    GstToupCamSrc *src = GST_TOUPCAM_SRC(bsrc);
+    GST_OBJECT_LOCK(src);
+    if (!src->hdr_dirty) {
+        GST_OBJECT_UNLOCK(src);
+        return;
+    }
+    src->hdr_dirty = FALSE;
+    count = src->hdr_request_count;
+    memcpy(expotime, src->hdr_request, sizeof(expotime));
+    GST_OBJECT_UNLOCK(src);
+
+    if (count && !(src->raw || src->x16)) {
+        GST_WARNING_OBJECT(src, "hdr-exposures needs 16 bit samples (raw, "
+                           "x16 or x16to8), ignored");
+        count = 0;
+    }
+    if (count && !src->hdr_count) {
+        // Bracketing drives the exposure, restored when turned off
+        camsdk_(get_AutoExpoEnable) (src->hCam, &src->hdr_saved_auto);
+        camsdk_(get_ExpoTime) (src->hCam, &src->hdr_saved_expotime);
+        camsdk_(put_AutoExpoEnable) (src->hCam, 0);
+    } else if (!count && src->hdr_count) {
+        camsdk_(put_ExpoTime) (src->hCam, src->hdr_saved_expotime);
+        camsdk_(put_AutoExpoEnable) (src->hCam, src->hdr_saved_auto);
+        settings_changed(src);
+    }
+    GST_INFO_OBJECT(src, "HDR bracketing %d exposures", count);
+    g_free(src->hdr_frames);
+    src->hdr_frames = NULL;
+    src->hdr_count = count;
+    memcpy(src->hdr_expotime, expotime, sizeof(expotime));
+    src->hdr_set_expotime = 0;
+    src->hdr_reverse = FALSE;
+    if (count && src->x16to8 && !src->hdr_curve) {
+        src->hdr_curve = g_new(guint16, G_MAXUINT16 + 1);
+        toupcam_hdr_curve_init(src->hdr_curve, TOUPCAM_LUT_SIZE - 1);
+    }
+}
 
-    GST_DEBUG_OBJECT(src, "gst_toupcam_src_stop()");
-    camsdk_(Close) (src->hCam);
+/*
+Pull the first frame exposed for expotime, skipping frames that were already
+in flight when the exposure was changed (see resolve_generation())
+waited: a frame has already been waited on
+*/
+static GstFlowReturn pull_exposure(GstToupCamSrc * src, unsigned expotime,
+                                   unsigned char *dst,
+                                   camsdk(FrameInfoV2) * info,
+                                   gboolean waited)
+{
+    if (src->hdr_set_expotime != expotime) {
+        camsdk_(put_ExpoTime) (src->hCam, expotime);
+        settings_changed(src);
+        src->hdr_set_expotime = expotime;
+    }
+    for (gint tries = 0;; ++tries) {
+        if ((tries || !waited) && wait_new_frame(src) != GST_FLOW_OK) {
+            return GST_FLOW_ERROR;
+        }
+        if (pull_frame(src, dst, ROW_PITCH_PACKED, info) != GST_FLOW_OK) {
+            return GST_FLOW_ERROR;
+        }
+        resolve_generation(src, exposure_start(src, info, expotime));
+        if (!src->frame_stale) {
+            return GST_FLOW_OK;
+        }
+        if (tries >= HDR_MAX_STALE) {
+            GST_WARNING_OBJECT(src, "exposure %u us not seen after %d "
+                               "frames, using the latest", expotime, tries);
+            return GST_FLOW_OK;
+        }
+    }
+}
 
-    gst_toupcam_src_reset(src);
+/*
+Pull one frame per hdr-exposures entry and merge them into frame_buff
+Brackets alternate direction so consecutive ones share the end exposure
+and only change it hdr_count - 1 times
+The first frame has already been waited on by the caller
+*/
+static GstFlowReturn pull_hdr_frames(GstToupCamSrc * src,
+                                     camsdk(FrameInfoV2) * info)
+{
+    gsize n = frame_samples_in(src);
+    ToupcamHdrParams p;
 
-    return TRUE;
+    if (!src->hdr_frames) {
+        src->hdr_frames = g_new(guint16, n * src->hdr_count);
+    }
+    memset(&p, 0, sizeof(p));
+    p.count = src->hdr_count;
+    for (gint k = 0; k < p.count; ++k) {
+        gint i = src->hdr_reverse ? p.count - 1 - k : k;
+        guint16 *frame = src->hdr_frames + i * n;
+
+        if (pull_exposure(src, src->hdr_expotime[i],
+                          (unsigned char *) frame, info,
+                          k == 0) != GST_FLOW_OK) {
+            return GST_FLOW_ERROR;
+        }
+        p.in[i] = frame;
+        p.expotime[i] = src->hdr_expotime[i];
+    }
+    src->hdr_reverse = !src->hdr_reverse;
+
+    p.row_samples = frame_row_samples_in(src);
+    p.height = src->nHeight;
+    p.max = 4095;
+    p.curve = src->x16to8 ? src->hdr_curve : NULL;
+    p.workers = src->workers;
+    toupcam_hdr_merge(&p, (guint16 *) get_frame_buff(src));
+    return GST_FLOW_OK;
 }
 
-static GstCaps *gst_toupcam_src_get_caps(GstBaseSrc * bsrc,
-                                         GstCaps * filter)
+/*
+Pull stack_frames consecutive frames and average them into frame_buff
+The first frame has already been waited on by the caller
+*/
+static GstFlowReturn pull_stack_frames(GstToupCamSrc * src,
+                                       camsdk(FrameInfoV2) * info)
 {
-    GstToupCamSrc *src = GST_TOUPCAM_SRC(bsrc);
-    GstCaps *caps;
-
-    if (src->hCam == 0) {
-        caps = gst_pad_get_pad_template_caps(GST_BASE_SRC_PAD(src));
-    } else {
-        GstVideoInfo vinfo;
-
-        // Create video info
-        gst_video_info_init(&vinfo);
+    gsize n = frame_samples_in(src);
+    unsigned char *frame_buff = get_frame_buff(src);
+    gint count = src->stack_frames;
 
-        vinfo.width = src->nWidth;
-        vinfo.height = src->nHeight;
-
-        // Frames per second fraction n/d, 0/1 indicates a frame rate may vary
-        vinfo.fps_n = 0;
-        vinfo.fps_d = 1;
-        vinfo.interlace_mode = GST_VIDEO_INTERLACE_MODE_PROGRESSIVE;
+    if (!src->stack_acc) {
+        src->stack_acc = g_new(guint32, n);
+    }
+    memset(src->stack_acc, 0, n * sizeof(guint32));
 
+    GST_DEBUG_OBJECT(src, "stacking %d frames", count);
+    for (gint i = 0; i < count; ++i) {
+        if (i && wait_new_frame(src) != GST_FLOW_OK) {
+            return GST_FLOW_ERROR;
+        }
+        if (pull_frame(src, frame_buff, ROW_PITCH_PACKED, info) !=
+            GST_FLOW_OK) {
+            return GST_FLOW_ERROR;
+        }
         if (src->raw || src->x16) {
-            vinfo.finfo =
-                gst_video_format_get_info(GST_VIDEO_FORMAT_ARGB64);
+            toupcam_stack_add_u16(src->stack_acc,
+                                  (const guint16 *) frame_buff, n);
         } else {
-            vinfo.finfo = gst_video_format_get_info(GST_VIDEO_FORMAT_RGB);
+            toupcam_stack_add_u8(src->stack_acc, frame_buff, n);
         }
+    }
 
-        // cannot do this for variable frame rate
-        // src->duration = gst_util_uint64_scale_int (GST_SECOND, vinfo.fps_d,
-        // vinfo.fps_n); // NB n and d are wrong way round to invert the fps into a
-        // duration.
+    if (src->raw || src->x16) {
+        toupcam_stack_mean_u16((guint16 *) frame_buff, src->stack_acc, n,
+                               count);
+    } else {
+        toupcam_stack_mean_u8(frame_buff, src->stack_acc, n, count);
+    }
+    return GST_FLOW_OK;
+}
 
-        caps = gst_video_info_to_caps(&vinfo);
+// Cheap focus metric on the green channel of a pulled frame
+static guint64 frame_sharpness(GstToupCamSrc * src,
+                               const unsigned char *frame)
+{
+    if (src->raw) {
+        // GBRG: same color samples are 2 apart
+        return toupcam_sharpness_u16((const guint16 *) frame, src->nWidth,
+                                     src->nHeight, 0, 2,
+                                     SHARPNESS_ROW_STEP);
+    } else if (src->x16) {
+        return toupcam_sharpness_u16((const guint16 *) frame,
+                                     src->nWidth * 3, src->nHeight, 1, 3,
+                                     SHARPNESS_ROW_STEP);
+    } else {
+        return toupcam_sharpness_u8(frame, src->nWidth * 3, src->nHeight,
+                                    1, 3, SHARPNESS_ROW_STEP);
     }
+}
 
-    //this func is called a lot and spams the output
-    //GST_INFO_OBJECT(src, "The caps are %" GST_PTR_FORMAT, caps);
+/*
+Pull best_of consecutive frames and select the sharpest
+Frames alternate between slot and frame_buff so only the winner is decoded
+*best is set to whichever of the two holds it
+The first frame has already been waited on by the caller
+*/
+static GstFlowReturn pull_best_frame(GstToupCamSrc * src,
+                                     unsigned char *slot,
+                                     unsigned char **best,
+                                     camsdk(FrameInfoV2) * info)
+{
+    unsigned char *frame_buff = get_frame_buff(src);
+    unsigned char *candidate = slot;
+    guint64 best_score = 0;
+    gint best_i = 0;
 
-    if (filter) {
-        GstCaps *tmp = gst_caps_intersect(caps, filter);
-        gst_caps_unref(caps);
-        caps = tmp;
+    *best = NULL;
+    for (gint i = 0; i < src->best_of; ++i) {
+        camsdk(FrameInfoV2) cinfo = { 0 };
 
-        GST_INFO_OBJECT(src,
-                        "The caps after filtering are %" GST_PTR_FORMAT,
-                        caps);
+        if (i && wait_new_frame(src) != GST_FLOW_OK) {
+            return GST_FLOW_ERROR;
+        }
+        if (pull_frame(src, candidate, ROW_PITCH_PACKED, &cinfo) !=
+            GST_FLOW_OK) {
+            return GST_FLOW_ERROR;
+        }
+        guint64 score = frame_sharpness(src, candidate);
+        GST_DEBUG_OBJECT(src, "frame %d sharpness %" G_GUINT64_FORMAT, i,
+                         score);
+        if (*best == NULL || score > best_score) {
+            *best = candidate;
+            *info = cinfo;
+            best_score = score;
+            best_i = i;
+            candidate = candidate == slot ? frame_buff : slot;
+        }
     }
-
-    return caps;
+    GST_DEBUG_OBJECT(src, "selected frame %d of %d", best_i, src->best_of);
+    return GST_FLOW_OK;
 }
 
-static gboolean gst_toupcam_src_set_caps(GstBaseSrc * bsrc, GstCaps * caps)
+/*
+Sizes and buffer offsets of the pyramid-levels mipmap for this stream
+Level 0 is the crop window of the output frame, each later level halves the
+last and follows the frame with packed rows
+*/
+static void pyramid_layout(GstToupCamSrc * src)
 {
-    // Start will open the device but not start it, set_caps starts it, stop
-    // should stop and close it (as v4l2src)
+    guint width = src->crop[2];
+    guint height = src->crop[3];
+    gsize offset = src->image_bytes_out;
+
+    src->pyramid_count = 0;
+    while (src->pyramid_count <= src->pyramid_levels && width && height) {
+        gint i = src->pyramid_count++;
+
+        src->pyramid_width[i] = width;
+        src->pyramid_height[i] = height;
+        if (i == 0) {
+            src->pyramid_stride[i] = src->out_stride;
+            src->pyramid_offset[i] = crop_offset(src);
+        } else {
+            src->pyramid_stride[i] = width * src->bytes_per_pix_out;
+            src->pyramid_offset[i] = offset;
+            offset += (gsize) src->pyramid_stride[i] * height;
+        }
+        width /= 2;
+        height /= 2;
+    }
+    src->pyramid_bytes = offset - src->image_bytes_out;
+}
 
-    GstToupCamSrc *src = GST_TOUPCAM_SRC(bsrc);
+/*
+Output buffers hold the crop window, or the full frame when downstream takes
+GstVideoCropMeta, followed by any pyramid levels
+Rows have GStreamer's default stride for the format (RGB is 4 byte aligned),
+padded to row-align when downstream reads the GstVideoMeta stride
+*/
+static void output_layout(GstToupCamSrc * src)
+{
+    const gint width = src->crop_meta ? src->nWidth : src->crop[2];
+    const gint height = src->crop_meta ? src->nHeight : src->crop[3];
     GstVideoInfo vinfo;
-    // GstStructure *s = gst_caps_get_structure (caps, 0);
-
-    GST_INFO_OBJECT(src, "The caps being set are %" GST_PTR_FORMAT, caps);
 
-    gst_video_info_from_caps(&vinfo, caps);
+    gst_video_info_init(&vinfo);
+    gst_video_info_set_format(&vinfo, output_format(src), width, height);
+    src->out_stride = GST_VIDEO_INFO_PLANE_STRIDE(&vinfo, 0);
+    if (src->video_meta && src->row_align > 1) {
+        src->out_stride = (src->out_stride + src->row_align - 1) /
+            src->row_align * src->row_align;
+    }
+    src->image_bytes_out = src->out_stride * height;
+    pyramid_layout(src);
+}
 
-    if (GST_VIDEO_INFO_FORMAT(&vinfo) != GST_VIDEO_FORMAT_UNKNOWN) {
-        g_assert(src->hCam != 0);
-        //  src->vrm_stride = get_pitch (src->device);  // wait for image to arrive
-        //  for this
-        src->gst_stride = GST_VIDEO_INFO_COMP_STRIDE(&vinfo, 0);
-        src->nHeight = vinfo.height;
-    } else {
-        goto unsupported_caps;
+// Levels after 0 follow the frame in the same memory
+static void pyramid_map(GstToupCamSrc * src, GstMapInfo * frame,
+                        unsigned char **level)
+{
+    for (gint i = 0; i < src->pyramid_count; ++i) {
+        level[i] = frame->data + src->pyramid_offset[i];
     }
+}
 
-    return TRUE;
+// Box filter each level from the one above, starting at level first
+static void pyramid_build(GstToupCamSrc * src, unsigned char **level,
+                          gint first)
+{
+    for (gint i = first; i < src->pyramid_count; ++i) {
+        if (src->bytes_per_pix_out == 3) {
+            toupcam_decimate_rgb24(src->workers, level[i - 1],
+                                   src->pyramid_stride[i - 1],
+                                   src->pyramid_width[i - 1],
+                                   src->pyramid_height[i - 1], level[i],
+                                   src->pyramid_stride[i], 2);
+        } else {
+            toupcam_decimate_argb64(src->workers,
+                                    (const guint16 *) level[i - 1],
+                                    src->pyramid_stride[i - 1],
+                                    src->pyramid_width[i - 1],
+                                    src->pyramid_height[i - 1],
+                                    (guint16 *) level[i],
+                                    src->pyramid_stride[i], 2);
+        }
+    }
+}
 
-  unsupported_caps:
-    GST_ERROR_OBJECT(src, "Unsupported caps: %" GST_PTR_FORMAT, caps);
-    return FALSE;
+static void add_pyramid_meta(GstToupCamSrc * src, GstBuffer * buf)
+{
+    GstToupCamPyramidMeta *meta = gst_buffer_add_toupcam_pyramid_meta(buf);
+
+    meta->n_levels = src->pyramid_count;
+    for (gint i = 0; i < src->pyramid_count; ++i) {
+        meta->width[i] = src->pyramid_width[i];
+        meta->height[i] = src->pyramid_height[i];
+        meta->offset[i] = src->pyramid_offset[i];
+        meta->stride[i] = src->pyramid_stride[i];
+    }
 }
 
-// raw to common format
-void GBRG12_to_ARGB64_x4(GstToupCamSrc * src, const unsigned char *bufin,
-                         unsigned char *bufout)
-{
-    for (unsigned y = 0; y < src->nHeight; ++y) {
-        for (unsigned x = 0; x < src->nWidth; ++x) {
-            uint16_t pix16 = (bufin[1] << 12) | (bufin[0] << 4);
-            /*
-               if (y == 0 && x < 16) {
-               //0x91 0x0E
-               GST_DEBUG_OBJECT (src, "0x%02X 0x%02X", bufin[0], bufin[1]);
-               }
-             */
-            uint8_t pix1 = pix16 >> 8;
-            uint8_t pix0 = pix16 & 0xFF;
-            unsigned colori = x % 4;
-            // blue
-            if (colori == 1) {
-                bufout[6] = pix0;
-                bufout[7] = pix1;
-                // red
-            } else if (colori == 3) {
-                bufout[2] = pix0;
-                bufout[3] = pix1;
-                // green
-            } else {
-                bufout[4] = pix0;
-                bufout[5] = pix1;
-            }
-            bufin += 2;
-            bufout += 8;
-        }
-    }
-}
-
-// high def to common format
-void RGB48_to_ARGB64_x4(GstToupCamSrc * src, const unsigned char *bufin,
-                        unsigned char *bufout)
-{
-    for (unsigned y = 0; y < src->nHeight; ++y) {
-        for (unsigned x = 0; x < src->nWidth; ++x) {
-            uint16_t rpix16 = (bufin[1] << 12) | (bufin[0] << 4);
-            bufin += 2;
-            uint16_t gpix16 = (bufin[1] << 12) | (bufin[0] << 4);
-            bufin += 2;
-            uint16_t bpix16 = (bufin[1] << 12) | (bufin[0] << 4);
-            bufin += 2;
-            /*
-               if (y == 0 && x < 16) {
-               //0x91 0x0E
-               GST_DEBUG_OBJECT (src, "0x%02X 0x%02X", bufin[0], bufin[1]);
-               }
-             */
-            uint8_t rpix1 = rpix16 >> 8;
-            uint8_t rpix0 = rpix16 & 0xFF;
-            uint8_t gpix1 = gpix16 >> 8;
-            uint8_t gpix0 = gpix16 & 0xFF;
-            uint8_t bpix1 = bpix16 >> 8;
-            uint8_t bpix0 = bpix16 & 0xFF;
-            // red
-            bufout[2] = rpix0;
-            bufout[3] = rpix1;
-            // green
-            bufout[4] = gpix0;
-            bufout[5] = gpix1;
-            // blue
-            bufout[6] = bpix0;
-            bufout[7] = bpix1;
-            bufout += 8;
-        }
+// Describe the image's stride and offset, and the crop window if any
+static void add_layout_meta(GstToupCamSrc * src, GstBuffer * buf)
+{
+    gsize offset[GST_VIDEO_MAX_PLANES] = { 0 };
+    gint stride[GST_VIDEO_MAX_PLANES] = { src->out_stride };
+
+    // With a pyramid it also lets gst_video_frame_map() map level 0 alone
+    if (src->video_meta || src->pyramid_count > 1) {
+        gst_buffer_add_video_meta_full(buf, GST_VIDEO_FRAME_FLAG_NONE,
+                                       output_format(src),
+                                       src->crop_meta ? src->nWidth :
+                                       src->crop[2],
+                                       src->crop_meta ? src->nHeight :
+                                       src->crop[3], 1, offset, stride);
+    }
+    if (src->crop_meta) {
+        GstVideoCropMeta *crop = gst_buffer_add_video_crop_meta(buf);
+
+        crop->x = src->crop[0];
+        crop->y = src->crop[1];
+        crop->width = src->crop[2];
+        crop->height = src->crop[3];
+    }
+    if (src->pyramid_count > 1) {
+        add_pyramid_meta(src, buf);
     }
 }
 
-static GstFlowReturn wait_new_frame(GstToupCamSrc * src)
+// x8 output rows are the pulled rows, without padding
+static gboolean x8_rows_packed(GstToupCamSrc * src)
 {
-    //printf("Waiting for new frame...\n");
-    // Wait for the next image to be ready
-    int timeout = 5;
-    while (src->imagesAvailable <= src->imagesPulled) {
-        gint64 end_time;
-        g_mutex_lock(&src->mutex);
-        end_time = g_get_monotonic_time() + G_TIME_SPAN_SECOND;
-        if (!g_cond_wait_until(&src->cond, &src->mutex, end_time)) {
-            GST_DEBUG_OBJECT(src,
-                             "timed out waiting for image, timeout=%u",
-                             timeout);
-            // timeout has passed.
-            // g_mutex_unlock (&src->mutex); // return here if needed
-            // return NULL;
-        }
-        g_mutex_unlock(&src->mutex);
-        timeout--;
-        if (timeout <= 0) {
-            // did not return an image. why?
-            // ----------------------------------------------------------
-            GST_ERROR_OBJECT(src, "WaitEvent timed out.");
-            return GST_FLOW_ERROR;
-        }
+    return (gsize) src->out_stride == frame_row_samples_in(src);
+}
+
+/*
+Whether an x8 frame can be pulled straight into the output buffer, with its
+stride. Padded rows can't also be used as pulled input, so then only when
+nothing needs that (masters, defects, motion) and no window is copied out
+*/
+static gboolean x8_pull_direct(GstToupCamSrc * src)
+{
+    gboolean busy;
+
+    if (src->cropping && !src->crop_meta) {
+        return FALSE;
     }
-    return GST_FLOW_OK;
+    if (x8_rows_packed(src)) {
+        return TRUE;
+    }
+    GST_OBJECT_LOCK(src);
+    busy = src->capture_request != TOUPCAM_MASTER_NONE
+        || src->defect_request || src->motion_detect;
+    GST_OBJECT_UNLOCK(src);
+    return !busy && src->capture_kind == TOUPCAM_MASTER_NONE
+        && !(src->defects && src->defects->count)
+        && !master_usable(src, src->dark) && !master_usable(src, src->flat);
 }
 
+/*
+Pull the next output frame (a whole HDR bracket / stack / best of group) and
+convert it into buf
+late: QoS says the frame would reach the sink late, pull the group to keep
+the camera in step but return FLOW_FRAME_DROPPED instead of converting it
+*/
 static GstFlowReturn pull_decode_frame(GstToupCamSrc * src,
-                                       GstBuffer * buf)
+                                       GstBuffer * buf, gboolean late)
 {
-    /*
-       Max size is RGBA 16 bit => 8 bytes per pixel
-       FIXME: size this dynamically
-       For now just make it really big
-       Largest supported camera is E3ISPM25000KPA @ 25MP
-     */
-    static unsigned char raw_buff[4928 * 4928 * 4 * 2];
+    GstFlowReturn ret;
     // Copy image to buffer in the right way
     GstMapInfo minfo;
+    GstPad *preview_pad;
+    GstBuffer *preview = NULL;
+    GstMapInfo pinfo;
+    GstVideoInfo pvinfo;
+    gint preview_factor = 0;
+    unsigned char *level[GST_TOUPCAM_PYRAMID_MAX_LEVELS];
+    gboolean fuse_level = FALSE;
+    gboolean x8_direct;
+    gboolean drop_stale;
+    // staged has the rows of a pulled frame without padding
+    gboolean packed = TRUE;
 
     // minfo size 4096, maxsize 4103, flags 0x00000002
-    gst_buffer_map(buf, &minfo, GST_MAP_WRITE);
+    if (!gst_buffer_map(buf, &minfo, GST_MAP_WRITE)) {
+        GST_ERROR_OBJECT(src, "failed to map output buffer");
+        return GST_FLOW_ERROR;
+    }
     GST_DEBUG_OBJECT(src,
                      "minfo size %" G_GSIZE_FORMAT ", maxsize %"
                      G_GSIZE_FORMAT ", flags 0x%08X", minfo.size,
                      minfo.maxsize, minfo.flags);
-    // XXX: debugging crash
-    if (minfo.size != src->image_bytes_out) {
+    // Downstream pools may hand out larger buffers
+    if (minfo.size < src->image_bytes_out + src->pyramid_bytes) {
         gst_buffer_unmap(buf, &minfo);
         GST_ERROR_OBJECT(src,
-                         "bad minfo size. Expect %d, got %" G_GSIZE_FORMAT,
-                         src->image_bytes_out, minfo.size);
+                         "bad minfo size. Expect %" G_GSIZE_FORMAT ", got %"
+                         G_GSIZE_FORMAT,
+                         src->image_bytes_out + src->pyramid_bytes,
+                         minfo.size);
         return GST_FLOW_ERROR;
     }
 
-    camsdk(FrameInfoV2) info = { 0 };
-    if (src->raw) {
-        /*
-           RGBA, 16 bit => 4 * 2 => 64 bit
-           Source data raw => densely packed into 16 bit areas
-         */
+    install_pending_masters(src);
+    update_hdr(src);
+    x8_direct = x8_pull_direct(src);
 
-        if (sizeof(raw_buff) < src->image_bytes_in) {
-            gst_buffer_unmap(buf, &minfo);
-            GST_ERROR_OBJECT(src,
-                             "insufficient frame buffer size. Need %d, got %d",
-                             src->image_bytes_in, src->image_bytes_in);
-            return GST_FLOW_ERROR;
+    camsdk(FrameInfoV2) info = { 0 };
+    // Frame as pulled, before any correction / conversion
+    unsigned char *staged = NULL;
+    if (src->hdr_count) {
+        ret = pull_hdr_frames(src, &info);
+        staged = src->frame_buff;
+    } else if (src->stack_frames > 1 && src->qos_level < QOS_SINGLE_FRAME) {
+        ret = pull_stack_frames(src, &info);
+        staged = src->frame_buff;
+    } else if (src->best_of > 1 && src->qos_level < QOS_SINGLE_FRAME) {
+        // x8 can pull candidates directly into an unpadded output buffer
+        unsigned char *slot = minfo.data;
+
+        if (src->raw || src->x16 || !x8_direct || !x8_rows_packed(src)) {
+            if (!src->best_buff) {
+                src->best_buff = g_malloc(src->image_bytes_in);
+            }
+            slot = src->best_buff;
         }
+        ret = pull_best_frame(src, slot, &staged, &info);
+    } else if (src->raw || src->x16 || !x8_direct) {
+        staged = get_frame_buff(src);
+        ret = pull_frame(src, staged, ROW_PITCH_PACKED, &info);
+    } else {
+        // x8 is already in the output format, pulled with its stride
+        staged = minfo.data;
+        packed = x8_rows_packed(src);
+        ret = pull_frame(src, staged, src->out_stride, &info);
+    }
+    // HDR already resolved each exposure as it was pulled
+    if (ret == GST_FLOW_OK && !src->hdr_count) {
+        unsigned expotime;
 
-        // From the grabber source we get 1 progressive frame
-        GST_DEBUG_OBJECT(src, "pulling raw image");
-        HRESULT hr = camsdk_(PullImageV2) (src->hCam, &raw_buff, 0, &info);
-        if (FAILED(hr)) {
-            GST_ERROR_OBJECT(src, "failed to pull image, hr = %08x", hr);
-            gst_buffer_unmap(buf, &minfo);
-            return GST_FLOW_ERROR;
-        }
+        g_mutex_lock(&src->mutex);
+        expotime = src->cur_expotime;
+        g_mutex_unlock(&src->mutex);
+        resolve_generation(src, exposure_start(src, &info, expotime));
+    }
 
-        GST_DEBUG_OBJECT(src, "decoding image");
-        GBRG12_to_ARGB64_x4(src, raw_buff, minfo.data);
-        // memset(minfo.data, 0x80, src->nWidth * src->nHeight * 7);
-#if 0
-        {
-            FILE *fp;
+    // Don't spend a conversion on a frame that is going to be dropped
+    if (ret == GST_FLOW_OK && late) {
+        gst_buffer_unmap(buf, &minfo);
+        GST_DEBUG_OBJECT(src, "QoS dropping frame %u", info.seq);
+        return FLOW_FRAME_DROPPED;
+    }
+    GST_OBJECT_LOCK(src);
+    drop_stale = src->drop_stale;
+    GST_OBJECT_UNLOCK(src);
+    if (ret == GST_FLOW_OK && drop_stale && src->frame_stale) {
+        gst_buffer_unmap(buf, &minfo);
+        GST_DEBUG_OBJECT(src, "Dropping stale generation %u frame",
+                         src->frame_gen);
+        g_atomic_int_inc(&src->stale_frames);
+        return FLOW_FRAME_DROPPED;
+    }
+
+    preview_pad = ret == GST_FLOW_OK ? preview_due(src, &preview_factor)
+        : NULL;
+    if (preview_pad) {
+        preview_configure(src, preview_pad, preview_factor, &pvinfo);
+        preview = gst_buffer_new_allocate(NULL,
+                                          GST_VIDEO_INFO_SIZE(&pvinfo),
+                                          NULL);
+        gst_buffer_map(preview, &pinfo, GST_MAP_WRITE);
+    }
+    if (ret == GST_FLOW_OK && src->pyramid_count > 1) {
+        pyramid_map(src, &minfo, level);
+        // Level 1 is filtered in the conversion pass unless the preview
+        // pad is using it
+        fuse_level = !preview;
+    }
 
-            fp = fopen("raw.bin", "wb");
-            fwrite(minfo.data, 1, src->image_bytes_out, fp);
-            fclose(fp);
+    if (ret == GST_FLOW_OK) {
+        // Masters are built from uncorrected single exposures
+        // Padded frames are left for the next, see x8_pull_direct()
+        if (!src->hdr_count && packed) {
+            capture_master_frame(src, staged);
         }
-#endif
-    } else if (src->x16) {
-        if (sizeof(raw_buff) < src->image_bytes_in) {
-            GST_ERROR_OBJECT(src,
-                             "insufficient frame buffer size. Need %d, got %d",
-                             src->image_bytes_in, src->image_bytes_in);
-            gst_buffer_unmap(buf, &minfo);
-            return GST_FLOW_ERROR;
+        if (packed) {
+            track_motion(src, staged, info.seq);
         }
-
-        GST_DEBUG_OBJECT(src, "pulling x16 image");
-        HRESULT hr =
-            camsdk_(PullImageV2) (src->hCam, &raw_buff, 48, &info);
-        if (FAILED(hr)) {
-            GST_ERROR_OBJECT(src, "failed to pull image, hr = %08x", hr);
-            gst_buffer_unmap(buf, &minfo);
-            return GST_FLOW_ERROR;
+        if (src->qos_level < QOS_SKIP_OPTIONAL && packed) {
+            correct_defects(src, staged);
         }
-
-        GST_DEBUG_OBJECT(src, "decoding image");
-        RGB48_to_ARGB64_x4(src, raw_buff, minfo.data);
-    } else {
-        GST_DEBUG_OBJECT(src, "pulling x8 image");
-        HRESULT hr =
-            camsdk_(PullImageV2) (src->hCam, minfo.data, 24, &info);
-        if (FAILED(hr)) {
-            GST_ERROR_OBJECT(src, "failed to pull image, hr = %08x", hr);
-            gst_buffer_unmap(buf, &minfo);
-            return GST_FLOW_ERROR;
+        if (fuse_level) {
+            decode_frame(src, staged, minfo.data, level[1],
+                         src->pyramid_stride[1], 2);
+        } else {
+            decode_frame(src, staged, minfo.data,
+                         preview ? pinfo.data : NULL,
+                         preview ? GST_VIDEO_INFO_PLANE_STRIDE(&pvinfo,
+                                                               0) : 0,
+                         preview_factor);
+        }
+        if (src->pyramid_count > 1) {
+            pyramid_build(src, level, fuse_level ? 2 : 1);
         }
     }
 
     gst_buffer_unmap(buf, &minfo);
+    if (preview) {
+        gst_buffer_unmap(preview, &pinfo);
+        preview_push(src, preview_pad, preview);
+        gst_object_unref(preview_pad);
+    }
+    if (ret != GST_FLOW_OK) {
+        return ret;
+    }
 
-    src->imagesPulled += 1;
     /* After we get the image data, we can do anything for the data we want to do
      */
     GST_DEBUG_OBJECT(src,
@@ -1650,26 +5124,318 @@ static GstFlowReturn pull_decode_frame(GstToupCamSrc * src,
                      ++src->m_total, info.width, info.height);
     GST_DEBUG_OBJECT(src, "flag %u, seq %u, us %llu", info.flag, info.seq,
                      info.timestamp);
+    add_frame_meta(src, buf, &info);
+    add_layout_meta(src, buf);
 
     return GST_FLOW_OK;
 }
 
-static GstFlowReturn gst_toupcam_src_alloc(GstPushSrc * psrc,
-                                           GstBuffer ** buf)
+static void stats_add_fields(GstStructure * s, const char *name,
+                             const ToupcamTimeHist * h)
 {
-    GstFlowReturn ret;
+    gchar *p50 = g_strdup_printf("%s-p50", name);
+    gchar *p99 = g_strdup_printf("%s-p99", name);
+    gchar *max = g_strdup_printf("%s-max", name);
+
+    gst_structure_set(s,
+                      p50, G_TYPE_UINT64,
+                      toupcam_time_hist_percentile(h, 50.0),
+                      p99, G_TYPE_UINT64,
+                      toupcam_time_hist_percentile(h, 99.0),
+                      max, G_TYPE_UINT64, h->max, NULL);
+    g_free(p50);
+    g_free(p99);
+    g_free(max);
+}
 
-    GstToupCamSrc *src = GST_TOUPCAM_SRC(psrc);
+// Snapshot the window into src->stats, optionally posting it
+static void stats_publish(GstToupCamSrc * src, gint64 now)
+{
+    gdouble secs = (now - src->stats_start) / (gdouble) G_USEC_PER_SEC;
+    GstStructure *s;
+    gboolean post;
+    gint images;
+
+    g_mutex_lock(&src->mutex);
+    images = src->imagesAvailable;
+    g_mutex_unlock(&src->mutex);
+
+    s = gst_structure_new("toupcamsrc-stats",
+                          "interval", G_TYPE_DOUBLE, secs,
+                          "frames", G_TYPE_INT, src->n_frames,
+                          "fps", G_TYPE_DOUBLE, src->stats_frames / secs,
+                          "device-fps", G_TYPE_DOUBLE,
+                          (images - src->stats_images) / secs,
+                          "bytes-per-sec", G_TYPE_DOUBLE,
+                          src->stats_bytes / secs,
+                          "timeouts", G_TYPE_INT, src->total_timeouts,
+                          "dropped-frames", G_TYPE_INT,
+                          g_atomic_int_get(&src->dropped_frames),
+                          "queue-depth", G_TYPE_UINT, src->stats_queue,
+                          "queue-depth-max", G_TYPE_UINT,
+                          src->stats_queue_max,
+                          "qos-level", G_TYPE_INT, src->qos_level,
+                          "qos-degrades", G_TYPE_UINT, src->qos_degrades,
+                          "qos-restores", G_TYPE_UINT, src->qos_restores,
+                          "qos-dropped", G_TYPE_UINT64, src->qos_dropped,
+                          NULL);
+    stats_add_fields(s, "wait", &src->stats_wait);
+    stats_add_fields(s, "pull", &src->stats_pull);
+    stats_add_fields(s, "convert", &src->stats_convert);
+    stats_add_fields(s, "push", &src->stats_push);
+
+    GST_OBJECT_LOCK(src);
+    if (src->stats) {
+        gst_structure_free(src->stats);
+    }
+    src->stats = s;
+    post = src->post_stats;
+    GST_OBJECT_UNLOCK(src);
+
+    if (post) {
+        gst_element_post_message(GST_ELEMENT(src),
+                                 gst_message_new_element(GST_OBJECT(src),
+                                                         gst_structure_copy
+                                                         (s)));
+    }
+    stats_reset(src, now);
+}
+
+// Hand the finished frame's span to the tracer and CSV dump
+static void log_span(GstToupCamSrc * src)
+{
+    const ToupcamSpan *s = &src->span;
+
+    gst_tracer_record_log(span_record, GST_OBJECT_NAME(src), s->seq,
+                          (guint64) s->callback, (guint64) s->wake,
+                          (guint64) s->pull_start, (guint64) s->pull_end,
+                          (guint64) s->convert_end, (guint64) s->push);
+    if (src->span_ring) {
+        toupcam_span_ring_push(src->span_ring, s);
+    }
+}
+
+/*
+Per frame accounting, t0 is when fill was entered
+push is the time between fills, ie downstream plus buffer allocation
+*/
+static void stats_begin_frame(GstToupCamSrc * src, gint64 t0)
+{
+    if (src->stats_fill_end) {
+        toupcam_time_hist_add(&src->stats_push, t0 - src->stats_fill_end);
+    }
+    src->stats_io = 0;
+    memset(&src->span, 0, sizeof(src->span));
+}
+
+static void stats_end_frame(GstToupCamSrc * src, gint64 t0, guint queue)
+{
+    gint64 now = g_get_monotonic_time();
+    gdouble interval;
+
+    toupcam_time_hist_add(&src->stats_convert, now - t0 - src->stats_io);
+    src->span.push = now;
+    log_span(src);
+    src->stats_frames++;
+    src->stats_bytes += src->image_bytes_out;
+    src->stats_queue = queue;
+    src->stats_queue_max = MAX(src->stats_queue_max, queue);
+    src->stats_fill_end = now;
+
+    GST_OBJECT_LOCK(src);
+    interval = src->stats_interval;
+    GST_OBJECT_UNLOCK(src);
+    if (now - src->stats_start >= interval * G_USEC_PER_SEC) {
+        stats_publish(src, now);
+    }
+}
+
+/*
+Apply GstController values for the current running time (the buffer
+timestamp with do-timestamp) before waiting for the next frame
+Writes that don't change a value are skipped, see control_unchanged()
+*/
+static void sync_controlled(GstToupCamSrc * src)
+{
+    GstClock *clock;
+    GstClockTime now;
+    GstClockTime base;
+    GParamSpec **props;
+    guint n_props;
+    GPtrArray *skipped;
+
+    if (!src->hCam
+        || !gst_object_has_active_control_bindings(GST_OBJECT(src))) {
+        return;
+    }
+    clock = gst_element_get_clock(GST_ELEMENT(src));
+    if (!clock) {
+        return;
+    }
+    now = gst_clock_get_time(clock);
+    gst_object_unref(clock);
+    base = gst_element_get_base_time(GST_ELEMENT(src));
+    if (now < base) {
+        return;
+    }
+    now -= base;
+
+    // Decided here rather than in set_property() so application sets are
+    // never mistaken for controller ones. Bindings whose value wouldn't
+    // change anything are disabled for this sync only
+    props = g_object_class_list_properties(G_OBJECT_GET_CLASS(src),
+                                           &n_props);
+    skipped = g_ptr_array_new();
+    for (guint i = 0; i < n_props; ++i) {
+        GstControlBinding *binding;
+        GValue *value;
+
+        binding = gst_object_get_control_binding(GST_OBJECT(src),
+                                                 props[i]->name);
+        if (!binding) {
+            continue;
+        }
+        value = gst_control_binding_is_disabled(binding) ? NULL
+            : gst_control_binding_get_value(binding, now);
+        if (value && control_unchanged(src, props[i]->param_id, value)) {
+            gst_control_binding_set_disabled(binding, TRUE);
+            g_ptr_array_add(skipped, binding);
+        } else {
+            gst_object_unref(binding);
+        }
+        if (value) {
+            g_value_unset(value);
+            g_free(value);
+        }
+    }
+    g_free(props);
+
+    gst_object_sync_values(GST_OBJECT(src), now);
+
+    for (guint i = 0; i < skipped->len; ++i) {
+        gst_control_binding_set_disabled(skipped->pdata[i], FALSE);
+        gst_object_unref(skipped->pdata[i]);
+    }
+    g_ptr_array_unref(skipped);
+}
+
+/*
+Step the QoS level up while downstream reports being late and back down once
+it keeps up, see QOS_STEP_US / QOS_RECOVER_US
+QoS that hasn't been refreshed for QOS_RECOVER_US (sink not syncing, branch
+removed) counts as keeping up
+*/
+static void qos_update(GstToupCamSrc * src)
+{
+    gint64 now = g_get_monotonic_time();
+    gboolean enabled;
+    gboolean late = FALSE;
+    gboolean ahead = TRUE;
+    gint level = src->qos_level;
+
+    GST_OBJECT_LOCK(src);
+    enabled = src->qos;
+    if (src->qos_event_time && now - src->qos_event_time < QOS_RECOVER_US) {
+        late = src->qos_diff > 0 || src->qos_proportion > 1.0;
+        ahead = src->qos_proportion < QOS_RECOVER_PROPORTION;
+    }
+    GST_OBJECT_UNLOCK(src);
+
+    if (late) {
+        src->qos_late_time = now;
+    }
+    if (!enabled) {
+        level = QOS_FULL;
+    } else if (late && level < QOS_DROP
+               && now - src->qos_changed >= QOS_STEP_US) {
+        level++;
+    } else if (!late && ahead && level > QOS_FULL
+               && now - MAX(src->qos_changed, src->qos_late_time) >=
+               QOS_RECOVER_US) {
+        level--;
+    }
+    if (level == src->qos_level) {
+        return;
+    }
+    if (level > src->qos_level) {
+        src->qos_degrades++;
+    } else {
+        src->qos_restores++;
+    }
+    GST_INFO_OBJECT(src, "QoS level %d => %d", src->qos_level, level);
+    src->qos_level = level;
+    src->qos_changed = now;
+}
+
+/*
+At QOS_DROP, TRUE if a frame pushed now would reach the sink late
+As GstVideoDecoder, skips ahead twice the lateness plus a frame
+*running_time is set for the QoS message
+*/
+static gboolean qos_frame_late(GstToupCamSrc * src,
+                               GstClockTime * running_time)
+{
+    GstClockTimeDiff diff;
+    GstClockTime timestamp;
+    GstClock *clock;
+    GstClockTime now;
+    GstClockTime base;
+
+    if (src->qos_level < QOS_DROP) {
+        return FALSE;
+    }
+    GST_OBJECT_LOCK(src);
+    diff = src->qos_diff;
+    timestamp = src->qos_timestamp;
+    GST_OBJECT_UNLOCK(src);
+    // Without a frame duration (framerate not known yet) there is nothing
+    // to project the deadline with
+    if (diff <= 0 || !GST_CLOCK_TIME_IS_VALID(timestamp)
+        || !GST_CLOCK_TIME_IS_VALID(src->duration)) {
+        return FALSE;
+    }
 
-    *buf = gst_buffer_new_allocate(NULL, src->image_bytes_out, NULL);
-    if (G_UNLIKELY(*buf == NULL)) {
-        GST_DEBUG_OBJECT(src, "Failed to allocate %u bytes",
-                         src->image_bytes_out);
-        ret = GST_FLOW_ERROR;
+    clock = gst_element_get_clock(GST_ELEMENT(src));
+    if (!clock) {
+        return FALSE;
+    }
+    now = gst_clock_get_time(clock);
+    gst_object_unref(clock);
+    base = gst_element_get_base_time(GST_ELEMENT(src));
+    if (now < base) {
+        return FALSE;
     }
-    ret = GST_FLOW_OK;
+    *running_time = now - base;
+    return *running_time < timestamp + 2 * diff + src->duration;
+}
+
+// Count a frame pull_decode_frame() dropped for being late and post a QoS
+// message
+static void qos_frame_dropped(GstToupCamSrc * src,
+                              GstClockTime running_time)
+{
+    GstMessage *msg;
+
+    src->qos_dropped++;
+    msg = gst_message_new_qos(GST_OBJECT(src), TRUE, running_time,
+                              GST_CLOCK_TIME_NONE, GST_CLOCK_TIME_NONE,
+                              src->duration);
+    gst_message_set_qos_stats(msg, GST_FORMAT_BUFFERS, src->qos_processed,
+                              src->qos_dropped);
+    gst_element_post_message(GST_ELEMENT(src), msg);
+}
 
-    return ret;
+// Keep a ref to buf for last-sample and waiting grabs
+// Only the ref is taken per frame, the sample is built when asked for
+static void store_last_sample(GstToupCamSrc * src, GstBuffer * buf)
+{
+    g_mutex_lock(&src->last_lock);
+    if (src->enable_last_sample || src->grab_waiters) {
+        gst_buffer_replace(&src->last_buffer, buf);
+        src->last_count++;
+        g_cond_broadcast(&src->last_cond);
+    }
+    g_mutex_unlock(&src->last_lock);
 }
 
 // Override the push class fill fn, using the default create and alloc fns.
@@ -1689,6 +5455,7 @@ static GstFlowReturn gst_toupcam_src_fill(GstPushSrc * psrc,
     if (psrc->parent.num_buffers > 0) {
         if (G_UNLIKELY(src->n_frames >= psrc->parent.num_buffers)) {
             GST_DEBUG_OBJECT(src, "EOS");
+            preview_eos(src);
             return GST_FLOW_EOS;
         }
     }
@@ -1696,14 +5463,41 @@ static GstFlowReturn gst_toupcam_src_fill(GstPushSrc * psrc,
     GST_DEBUG_OBJECT(src, " ");
     GST_DEBUG_OBJECT(src, "waiting for new image");
 
-    if (wait_new_frame(src) != GST_FLOW_OK) {
-        GST_ERROR_OBJECT(src, "Failed to get next frame");
-        return GST_FLOW_ERROR;
-    }
-    if (pull_decode_frame(src, buf) != GST_FLOW_OK) {
+    gint64 t0 = g_get_monotonic_time();
+    GstClockTime running_time;
+    GstFlowReturn ret;
+    guint queue;
+    gboolean late;
+
+    stats_begin_frame(src, t0);
+    // Dropped frames are skipped here rather than returned to basesrc,
+    // GST_BASE_SRC_FLOW_DROPPED needs a newer GStreamer than we require
+    do {
+        // Spans describe the frame that is output
+        memset(&src->span, 0, sizeof(src->span));
+        sync_controlled(src);
+        qos_update(src);
+        if (wait_new_frame(src) != GST_FLOW_OK) {
+            GST_ERROR_OBJECT(src, "Failed to get next frame");
+            preview_eos(src);
+            return GST_FLOW_ERROR;
+        }
+        late = qos_frame_late(src, &running_time);
+        // Frames the SDK has queued behind the one we're about to pull
+        g_mutex_lock(&src->mutex);
+        queue = src->imagesAvailable - src->imagesPulled - 1;
+        g_mutex_unlock(&src->mutex);
+        ret = pull_decode_frame(src, buf, late);
+        if (ret == FLOW_FRAME_DROPPED && late) {
+            qos_frame_dropped(src, running_time);
+        }
+    } while (ret == FLOW_FRAME_DROPPED);
+    if (ret != GST_FLOW_OK) {
         GST_ERROR_OBJECT(src, "Failed to decode frame");
+        preview_eos(src);
         return GST_FLOW_ERROR;
     }
+    src->span.convert_end = g_get_monotonic_time();
 
     /*
        // If we do not use gst_base_src_set_do_timestamp() we need to add timestamps
@@ -1718,11 +5512,15 @@ static GstFlowReturn gst_toupcam_src_fill(GstPushSrc * psrc,
      */
     GST_BUFFER_PTS(buf) = GST_CLOCK_TIME_NONE;
     GST_BUFFER_DTS(buf) = GST_CLOCK_TIME_NONE;
-    GST_BUFFER_DURATION(buf) = GST_CLOCK_TIME_NONE;
+    GST_BUFFER_DURATION(buf) = src->duration;
 
     // count frames, and send EOS when required frame number is reached
     GST_BUFFER_OFFSET(buf) = src->n_frames;     // from videotestsrc
     src->n_frames++;
+    src->qos_processed++;
+    update_framerate(src);
+    store_last_sample(src, buf);
+    stats_end_frame(src, t0, queue);
 
     return GST_FLOW_OK;
 }
@@ -10,6 +10,11 @@
 
 #include <gst/base/gstpushsrc.h>
 
+#include "gsttoupcammeta.h"
+#include "toupcamcal.h"
+#include "toupcamproc.h"
+#include "toupcamstats.h"
+
 /*
 ToupTek Photonics SDK gets rebranded to a few other things
 Ease integration with other variants
@@ -25,7 +30,10 @@ TODO: add tucsen rebrand
 */
 
 // XXX: SDK_BRANDING
+// ./configure --with-sdk=sim defines CAMSDK_SIM
+#ifndef CAMSDK_SIM
 #define CAMSDK_TOUPTEK
+#endif
 // Amscope
 //#define CAMSDK_AMCAM
 //? "MIView", Came with 25 MP camera
@@ -69,6 +77,14 @@ release
 #define camsdk_(x) Swiftcam_##x
 #define CAMSDK_(x) SWIFTCAM_##x
 #define CAMDSK_BRAND "swiftcam"
+#elif defined(CAMSDK_SIM)
+// In process simulated camera, see simcam.h
+#include "simcam.h"
+#define camsdk(x) Simcam##x
+#define camsdk_(x) Simcam_##x
+#define CAMSDK_(x) SIMCAM_##x
+#define CAMSDK_HANDLE HSimcam
+#define CAMDSK_BRAND "simcam"
 #else
 #error Need SDK brand
 #endif
@@ -86,6 +102,9 @@ G_BEGIN_DECLS
 typedef struct _GstToupCamSrc GstToupCamSrc;
 typedef struct _GstToupCamSrcClass GstToupCamSrcClass;
 
+// Control writes remembered to resolve frame generations
+#define TOUPCAM_GEN_HISTORY 16
+
 struct _GstToupCamSrc {
     GstPushSrc base_toupcam_src;
 
@@ -100,6 +119,8 @@ struct _GstToupCamSrc {
     CAMSDK_HANDLE hCam;         // device handle
     gboolean raw;
     gboolean x16;
+    // x16 pull, tone mapped to 8 bit RGB output (x16 is also set)
+    gboolean x16to8;
     gint esize;
     gint nWidth;
     gint nHeight;
@@ -109,13 +130,23 @@ struct _GstToupCamSrc {
     gint bytes_per_pix_out;
     gint image_bytes_out;
     gint m_total;
-    gint gst_stride;            // Stride/pitch for the GStreamer buffer
+    // Bytes per row of the output image, see output_layout()
+    gint out_stride;
 
+    // Staging buffer for frames that need post processing before output
     unsigned char *frame_buff;
 
     // gst properties
+    // Nominal frame rate advertised in caps, 0 => unknown
+    // Written by the streaming thread under the object lock
     gdouble framerate;
+    // max-framerate, 0 => no limit
+    // maxframerate and framerate_dirty: object lock
     gdouble maxframerate;
+    gboolean framerate_dirty;
+    // Rate the camera is limited to by the SDK, 0 => unknown
+    // Only touched by the streaming thread
+    gdouble camera_framerate;
     // library based properties
     // bool
     int hflip;
@@ -136,6 +167,137 @@ struct _GstToupCamSrc {
     int awb_rgb;
     int awb_tt;
 
+    // frame stacking
+    gint stack_frames;
+    guint32 *stack_acc;
+
+    // best of N frame selection
+    gint best_of;
+    unsigned char *best_buff;
+
+    // HDR exposure bracketing, see pull_hdr_frames()
+    // hdr_exposures_str, hdr_request*, hdr_dirty: object lock
+    gchar *hdr_exposures_str;
+    guint32 hdr_request[TOUPCAM_HDR_MAX];
+    gint hdr_request_count;
+    gboolean hdr_dirty;
+    // Only touched by the streaming thread
+    // 0 when off
+    gint hdr_count;
+    guint32 hdr_expotime[TOUPCAM_HDR_MAX];
+    // hdr_count pulled frames
+    guint16 *hdr_frames;
+    // Radiance to 12 bit for x16to8
+    guint16 *hdr_curve;
+    gboolean hdr_reverse;
+    // Last exposure written by bracketing, 0 => none yet
+    unsigned hdr_set_expotime;
+    // Restored when bracketing is turned off
+    unsigned hdr_saved_expotime;
+    int hdr_saved_auto;
+
+    // dark / flat field correction
+    // Only touched by the streaming thread
+    ToupcamMaster *dark;
+    ToupcamMaster *flat;
+    gboolean cal_warned;
+    ToupcamMasterKind capture_kind;
+    gint capture_frames;
+    gint capture_count;
+    guint32 *capture_acc;
+    // Protected by the object lock, picked up by the streaming thread
+    gchar *dark_file;
+    gchar *flat_file;
+    ToupcamMaster *pending_dark;
+    gboolean dark_pending;
+    ToupcamMaster *pending_flat;
+    gboolean flat_pending;
+    ToupcamMasterKind capture_request;
+    gint capture_request_frames;
+
+    // hot / dead pixel correction
+    // Only touched by the streaming thread
+    ToupcamDefectMap *defects;
+    // Protected by the object lock
+    gchar *defect_dir;
+    gdouble defect_sigma;
+    gboolean defect_request;
+
+    // Host color processing for raw / x16
+    // Protected by the object lock
+    gchar *host_ccm_str;
+    gboolean host_ccm_set;
+    gdouble host_ccm[9];
+    gdouble host_wb[3];
+    gdouble host_gamma;
+    gboolean color_dirty;
+    gint convert_threads;
+    // Only touched by the streaming thread
+    ToupcamColor *color;
+    ToupcamWorkers *workers;
+
+    // x16to8 tone mapping
+    // Protected by the object lock
+    gint tonemap_interval;
+    gdouble tonemap_low;
+    gdouble tonemap_high;
+    // Only touched by the streaming thread
+    ToupcamTonemap *tonemap;
+    gboolean tonemap_dirty;
+    guint32 *tonemap_hist;
+    guint tonemap_frames;
+    guint32 tonemap_black;
+    guint32 tonemap_white;
+
+    // "preview" request pad
+    // Protected by the object lock
+    GstPad *preview_pad;
+    gboolean preview_new;
+    gint preview_factor;
+    gint preview_width;
+    gdouble preview_max_fps;
+    // Only touched by the streaming thread
+    gboolean preview_started;
+    gint preview_cur_factor;
+    gint64 preview_last;
+
+    // memfd backed output buffers
+    // Set before start
+    gboolean memfd;
+    gboolean memfd_hugepages;
+
+    // Mipmap pyramid output, see pyramid_layout()
+    // Set before start
+    gint pyramid_levels;
+    // Layout for this stream, levels including 0 (1 => off)
+    gint pyramid_count;
+    guint pyramid_width[GST_TOUPCAM_PYRAMID_MAX_LEVELS];
+    guint pyramid_height[GST_TOUPCAM_PYRAMID_MAX_LEVELS];
+    gsize pyramid_offset[GST_TOUPCAM_PYRAMID_MAX_LEVELS];
+    gint pyramid_stride[GST_TOUPCAM_PYRAMID_MAX_LEVELS];
+    // Bytes of the levels after 0
+    gsize pyramid_bytes;
+
+    // Software crop, see crop_window()
+    // Set before start, 0 width / height => to the frame edge
+    gint crop_x;
+    gint crop_y;
+    gint crop_width;
+    gint crop_height;
+    // Only touched by the streaming thread
+    // Window for this stream, x, y, w, h in frame pixels, w x h is the caps
+    gint crop[4];
+    gboolean cropping;
+    // Downstream takes full frames with GstVideoCropMeta, else crop is copied
+    gboolean crop_meta;
+
+    // Pad output rows to a multiple of this many bytes, 0 => caps default
+    // Set before start
+    gint row_align;
+    // Only touched by the streaming thread
+    // Downstream reads GstVideoMeta strides / offsets
+    gboolean video_meta;
+
     // stream
     gint n_frames;
     gint total_timeouts;
@@ -145,10 +307,143 @@ struct _GstToupCamSrc {
     gint imagesPulled;
     GMutex mutex;
     GCond cond;
+
+    // Frame metadata
+    // Exposure in effect, updated from the SDK callback under mutex
+    unsigned cur_expotime;
+    unsigned short cur_expoagain;
+    // Only touched by the streaming thread
+    unsigned roi[4];
+    gboolean have_seq;
+    unsigned last_seq;
+    // Dropped since the last output buffer
+    guint seq_dropped;
+    // Dropped since start, atomic
+    gint dropped_frames;
+
+    // Live statistics
+    // Protected by the object lock
+    gdouble stats_interval;
+    gboolean post_stats;
+    GstStructure *stats;
+    // Only touched by the streaming thread
+    gint64 stats_start;
+    gint64 stats_fill_end;
+    // Time spent waiting / pulling for the current frame
+    gint64 stats_io;
+    guint stats_frames;
+    gint stats_images;
+    guint64 stats_bytes;
+    guint stats_queue;
+    guint stats_queue_max;
+    ToupcamTimeHist stats_wait;
+    ToupcamTimeHist stats_pull;
+    ToupcamTimeHist stats_convert;
+    ToupcamTimeHist stats_push;
+
+    // Per frame timing spans
+    // Time of the last SDK image event, under mutex
+    gint64 image_event_time;
+    // Only touched by the streaming thread
+    ToupcamSpan span;
+    // GST_TOUPCAMSRC_TRACE CSV dump, NULL when off
+    ToupcamSpanRing *span_ring;
+    GThread *span_thread;
+    gint span_running;
+    FILE *span_file;
+
+    // Exposure settling, see track_exposure()
+    // settle_tolerance, settle_frames and settle_rearm: object lock
+    gdouble settle_tolerance;
+    gint settle_frames;
+    gboolean settle_rearm;
+    // Only touched by the streaming thread
+    unsigned settle_expotime;
+    unsigned short settle_expoagain;
+    gint settle_count;
+    gint settle_moving;
+    gint64 settle_start;
+    // exposure-settled property, atomic
+    gint exposure_settled;
+
+    // Motion settling, see track_motion()
+    // Object lock
+    gboolean motion_detect;
+    // Pixels
+    gdouble motion_tolerance;
+    gdouble motion_difference;
+    gint motion_frames;
+    gboolean motion_rearm;
+    // Only touched by the streaming thread
+    // Projections of the previous / current frame, columns then rows
+    guint32 *motion_prev;
+    guint32 *motion_cur;
+    gboolean motion_have_prev;
+    gint motion_width;
+    gint motion_height;
+    gint motion_count;
+    gint motion_moving;
+    gint64 motion_start;
+    // motion-settled property, atomic
+    gint motion_settled;
+
+    // Settings generations, see settings_changed()
+    // Object lock
+    guint settings_gen;
+    // Host time (us) of each control write, by generation % HISTORY
+    gint64 gen_time[TOUPCAM_GEN_HISTORY];
+    gint settings_latency;
+    gboolean drop_stale;
+    // Only touched by the streaming thread
+    // Sensor readout time from the SDK's maximum frame rate, 0 => unknown
+    gint64 readout_us;
+    // Host minus device clock, smallest seen
+    gboolean have_clock_offset;
+    gint64 clock_offset;
+    guint frame_gen;
+    gboolean frame_stale;
+    // stale-frames property, atomic
+    gint stale_frames;
+
+    // Most recent buffer for last-sample / grab, see store_last_sample()
+    // last_lock
+    GMutex last_lock;
+    GCond last_cond;
+    gboolean enable_last_sample;
+    GstBuffer *last_buffer;
+    // Buffers stored since start, grab waits for this to change
+    guint64 last_count;
+    gint grab_waiters;
+    // Set by stop() to release waiting grabs
+    gboolean last_flushing;
+
+    // Downstream QoS, see qos_update()
+    // Object lock
+    gboolean qos;
+    gdouble qos_proportion;
+    GstClockTimeDiff qos_diff;
+    GstClockTime qos_timestamp;
+    // Monotonic us of the last QoS event, 0 => none since start
+    gint64 qos_event_time;
+    // Only touched by the streaming thread
+    gint qos_level;
+    gint64 qos_changed;
+    gint64 qos_late_time;
+    guint qos_degrades;
+    guint qos_restores;
+    guint64 qos_processed;
+    guint64 qos_dropped;
 };
 
 struct _GstToupCamSrcClass {
     GstPushSrcClass base_toupcam_src_class;
+
+    // action signals
+    void (*capture_dark) (GstToupCamSrc * src, gint frames);
+    void (*capture_flat) (GstToupCamSrc * src, gint frames);
+    void (*build_defect_map) (GstToupCamSrc * src);
+    void (*rearm_motion) (GstToupCamSrc * src);
+    GstSample *(*grab) (GstToupCamSrc * src, guint64 timeout);
 };
 
 GType gst_toupcam_src_get_type(void);
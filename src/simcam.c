@@ -0,0 +1,934 @@
+/* GStreamer ToupCam Plugin
+ * Copyright (C) 2022 Labsmore LLC
+ *
+ * Author John McMaster <johndmcmaster@gmail.com>
+ * Author Kishore Arepalli <kishore.arepalli@gmail.com>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "simcam.h"
+
+#define SIM_EXPOTIME_MIN 100
+#define SIM_EXPOTIME_MAX 5000000
+#define SIM_EXPOTIME_DEF 10000
+#define SIM_EXPOAGAIN_MAX 5000
+// Auto exposure converges on this exposure time (us x gain / 100)
+#define SIM_AE_TARGET 20000
+
+// Pattern period in pixels, must be a power of 2
+#define SIM_PERIOD 256
+// Announced frames kept until pulled, as the SDK's OPTION_FRAME_DEQUE_LENGTH
+#define SIM_DEQUE_LENGTH 3
+
+typedef struct {
+    gint width;
+    gint height;
+    gdouble fps;
+    gint bits;
+    gint jitter;
+    gdouble drop;
+    gint cameras;
+    SimcamModelV2 model;
+} SimConfig;
+
+typedef struct {
+    unsigned seq;
+    guint64 timestamp;
+} SimFrame;
+
+typedef struct {
+    GMutex lock;
+    GCond cond;
+    GThread *thread;
+    gboolean running;
+    PSIMCAM_EVENT_CALLBACK callback;
+    void *ctx;
+    gint index;
+
+    // Settings
+    unsigned esize;
+    int raw;
+    int bitdepth;
+    int rgb48;
+    int pixel_format;
+    int byteorder;
+    // 0 => no limit, whole fps
+    int framerate;
+    // 0.1 fps, 0 => no limit
+    int precise_framerate;
+    int hflip;
+    int vflip;
+    int auto_expo;
+    unsigned expotime;
+    unsigned short expoagain;
+    gboolean expo_event;
+    int hue;
+    int saturation;
+    int brightness;
+    int contrast;
+    int gamma;
+    int wb[3];
+    unsigned short bb[3];
+
+    // Latest frame
+    unsigned seq;
+    // Announced frames not pulled yet, oldest first
+    SimFrame deque[SIM_DEQUE_LENGTH];
+    gint queued;
+    // get_FrameRate() window
+    unsigned total_frames;
+    unsigned window_frames;
+    gint64 window_start;
+    unsigned rate_frames;
+    unsigned rate_ms;
+} SimCam;
+
+#define SIMCAM(h) ((SimCam *) (h))
+
+static SimConfig config;
+
+static void parse_config(const char *str)
+{
+    gchar **items;
+
+    config.fps = 30.0;
+    config.bits = 12;
+    config.cameras = 1;
+    if (str) {
+        items = g_strsplit(str, ",", -1);
+        for (gchar ** item = items; *item; ++item) {
+            gchar **kv = g_strsplit(*item, "=", 2);
+            const char *key = kv[0] ? kv[0] : "";
+            const char *val = kv[0] && kv[1] ? kv[1] : "";
+
+            if (!strcmp(key, "width")) {
+                config.width = atoi(val);
+            } else if (!strcmp(key, "height")) {
+                config.height = atoi(val);
+            } else if (!strcmp(key, "fps")) {
+                config.fps = g_ascii_strtod(val, NULL);
+            } else if (!strcmp(key, "bits")) {
+                config.bits = atoi(val);
+            } else if (!strcmp(key, "jitter")) {
+                config.jitter = atoi(val);
+            } else if (!strcmp(key, "drop")) {
+                config.drop = g_ascii_strtod(val, NULL);
+            } else if (!strcmp(key, "cameras")) {
+                config.cameras = atoi(val);
+            } else if (key[0]) {
+                g_warning("SIMCAM: unknown setting %s", *item);
+            }
+            g_strfreev(kv);
+        }
+        g_strfreev(items);
+    }
+    if (config.fps <= 0.0) {
+        config.fps = 30.0;
+    }
+    config.bits = CLAMP(config.bits, 8, 16);
+    config.jitter = MAX(config.jitter, 0);
+    config.cameras = CLAMP(config.cameras, 0, SIMCAM_MAX);
+
+    SimcamModelV2 *model = &config.model;
+    model->name = "Simulated camera";
+    model->flag = SIMCAM_FLAG_RAW8 | SIMCAM_FLAG_RAW12;
+    model->xpixsz = 2.4;
+    model->ypixsz = 2.4;
+    if (config.width > 0 && config.height > 0) {
+        model->res[0].width = config.width;
+        model->res[0].height = config.height;
+        model->preview = 1;
+    } else {
+        static const SimcamResolution res[] = {
+            {5440, 3648}, {2736, 1824}, {1824, 1216},
+        };
+        memcpy(model->res, res, sizeof(res));
+        model->preview = G_N_ELEMENTS(res);
+    }
+    model->still = model->preview;
+}
+
+static void ensure_config(void)
+{
+    static gsize once = 0;
+
+    if (g_once_init_enter(&once)) {
+        parse_config(g_getenv("SIMCAM"));
+        g_once_init_leave(&once, 1);
+    }
+}
+
+const char *Simcam_Version(void)
+{
+    return "53.0.sim";
+}
+
+unsigned Simcam_EnumV2(SimcamDeviceV2 arr[SIMCAM_MAX])
+{
+    ensure_config();
+    for (gint i = 0; i < config.cameras; ++i) {
+        snprintf(arr[i].displayname, sizeof(arr[i].displayname),
+                 "Simulated camera %d", i);
+        snprintf(arr[i].id, sizeof(arr[i].id), "sim%d", i);
+        arr[i].model = &config.model;
+    }
+    return config.cameras;
+}
+
+HSimcam Simcam_Open(const char *camId)
+{
+    SimCam *cam;
+    gint index = 0;
+
+    ensure_config();
+    if (camId) {
+        // "@" only selects extra SDK features on real cameras
+        if (camId[0] == '@') {
+            ++camId;
+        }
+        if (sscanf(camId, "sim%d", &index) != 1) {
+            return NULL;
+        }
+    }
+    if (index < 0 || index >= config.cameras) {
+        return NULL;
+    }
+
+    cam = g_new0(SimCam, 1);
+    g_mutex_init(&cam->lock);
+    g_cond_init(&cam->cond);
+    cam->index = index;
+    cam->byteorder = 1;
+    cam->auto_expo = 1;
+    cam->expotime = SIM_EXPOTIME_DEF;
+    cam->expoagain = SIMCAM_EXPOGAIN_DEF;
+    cam->hue = SIMCAM_HUE_DEF;
+    cam->saturation = SIMCAM_SATURATION_DEF;
+    cam->brightness = SIMCAM_BRIGHTNESS_DEF;
+    cam->contrast = SIMCAM_CONTRAST_DEF;
+    cam->gamma = SIMCAM_GAMMA_DEF;
+    return (HSimcam) cam;
+}
+
+void Simcam_Close(HSimcam h)
+{
+    SimCam *cam = SIMCAM(h);
+
+    if (!cam) {
+        return;
+    }
+    Simcam_Stop(h);
+    g_mutex_clear(&cam->lock);
+    g_cond_clear(&cam->cond);
+    g_free(cam);
+}
+
+// Frame period in us, exposure can't be longer than a frame
+static gint64 frame_period(SimCam * cam)
+{
+    gdouble fps = config.fps;
+
+    if (cam->precise_framerate > 0) {
+        fps = MIN(fps, cam->precise_framerate / 10.0);
+    }
+    if (cam->framerate > 0) {
+        fps = MIN(fps, cam->framerate);
+    }
+    return MAX((gint64) (G_USEC_PER_SEC / fps), cam->expotime);
+}
+
+// OPTION_PRECISE_FRAMERATE range is [1, max]
+static int max_precise_framerate(void)
+{
+    return MAX((int) (config.fps * 10.0 + 0.5), 1);
+}
+
+// Simple proportional AE, lock held
+static void auto_expose(SimCam * cam)
+{
+    guint64 cur = (guint64) cam->expotime * cam->expoagain / 100;
+    gint64 step;
+
+    if (cur == SIM_AE_TARGET) {
+        return;
+    }
+    step = ((gint64) SIM_AE_TARGET - (gint64) cur) / 4;
+    if (step == 0) {
+        step = SIM_AE_TARGET > cur ? 1 : -1;
+    }
+    cam->expotime = CLAMP((gint64) cam->expotime + step, SIM_EXPOTIME_MIN,
+                          SIM_EXPOTIME_MAX);
+    cam->expoagain = SIMCAM_EXPOGAIN_DEF;
+    cam->expo_event = TRUE;
+}
+
+static gpointer frame_thread(gpointer data)
+{
+    SimCam *cam = data;
+    gint64 next = g_get_monotonic_time();
+
+    g_mutex_lock(&cam->lock);
+    while (cam->running) {
+        gint64 period = frame_period(cam);
+        gint64 deadline, now;
+        gboolean expo_event, announce;
+
+        next += period;
+        deadline = next;
+        if (config.jitter) {
+            deadline += g_random_int_range(-config.jitter,
+                                           config.jitter + 1);
+        }
+        while (cam->running && g_get_monotonic_time() < deadline) {
+            g_cond_wait_until(&cam->cond, &cam->lock, deadline);
+        }
+        if (!cam->running) {
+            break;
+        }
+        now = g_get_monotonic_time();
+        // Fell behind (ex: exposure got shorter): don't burst to catch up
+        if (now - next > period) {
+            next = now;
+        }
+
+        cam->seq++;
+        cam->total_frames++;
+        cam->window_frames++;
+        if (now - cam->window_start >= G_USEC_PER_SEC) {
+            cam->rate_frames = cam->window_frames;
+            cam->rate_ms = (now - cam->window_start) / 1000;
+            cam->window_frames = 0;
+            cam->window_start = now;
+        }
+        if (cam->auto_expo) {
+            auto_expose(cam);
+        }
+        expo_event = cam->expo_event;
+        cam->expo_event = FALSE;
+        announce = config.drop <= 0.0
+            || g_random_double() >= config.drop;
+        // Host isn't keeping up: the frame is lost, as with a full SDK deque
+        if (announce && cam->queued == SIM_DEQUE_LENGTH) {
+            announce = FALSE;
+        }
+        if (announce) {
+            cam->deque[cam->queued].seq = cam->seq;
+            cam->deque[cam->queued].timestamp = now;
+            cam->queued++;
+        }
+
+        // Callback may call back into us
+        g_mutex_unlock(&cam->lock);
+        if (expo_event) {
+            cam->callback(SIMCAM_EVENT_EXPOSURE, cam->ctx);
+        }
+        if (announce) {
+            cam->callback(SIMCAM_EVENT_IMAGE, cam->ctx);
+        }
+        g_mutex_lock(&cam->lock);
+    }
+    g_mutex_unlock(&cam->lock);
+    return NULL;
+}
+
+HRESULT Simcam_StartPullModeWithCallback(HSimcam h,
+                                         PSIMCAM_EVENT_CALLBACK funEvent,
+                                         void *ctxEvent)
+{
+    SimCam *cam = SIMCAM(h);
+
+    if (!cam || !funEvent) {
+        return E_INVALIDARG;
+    }
+    if (cam->thread) {
+        return E_UNEXPECTED;
+    }
+    cam->callback = funEvent;
+    cam->ctx = ctxEvent;
+    cam->running = TRUE;
+    cam->window_start = g_get_monotonic_time();
+    cam->window_frames = 0;
+    cam->queued = 0;
+    cam->thread = g_thread_new("simcam", frame_thread, cam);
+    return S_OK;
+}
+
+HRESULT Simcam_Stop(HSimcam h)
+{
+    SimCam *cam = SIMCAM(h);
+
+    if (!cam->thread) {
+        return S_OK;
+    }
+    g_mutex_lock(&cam->lock);
+    cam->running = FALSE;
+    g_cond_signal(&cam->cond);
+    g_mutex_unlock(&cam->lock);
+    g_thread_join(cam->thread);
+    cam->thread = NULL;
+    return S_OK;
+}
+
+/*
+Diagonal ramp that moves 4 pixels per frame
+Each row is a window into one precomputed line so rendering is a memcpy per
+row, keeping the simulated SDK's cost close to the real one's copy out
+*/
+static void render_u8(guint8 * dst, gsize pitch, gint width, gint height,
+                      gint spp, unsigned seq, gdouble gain)
+{
+    const gsize row = (gsize) width * spp;
+    guint8 *line = g_new(guint8, row + SIM_PERIOD * spp);
+
+    for (gint x = 0; x < width + SIM_PERIOD; ++x) {
+        guint v = MIN((x % SIM_PERIOD) * gain, G_MAXUINT8);
+        for (gint c = 0; c < spp; ++c) {
+            line[x * spp + c] = c == 1 ? G_MAXUINT8 - v : v;
+        }
+    }
+    for (gint y = 0; y < height; ++y) {
+        const gint offset = (y + seq * 4) & (SIM_PERIOD - 1);
+        memcpy(dst + y * pitch, line + offset * spp, row);
+    }
+    g_free(line);
+}
+
+static void render_u16(guint8 * dst, gsize pitch, gint width, gint height,
+                       gint spp, unsigned seq, gdouble gain, gint bits)
+{
+    const gsize row = (gsize) width * spp;
+    const guint max = (1 << bits) - 1;
+    const gdouble scale = (gdouble) (max + 1) / SIM_PERIOD;
+    guint16 *line = g_new(guint16, row + SIM_PERIOD * spp);
+
+    for (gint x = 0; x < width + SIM_PERIOD; ++x) {
+        guint v = MIN((x % SIM_PERIOD) * scale * gain, max);
+        for (gint c = 0; c < spp; ++c) {
+            line[x * spp + c] = c == 1 ? max - v : v;
+        }
+    }
+    for (gint y = 0; y < height; ++y) {
+        const gint offset = (y + seq * 4) & (SIM_PERIOD - 1);
+        memcpy(dst + y * pitch, line + offset * spp, row * sizeof(guint16));
+    }
+    g_free(line);
+}
+
+HRESULT Simcam_PullImageV2(HSimcam h, void *pImageData, int bits,
+                           SimcamFrameInfoV2 * pInfo)
+{
+    return Simcam_PullImageWithRowPitchV2(h, pImageData, bits, 0, pInfo);
+}
+
+/*
+rowPitch: bytes per row, 0 => SDK default (RGB rows 4 byte aligned, raw
+packed), -1 => packed
+*/
+HRESULT Simcam_PullImageWithRowPitchV2(HSimcam h, void *pImageData,
+                                       int bits, int rowPitch,
+                                       SimcamFrameInfoV2 * pInfo)
+{
+    SimCam *cam = SIMCAM(h);
+    const SimcamResolution *res;
+    unsigned seq;
+    guint64 timestamp;
+    gdouble gain;
+    gboolean raw, wide;
+    gint bpp;
+    gsize pitch;
+
+    g_mutex_lock(&cam->lock);
+    if (!cam->queued) {
+        g_mutex_unlock(&cam->lock);
+        return E_UNEXPECTED;
+    }
+    seq = cam->deque[0].seq;
+    timestamp = cam->deque[0].timestamp;
+    cam->queued--;
+    memmove(cam->deque, cam->deque + 1, cam->queued * sizeof(SimFrame));
+    res = &config.model.res[cam->esize];
+    // Brightness follows exposure, 1.0 at the AE target
+    gain = (gdouble) cam->expotime * cam->expoagain / 100 / SIM_AE_TARGET;
+    raw = cam->raw;
+    wide = cam->bitdepth
+        && (!raw || cam->pixel_format == SIMCAM_PIXELFORMAT_RAW12);
+    g_mutex_unlock(&cam->lock);
+
+    if (raw) {
+        bpp = wide ? 2 : 1;
+    } else if (bits == 48 || bits == 24 || bits == 32) {
+        bpp = bits / 8;
+    } else {
+        return E_INVALIDARG;
+    }
+    if (rowPitch == -1 || (rowPitch == 0 && raw)) {
+        pitch = (gsize) res->width * bpp;
+    } else if (rowPitch == 0) {
+        pitch = ((gsize) res->width * bpp + 3) & ~(gsize) 3;
+    } else if (rowPitch >= (gint) res->width * bpp) {
+        pitch = rowPitch;
+    } else {
+        return E_INVALIDARG;
+    }
+
+    if (raw) {
+        if (wide) {
+            render_u16(pImageData, pitch, res->width, res->height, 1, seq,
+                       gain, config.bits);
+        } else {
+            render_u8(pImageData, pitch, res->width, res->height, 1, seq,
+                      gain);
+        }
+    } else if (bits == 48) {
+        render_u16(pImageData, pitch, res->width, res->height, 3, seq, gain,
+                   config.bits);
+    } else {
+        render_u8(pImageData, pitch, res->width, res->height, bits / 8, seq,
+                  gain);
+    }
+
+    if (pInfo) {
+        pInfo->width = res->width;
+        pInfo->height = res->height;
+        pInfo->flag = SIMCAM_FRAMEINFO_FLAG_SEQ
+            | SIMCAM_FRAMEINFO_FLAG_TIMESTAMP;
+        pInfo->seq = seq;
+        pInfo->timestamp = timestamp;
+    }
+    return S_OK;
+}
+
+HRESULT Simcam_put_eSize(HSimcam h, unsigned nResolutionIndex)
+{
+    SimCam *cam = SIMCAM(h);
+
+    if (nResolutionIndex >= config.model.preview) {
+        return E_INVALIDARG;
+    }
+    g_mutex_lock(&cam->lock);
+    cam->esize = nResolutionIndex;
+    g_mutex_unlock(&cam->lock);
+    return S_OK;
+}
+
+HRESULT Simcam_get_eSize(HSimcam h, unsigned *pnResolutionIndex)
+{
+    *pnResolutionIndex = SIMCAM(h)->esize;
+    return S_OK;
+}
+
+HRESULT Simcam_get_Size(HSimcam h, int *pWidth, int *pHeight)
+{
+    const SimcamResolution *res = &config.model.res[SIMCAM(h)->esize];
+
+    *pWidth = res->width;
+    *pHeight = res->height;
+    return S_OK;
+}
+
+HRESULT Simcam_get_Roi(HSimcam h, unsigned *pxOffset, unsigned *pyOffset,
+                       unsigned *pxWidth, unsigned *pyHeight)
+{
+    const SimcamResolution *res = &config.model.res[SIMCAM(h)->esize];
+
+    *pxOffset = 0;
+    *pyOffset = 0;
+    *pxWidth = res->width;
+    *pyHeight = res->height;
+    return S_OK;
+}
+
+static int *option_field(SimCam * cam, unsigned iOption)
+{
+    switch (iOption) {
+    case SIMCAM_OPTION_RAW:
+        return &cam->raw;
+    case SIMCAM_OPTION_BITDEPTH:
+        return &cam->bitdepth;
+    case SIMCAM_OPTION_BYTEORDER:
+        return &cam->byteorder;
+    case SIMCAM_OPTION_RGB:
+        return &cam->rgb48;
+    case SIMCAM_OPTION_PIXEL_FORMAT:
+        return &cam->pixel_format;
+    case SIMCAM_OPTION_FRAMERATE:
+        return &cam->framerate;
+    case SIMCAM_OPTION_PRECISE_FRAMERATE:
+        return &cam->precise_framerate;
+    default:
+        return NULL;
+    }
+}
+
+HRESULT Simcam_put_Option(HSimcam h, unsigned iOption, int iValue)
+{
+    SimCam *cam = SIMCAM(h);
+    int *field = option_field(cam, iOption);
+
+    if (!field) {
+        return E_NOTIMPL;
+    }
+    if ((iOption == SIMCAM_OPTION_FRAMERATE && (iValue < 0 || iValue > 63))
+        || (iOption == SIMCAM_OPTION_PRECISE_FRAMERATE
+            && (iValue < 1 || iValue > max_precise_framerate()))) {
+        return E_INVALIDARG;
+    }
+    g_mutex_lock(&cam->lock);
+    *field = iValue;
+    g_mutex_unlock(&cam->lock);
+    return S_OK;
+}
+
+HRESULT Simcam_get_Option(HSimcam h, unsigned iOption, int *piValue)
+{
+    SimCam *cam = SIMCAM(h);
+    int *field = option_field(cam, iOption);
+
+    if (iOption == SIMCAM_OPTION_MAX_PRECISE_FRAMERATE) {
+        *piValue = max_precise_framerate();
+        return S_OK;
+    }
+    if (!field) {
+        return E_NOTIMPL;
+    }
+    g_mutex_lock(&cam->lock);
+    *piValue = *field;
+    g_mutex_unlock(&cam->lock);
+    return S_OK;
+}
+
+HRESULT Simcam_get_RawFormat(HSimcam h, unsigned *nFourCC,
+                             unsigned *bitsperpixel)
+{
+    SimCam *cam = SIMCAM(h);
+
+    memcpy(nFourCC, "GBRG", 4);
+    *bitsperpixel = cam->pixel_format == SIMCAM_PIXELFORMAT_RAW12
+        ? config.bits : 8;
+    return S_OK;
+}
+
+// Plain settings with no effect on the simulated image
+#define SIM_INT_SETTING(name, field)                                           \
+    HRESULT Simcam_put_##name(HSimcam h, int v)                                \
+    {                                                                          \
+        SimCam *cam = SIMCAM(h);                                               \
+        g_mutex_lock(&cam->lock);                                              \
+        cam->field = v;                                                        \
+        g_mutex_unlock(&cam->lock);                                            \
+        return S_OK;                                                           \
+    }                                                                          \
+    HRESULT Simcam_get_##name(HSimcam h, int *v)                               \
+    {                                                                          \
+        SimCam *cam = SIMCAM(h);                                               \
+        g_mutex_lock(&cam->lock);                                              \
+        *v = cam->field;                                                       \
+        g_mutex_unlock(&cam->lock);                                            \
+        return S_OK;                                                           \
+    }
+
+SIM_INT_SETTING(HFlip, hflip)
+SIM_INT_SETTING(VFlip, vflip)
+SIM_INT_SETTING(AutoExpoEnable, auto_expo)
+SIM_INT_SETTING(Hue, hue)
+SIM_INT_SETTING(Saturation, saturation)
+SIM_INT_SETTING(Brightness, brightness)
+SIM_INT_SETTING(Contrast, contrast)
+SIM_INT_SETTING(Gamma, gamma)
+
+HRESULT Simcam_put_ExpoTime(HSimcam h, unsigned Time)
+{
+    SimCam *cam = SIMCAM(h);
+
+    if (Time < SIM_EXPOTIME_MIN || Time > SIM_EXPOTIME_MAX) {
+        return E_INVALIDARG;
+    }
+    g_mutex_lock(&cam->lock);
+    cam->expotime = Time;
+    cam->expo_event = TRUE;
+    g_mutex_unlock(&cam->lock);
+    return S_OK;
+}
+
+HRESULT Simcam_get_ExpoTime(HSimcam h, unsigned *Time)
+{
+    SimCam *cam = SIMCAM(h);
+
+    g_mutex_lock(&cam->lock);
+    *Time = cam->expotime;
+    g_mutex_unlock(&cam->lock);
+    return S_OK;
+}
+
+HRESULT Simcam_get_ExpTimeRange(HSimcam h, unsigned *nMin, unsigned *nMax,
+                                unsigned *nDef)
+{
+    *nMin = SIM_EXPOTIME_MIN;
+    *nMax = SIM_EXPOTIME_MAX;
+    *nDef = SIM_EXPOTIME_DEF;
+    return S_OK;
+}
+
+HRESULT Simcam_put_ExpoAGain(HSimcam h, unsigned short AGain)
+{
+    SimCam *cam = SIMCAM(h);
+
+    if (AGain < SIMCAM_EXPOGAIN_MIN || AGain > SIM_EXPOAGAIN_MAX) {
+        return E_INVALIDARG;
+    }
+    g_mutex_lock(&cam->lock);
+    cam->expoagain = AGain;
+    cam->expo_event = TRUE;
+    g_mutex_unlock(&cam->lock);
+    return S_OK;
+}
+
+HRESULT Simcam_get_ExpoAGain(HSimcam h, unsigned short *AGain)
+{
+    SimCam *cam = SIMCAM(h);
+
+    g_mutex_lock(&cam->lock);
+    *AGain = cam->expoagain;
+    g_mutex_unlock(&cam->lock);
+    return S_OK;
+}
+
+HRESULT Simcam_get_ExpoAGainRange(HSimcam h, unsigned short *nMin,
+                                  unsigned short *nMax,
+                                  unsigned short *nDef)
+{
+    *nMin = SIMCAM_EXPOGAIN_MIN;
+    *nMax = SIM_EXPOAGAIN_MAX;
+    *nDef = SIMCAM_EXPOGAIN_DEF;
+    return S_OK;
+}
+
+HRESULT Simcam_put_WhiteBalanceGain(HSimcam h, int aGain[3])
+{
+    SimCam *cam = SIMCAM(h);
+
+    g_mutex_lock(&cam->lock);
+    memcpy(cam->wb, aGain, sizeof(cam->wb));
+    g_mutex_unlock(&cam->lock);
+    return S_OK;
+}
+
+HRESULT Simcam_get_WhiteBalanceGain(HSimcam h, int aGain[3])
+{
+    SimCam *cam = SIMCAM(h);
+
+    g_mutex_lock(&cam->lock);
+    memcpy(aGain, cam->wb, sizeof(cam->wb));
+    g_mutex_unlock(&cam->lock);
+    return S_OK;
+}
+
+HRESULT Simcam_put_BlackBalance(HSimcam h, unsigned short aSub[3])
+{
+    SimCam *cam = SIMCAM(h);
+
+    g_mutex_lock(&cam->lock);
+    memcpy(cam->bb, aSub, sizeof(cam->bb));
+    g_mutex_unlock(&cam->lock);
+    return S_OK;
+}
+
+HRESULT Simcam_get_BlackBalance(HSimcam h, unsigned short aSub[3])
+{
+    SimCam *cam = SIMCAM(h);
+
+    g_mutex_lock(&cam->lock);
+    memcpy(aSub, cam->bb, sizeof(cam->bb));
+    g_mutex_unlock(&cam->lock);
+    return S_OK;
+}
+
+// The test pattern is already neutral, report it right away
+HRESULT Simcam_AwbInit(HSimcam h, PISIMCAM_WHITEBALANCE_CALLBACK fnWBProc,
+                       void *pWBCtx)
+{
+    const int gain[3] = { 0, 0, 0 };
+
+    if (fnWBProc) {
+        fnWBProc(gain, pWBCtx);
+    }
+    return S_OK;
+}
+
+HRESULT Simcam_AwbOnce(HSimcam h, PISIMCAM_TEMPTINT_CALLBACK fnTTProc,
+                       void *pTTCtx)
+{
+    if (fnTTProc) {
+        fnTTProc(6503, 1000, pTTCtx);
+    }
+    return S_OK;
+}
+
+HRESULT Simcam_get_FrameRate(HSimcam h, unsigned *nFrame, unsigned *nTime,
+                             unsigned *nTotalFrame)
+{
+    SimCam *cam = SIMCAM(h);
+
+    g_mutex_lock(&cam->lock);
+    if (cam->rate_ms) {
+        *nFrame = cam->rate_frames;
+        *nTime = cam->rate_ms;
+    } else {
+        // Nothing measured yet, report the nominal rate
+        *nTime = 1000;
+        *nFrame = MAX(G_USEC_PER_SEC / frame_period(cam), 1);
+    }
+    *nTotalFrame = cam->total_frames;
+    g_mutex_unlock(&cam->lock);
+    return S_OK;
+}
+
+HRESULT Simcam_get_Negative(HSimcam h, int *bNegative)
+{
+    *bNegative = 0;
+    return S_OK;
+}
+
+HRESULT Simcam_get_Chrome(HSimcam h, int *bChrome)
+{
+    *bChrome = 0;
+    return S_OK;
+}
+
+HRESULT Simcam_get_HZ(HSimcam h, int *nHZ)
+{
+    *nHZ = 2;
+    return S_OK;
+}
+
+HRESULT Simcam_get_Mode(HSimcam h, int *bSkip)
+{
+    *bSkip = 0;
+    return S_OK;
+}
+
+HRESULT Simcam_get_RealTime(HSimcam h, int *val)
+{
+    *val = 0;
+    return S_OK;
+}
+
+HRESULT Simcam_get_Temperature(HSimcam h, short *pTemperature)
+{
+    // 0.1 degrees C
+    *pTemperature = 250;
+    return S_OK;
+}
+
+const SimcamModelV2 *Simcam_query_Model(HSimcam h)
+{
+    return &config.model;
+}
+
+HRESULT Simcam_get_SerialNumber(HSimcam h, char sn[32])
+{
+    snprintf(sn, 32, "SIM%05d", SIMCAM(h)->index);
+    return S_OK;
+}
+
+HRESULT Simcam_get_FwVersion(HSimcam h, char fwver[16])
+{
+    g_strlcpy(fwver, "1.0.0", 16);
+    return S_OK;
+}
+
+HRESULT Simcam_get_HwVersion(HSimcam h, char hwver[16])
+{
+    g_strlcpy(hwver, "1.0", 16);
+    return S_OK;
+}
+
+HRESULT Simcam_get_ProductionDate(HSimcam h, char pdate[10])
+{
+    g_strlcpy(pdate, "20221011", 10);
+    return S_OK;
+}
+
+HRESULT Simcam_get_FpgaVersion(HSimcam h, char fpgaver[16])
+{
+    g_strlcpy(fpgaver, "1.0", 16);
+    return S_OK;
+}
+
+HRESULT Simcam_get_Revision(HSimcam h, unsigned short *pRevision)
+{
+    *pRevision = 1;
+    return S_OK;
+}
+
+unsigned Simcam_get_MaxBitDepth(HSimcam h)
+{
+    return config.bits;
+}
+
+unsigned Simcam_get_FanMaxSpeed(HSimcam h)
+{
+    return 0;
+}
+
+unsigned Simcam_get_MaxSpeed(HSimcam h)
+{
+    return 0;
+}
+
+// Single speed level, see get_MaxSpeed()
+HRESULT Simcam_put_Speed(HSimcam h, unsigned short nSpeed)
+{
+    return nSpeed ? E_INVALIDARG : S_OK;
+}
+
+HRESULT Simcam_get_Speed(HSimcam h, unsigned short *pSpeed)
+{
+    *pSpeed = 0;
+    return S_OK;
+}
+
+// S_FALSE => color
+HRESULT Simcam_get_MonoMode(HSimcam h)
+{
+    return S_FALSE;
+}
+
+unsigned Simcam_get_StillResolutionNumber(HSimcam h)
+{
+    return config.model.still;
+}
+
+HRESULT Simcam_get_StillResolution(HSimcam h, unsigned nResolutionIndex,
+                                   int *pWidth, int *pHeight)
+{
+    if (nResolutionIndex >= config.model.still) {
+        return E_INVALIDARG;
+    }
+    *pWidth = config.model.res[nResolutionIndex].width;
+    *pHeight = config.model.res[nResolutionIndex].height;
+    return S_OK;
+}
+
+HRESULT Simcam_get_PixelSize(HSimcam h, unsigned nResolutionIndex,
+                             float *x, float *y)
+{
+    if (nResolutionIndex >= config.model.preview) {
+        return E_INVALIDARG;
+    }
+    // Binned resolutions have proportionally larger pixels
+    *x = config.model.xpixsz * config.model.res[0].width
+        / config.model.res[nResolutionIndex].width;
+    *y = config.model.ypixsz * config.model.res[0].height
+        / config.model.res[nResolutionIndex].height;
+    return S_OK;
+}
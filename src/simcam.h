@@ -0,0 +1,236 @@
+/* GStreamer ToupCam Plugin
+ * Copyright (C) 2022 Labsmore LLC
+ *
+ * Author John McMaster <johndmcmaster@gmail.com>
+ * Author Kishore Arepalli <kishore.arepalli@gmail.com>
+ */
+
+/*
+Simulated camera SDK, selected with ./configure --with-sdk=sim
+
+Implements the subset of toupcam.h that toupcamsrc uses, with the same
+signatures and constant values, entirely in process
+A thread per opened camera generates frames (a moving test pattern) and
+fires the event callback, so full pipelines can be run without hardware
+Like the SDK a few announced frames queue up for pulling, frames arriving
+while the queue is full are lost
+
+Configured through the SIMCAM environment variable, comma separated, ex:
+SIMCAM=width=1920,height=1080,fps=60,bits=12,jitter=2000,drop=0.01
+    width, height: single resolution (default: 5440x3648, 2736x1824 and
+                   1824x1216 as the cameras in the README)
+    fps: frame rate (default 30), further limited by the exposure time
+    bits: sensor bit depth for the 16 bit / raw formats (default 12)
+    jitter: +/- microseconds of uniform random frame timing jitter
+    drop: fraction of frames to lose before they are announced
+          OPTION_FRAMERATE / OPTION_PRECISE_FRAMERATE lower the rate further
+    cameras: number of devices to enumerate (default 1)
+*/
+
+#ifndef _SIMCAM_H_
+#define _SIMCAM_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef HRESULT
+#define HRESULT int
+#endif
+#ifndef SUCCEEDED
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr) (((HRESULT)(hr)) < 0)
+#endif
+#ifndef S_OK
+#define S_OK ((HRESULT)0x00000000L)
+#define S_FALSE ((HRESULT)0x00000001L)
+#define E_UNEXPECTED ((HRESULT)0x8000ffffL)
+#define E_NOTIMPL ((HRESULT)0x80004001L)
+#define E_INVALIDARG ((HRESULT)0x80070057L)
+#define E_POINTER ((HRESULT)0x80004003L)
+#define E_FAIL ((HRESULT)0x80004005L)
+#endif
+
+#define SIMCAM_MAX 16
+
+#define SIMCAM_FLAG_RAW8 0x00000004
+#define SIMCAM_FLAG_RAW12 0x00000008
+
+#define SIMCAM_HUE_DEF 0
+#define SIMCAM_HUE_MIN (-180)
+#define SIMCAM_HUE_MAX 180
+#define SIMCAM_SATURATION_DEF 128
+#define SIMCAM_SATURATION_MIN 0
+#define SIMCAM_SATURATION_MAX 255
+#define SIMCAM_BRIGHTNESS_DEF 0
+#define SIMCAM_BRIGHTNESS_MIN (-64)
+#define SIMCAM_BRIGHTNESS_MAX 64
+#define SIMCAM_CONTRAST_DEF 0
+#define SIMCAM_CONTRAST_MIN (-100)
+#define SIMCAM_CONTRAST_MAX 100
+#define SIMCAM_GAMMA_DEF 100
+#define SIMCAM_GAMMA_MIN 20
+#define SIMCAM_GAMMA_MAX 180
+#define SIMCAM_EXPOGAIN_DEF 100
+#define SIMCAM_EXPOGAIN_MIN 100
+
+#define SIMCAM_EVENT_EXPOSURE 0x0001
+#define SIMCAM_EVENT_TEMPTINT 0x0002
+#define SIMCAM_EVENT_IMAGE 0x0004
+#define SIMCAM_EVENT_STILLIMAGE 0x0005
+#define SIMCAM_EVENT_WBGAIN 0x0006
+#define SIMCAM_EVENT_ERROR 0x0080
+#define SIMCAM_EVENT_DISCONNECTED 0x0081
+#define SIMCAM_EVENT_NOFRAMETIMEOUT 0x0082
+
+#define SIMCAM_OPTION_RAW 0x04
+#define SIMCAM_OPTION_BITDEPTH 0x06
+#define SIMCAM_OPTION_BYTEORDER 0x0a
+#define SIMCAM_OPTION_RGB 0x18
+#define SIMCAM_OPTION_FRAMERATE 0x1e
+#define SIMCAM_OPTION_PIXEL_FORMAT 0x1f
+#define SIMCAM_OPTION_PRECISE_FRAMERATE 0x3d
+#define SIMCAM_OPTION_MAX_PRECISE_FRAMERATE 0x3e
+
+#define SIMCAM_PIXELFORMAT_RAW8 0x00
+#define SIMCAM_PIXELFORMAT_RAW12 0x02
+
+#define SIMCAM_FRAMEINFO_FLAG_SEQ 0x00000001
+#define SIMCAM_FRAMEINFO_FLAG_TIMESTAMP 0x00000002
+
+typedef struct SimcamT {
+    int unused;
+} *HSimcam;
+
+typedef struct {
+    unsigned width;
+    unsigned height;
+} SimcamResolution;
+
+typedef struct {
+    const char *name;
+    unsigned long long flag;
+    unsigned maxspeed;
+    unsigned preview;
+    unsigned still;
+    unsigned maxfanspeed;
+    unsigned ioctrol;
+    float xpixsz;
+    float ypixsz;
+    SimcamResolution res[SIMCAM_MAX];
+} SimcamModelV2;
+
+typedef struct {
+    char displayname[64];
+    char id[64];
+    const SimcamModelV2 *model;
+} SimcamDeviceV2;
+
+typedef struct {
+    unsigned width;
+    unsigned height;
+    unsigned flag;
+    unsigned seq;
+    // microseconds
+    unsigned long long timestamp;
+} SimcamFrameInfoV2;
+
+typedef void (*PSIMCAM_EVENT_CALLBACK) (unsigned nEvent, void *ctxEvent);
+typedef void (*PISIMCAM_WHITEBALANCE_CALLBACK) (const int aGain[3],
+                                                void *ctxWhiteBalance);
+typedef void (*PISIMCAM_TEMPTINT_CALLBACK) (const int nTemp,
+                                            const int nTint, void *ctxTT);
+
+const char *Simcam_Version(void);
+unsigned Simcam_EnumV2(SimcamDeviceV2 arr[SIMCAM_MAX]);
+HSimcam Simcam_Open(const char *camId);
+void Simcam_Close(HSimcam h);
+
+HRESULT Simcam_StartPullModeWithCallback(HSimcam h,
+                                         PSIMCAM_EVENT_CALLBACK funEvent,
+                                         void *ctxEvent);
+HRESULT Simcam_PullImageV2(HSimcam h, void *pImageData, int bits,
+                           SimcamFrameInfoV2 * pInfo);
+HRESULT Simcam_PullImageWithRowPitchV2(HSimcam h, void *pImageData,
+                                       int bits, int rowPitch,
+                                       SimcamFrameInfoV2 * pInfo);
+HRESULT Simcam_Stop(HSimcam h);
+
+HRESULT Simcam_put_eSize(HSimcam h, unsigned nResolutionIndex);
+HRESULT Simcam_get_eSize(HSimcam h, unsigned *pnResolutionIndex);
+HRESULT Simcam_get_Size(HSimcam h, int *pWidth, int *pHeight);
+HRESULT Simcam_get_Roi(HSimcam h, unsigned *pxOffset, unsigned *pyOffset,
+                       unsigned *pxWidth, unsigned *pyHeight);
+HRESULT Simcam_put_Option(HSimcam h, unsigned iOption, int iValue);
+HRESULT Simcam_get_Option(HSimcam h, unsigned iOption, int *piValue);
+HRESULT Simcam_get_RawFormat(HSimcam h, unsigned *nFourCC,
+                             unsigned *bitsperpixel);
+
+HRESULT Simcam_put_HFlip(HSimcam h, int bHFlip);
+HRESULT Simcam_get_HFlip(HSimcam h, int *bHFlip);
+HRESULT Simcam_put_VFlip(HSimcam h, int bVFlip);
+HRESULT Simcam_get_VFlip(HSimcam h, int *bVFlip);
+
+HRESULT Simcam_put_AutoExpoEnable(HSimcam h, int bAutoExposure);
+HRESULT Simcam_get_AutoExpoEnable(HSimcam h, int *bAutoExposure);
+HRESULT Simcam_put_ExpoTime(HSimcam h, unsigned Time);
+HRESULT Simcam_get_ExpoTime(HSimcam h, unsigned *Time);
+HRESULT Simcam_get_ExpTimeRange(HSimcam h, unsigned *nMin, unsigned *nMax,
+                                unsigned *nDef);
+HRESULT Simcam_put_ExpoAGain(HSimcam h, unsigned short AGain);
+HRESULT Simcam_get_ExpoAGain(HSimcam h, unsigned short *AGain);
+HRESULT Simcam_get_ExpoAGainRange(HSimcam h, unsigned short *nMin,
+                                  unsigned short *nMax,
+                                  unsigned short *nDef);
+
+HRESULT Simcam_put_Hue(HSimcam h, int Hue);
+HRESULT Simcam_get_Hue(HSimcam h, int *Hue);
+HRESULT Simcam_put_Saturation(HSimcam h, int Saturation);
+HRESULT Simcam_get_Saturation(HSimcam h, int *Saturation);
+HRESULT Simcam_put_Brightness(HSimcam h, int Brightness);
+HRESULT Simcam_get_Brightness(HSimcam h, int *Brightness);
+HRESULT Simcam_put_Contrast(HSimcam h, int Contrast);
+HRESULT Simcam_get_Contrast(HSimcam h, int *Contrast);
+HRESULT Simcam_put_Gamma(HSimcam h, int Gamma);
+HRESULT Simcam_get_Gamma(HSimcam h, int *Gamma);
+HRESULT Simcam_put_WhiteBalanceGain(HSimcam h, int aGain[3]);
+HRESULT Simcam_get_WhiteBalanceGain(HSimcam h, int aGain[3]);
+HRESULT Simcam_put_BlackBalance(HSimcam h, unsigned short aSub[3]);
+HRESULT Simcam_get_BlackBalance(HSimcam h, unsigned short aSub[3]);
+HRESULT Simcam_AwbInit(HSimcam h, PISIMCAM_WHITEBALANCE_CALLBACK fnWBProc,
+                       void *pWBCtx);
+HRESULT Simcam_AwbOnce(HSimcam h, PISIMCAM_TEMPTINT_CALLBACK fnTTProc,
+                       void *pTTCtx);
+
+HRESULT Simcam_get_FrameRate(HSimcam h, unsigned *nFrame, unsigned *nTime,
+                             unsigned *nTotalFrame);
+HRESULT Simcam_get_Negative(HSimcam h, int *bNegative);
+HRESULT Simcam_get_Chrome(HSimcam h, int *bChrome);
+HRESULT Simcam_get_HZ(HSimcam h, int *nHZ);
+HRESULT Simcam_get_Mode(HSimcam h, int *bSkip);
+HRESULT Simcam_get_RealTime(HSimcam h, int *val);
+HRESULT Simcam_get_Temperature(HSimcam h, short *pTemperature);
+
+const SimcamModelV2 *Simcam_query_Model(HSimcam h);
+HRESULT Simcam_get_SerialNumber(HSimcam h, char sn[32]);
+HRESULT Simcam_get_FwVersion(HSimcam h, char fwver[16]);
+HRESULT Simcam_get_HwVersion(HSimcam h, char hwver[16]);
+HRESULT Simcam_get_ProductionDate(HSimcam h, char pdate[10]);
+HRESULT Simcam_get_FpgaVersion(HSimcam h, char fpgaver[16]);
+HRESULT Simcam_get_Revision(HSimcam h, unsigned short *pRevision);
+unsigned Simcam_get_MaxBitDepth(HSimcam h);
+unsigned Simcam_get_FanMaxSpeed(HSimcam h);
+unsigned Simcam_get_MaxSpeed(HSimcam h);
+HRESULT Simcam_put_Speed(HSimcam h, unsigned short nSpeed);
+HRESULT Simcam_get_Speed(HSimcam h, unsigned short *pSpeed);
+HRESULT Simcam_get_MonoMode(HSimcam h);
+unsigned Simcam_get_StillResolutionNumber(HSimcam h);
+HRESULT Simcam_get_StillResolution(HSimcam h, unsigned nResolutionIndex,
+                                   int *pWidth, int *pHeight);
+HRESULT Simcam_get_PixelSize(HSimcam h, unsigned nResolutionIndex,
+                             float *x, float *y);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,500 @@
+/* GStreamer ToupCam Plugin
+ * Copyright (C) 2022 Labsmore LLC
+ *
+ * Author John McMaster <johndmcmaster@gmail.com>
+ * Author Kishore Arepalli <kishore.arepalli@gmail.com>
+ */
+
+/*
+Microbenchmarks for the toupcamproc.c kernels on synthetic frames
+No camera or GStreamer needed, see "make bench"
+
+Each kernel runs at each frame size and worker count until --min-time has
+passed and the fastest iteration is reported
+GB/s counts bytes read plus bytes written at full resolution
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "toupcamproc.h"
+
+#ifndef PACKAGE_VERSION
+#define PACKAGE_VERSION "unknown"
+#endif
+
+// README "Supported resolutions", largest first
+static const gint default_sizes[][2] = {
+    {5440, 3648},
+    {2736, 1824},
+    {1824, 1216},
+};
+
+#define PREVIEW_FACTOR 4
+#define SHARPNESS_ROW_STEP 4
+
+typedef struct {
+    gint width;
+    gint height;
+    // 12 bit samples, GBRG mosaic
+    guint16 *raw;
+    // 12 bit samples, interleaved RGB
+    guint16 *rgb48;
+    // 8 bit interleaved RGB, also the 8 bit output
+    guint8 *rgb24;
+    // Per RGB sample, used for all correction kernels
+    guint16 *dark;
+    guint16 *flat;
+    guint16 *argb64;
+    guint16 *preview;
+    guint32 *acc;
+    guint32 hist[TOUPCAM_LUT_SIZE];
+    ToupcamColor color;
+    ToupcamColor color_ccm;
+    ToupcamTonemap tonemap;
+} BenchFrame;
+
+typedef struct {
+    const char *name;
+    // Bytes read / written per pixel, fractional for sparse / decimated
+    gdouble bytes_in;
+    gdouble bytes_out;
+    // Uses the worker pool
+    gboolean threaded;
+    void (*run) (BenchFrame * f, ToupcamWorkers * w);
+} BenchKernel;
+
+static void conv_params(BenchFrame * f, ToupcamWorkers * w,
+                        ToupcamConvParams * p)
+{
+    memset(p, 0, sizeof(*p));
+    p->width = f->width;
+    p->height = f->height;
+    p->max = TOUPCAM_LUT_SIZE - 1;
+    p->shift = 4;
+    p->workers = w;
+}
+
+static void run_gbrg12(BenchFrame * f, ToupcamWorkers * w)
+{
+    ToupcamConvParams p;
+
+    conv_params(f, w, &p);
+    GBRG12_to_ARGB64_x4(&p, (const unsigned char *) f->raw,
+                        (unsigned char *) f->argb64);
+}
+
+static void run_gbrg12_color(BenchFrame * f, ToupcamWorkers * w)
+{
+    ToupcamConvParams p;
+
+    conv_params(f, w, &p);
+    p.color = &f->color;
+    GBRG12_to_ARGB64_x4(&p, (const unsigned char *) f->raw,
+                        (unsigned char *) f->argb64);
+}
+
+static void run_rgb48(BenchFrame * f, ToupcamWorkers * w)
+{
+    ToupcamConvParams p;
+
+    conv_params(f, w, &p);
+    RGB48_to_ARGB64_x4(&p, (const unsigned char *) f->rgb48,
+                       (unsigned char *) f->argb64);
+}
+
+static void run_rgb48_dark_flat(BenchFrame * f, ToupcamWorkers * w)
+{
+    ToupcamConvParams p;
+
+    conv_params(f, w, &p);
+    p.dark = f->dark;
+    p.flat = f->flat;
+    RGB48_to_ARGB64_x4(&p, (const unsigned char *) f->rgb48,
+                       (unsigned char *) f->argb64);
+}
+
+static void run_rgb48_ccm(BenchFrame * f, ToupcamWorkers * w)
+{
+    ToupcamConvParams p;
+
+    conv_params(f, w, &p);
+    p.color = &f->color_ccm;
+    RGB48_to_ARGB64_x4(&p, (const unsigned char *) f->rgb48,
+                       (unsigned char *) f->argb64);
+}
+
+static void run_rgb48_preview(BenchFrame * f, ToupcamWorkers * w)
+{
+    ToupcamConvParams p;
+
+    conv_params(f, w, &p);
+    p.preview = (unsigned char *) f->preview;
+    p.preview_factor = PREVIEW_FACTOR;
+    p.preview_stride = f->width / PREVIEW_FACTOR * 8;
+    RGB48_to_ARGB64_x4(&p, (const unsigned char *) f->rgb48,
+                       (unsigned char *) f->argb64);
+}
+
+static void run_tonemap(BenchFrame * f, ToupcamWorkers * w)
+{
+    ToupcamConvParams p;
+
+    conv_params(f, w, &p);
+    p.tonemap = &f->tonemap;
+    p.hist = f->hist;
+    p.hist_step = 8;
+    RGB48_to_RGB24_tonemap(&p, (const unsigned char *) f->rgb48,
+                           f->rgb24);
+}
+
+static void run_decimate_rgb24(BenchFrame * f, ToupcamWorkers * w)
+{
+    toupcam_decimate_rgb24(w, f->rgb24, (gsize) f->width * 3, f->width,
+                           f->height, (guint8 *) f->preview,
+                           f->width / PREVIEW_FACTOR * 3, PREVIEW_FACTOR);
+}
+
+static void run_decimate_argb64(BenchFrame * f, ToupcamWorkers * w)
+{
+    toupcam_decimate_argb64(w, f->argb64, (gsize) f->width * 8, f->width,
+                            f->height, f->preview,
+                            f->width / PREVIEW_FACTOR * 8, PREVIEW_FACTOR);
+}
+
+static void run_correct_u8(BenchFrame * f, ToupcamWorkers * w)
+{
+    ToupcamConvParams p;
+
+    conv_params(f, w, &p);
+    p.max = G_MAXUINT8;
+    p.dark = f->dark;
+    p.flat = f->flat;
+    toupcam_correct_u8(&p, f->rgb24, f->rgb24);
+}
+
+static void run_stack_u16(BenchFrame * f, ToupcamWorkers * w)
+{
+    toupcam_stack_add_u16(f->acc, f->rgb48,
+                          (gsize) f->width * f->height * 3);
+}
+
+static void run_sharpness_u16(BenchFrame * f, ToupcamWorkers * w)
+{
+    volatile guint64 score;
+
+    score = toupcam_sharpness_u16(f->rgb48, (gsize) f->width * 3,
+                                  f->height, 1, 3, SHARPNESS_ROW_STEP);
+    (void) score;
+}
+
+// Three RGB48 sized frames: any data does, the merge has no branches
+static void run_hdr_merge3(BenchFrame * f, ToupcamWorkers * w)
+{
+    ToupcamHdrParams p;
+
+    memset(&p, 0, sizeof(p));
+    p.count = 3;
+    p.in[0] = f->rgb48;
+    p.in[1] = f->dark;
+    p.in[2] = f->flat;
+    p.expotime[0] = 1000;
+    p.expotime[1] = 4000;
+    p.expotime[2] = 16000;
+    p.row_samples = (gsize) f->width * 3;
+    p.height = f->height;
+    p.max = TOUPCAM_LUT_SIZE - 1;
+    p.workers = w;
+    toupcam_hdr_merge(&p, f->argb64);
+}
+
+static const BenchKernel kernels[] = {
+    {"GBRG12_to_ARGB64", 2, 8, TRUE, run_gbrg12},
+    {"GBRG12_to_ARGB64_color", 2, 8, TRUE, run_gbrg12_color},
+    {"RGB48_to_ARGB64", 6, 8, TRUE, run_rgb48},
+    {"RGB48_to_ARGB64_dark_flat", 18, 8, TRUE, run_rgb48_dark_flat},
+    {"RGB48_to_ARGB64_ccm", 6, 8, TRUE, run_rgb48_ccm},
+    // Preview output is 1 / PREVIEW_FACTOR^2 of the pixels
+    {"RGB48_to_ARGB64_preview4", 6,
+     8 + 8.0 / (PREVIEW_FACTOR * PREVIEW_FACTOR), TRUE, run_rgb48_preview},
+    {"RGB48_to_RGB24_tonemap", 6, 3, TRUE, run_tonemap},
+    {"decimate_rgb24_4", 3, 3.0 / (PREVIEW_FACTOR * PREVIEW_FACTOR), TRUE,
+     run_decimate_rgb24},
+    {"decimate_argb64_4", 8, 8.0 / (PREVIEW_FACTOR * PREVIEW_FACTOR), TRUE,
+     run_decimate_argb64},
+    {"correct_u8", 15, 3, FALSE, run_correct_u8},
+    {"stack_add_u16", 18, 12, FALSE, run_stack_u16},
+    {"hdr_merge3", 18, 6, TRUE, run_hdr_merge3},
+    // Only every SHARPNESS_ROW_STEP'th row is read
+    {"sharpness_u16", 6.0 / SHARPNESS_ROW_STEP, 0, FALSE,
+     run_sharpness_u16},
+};
+
+// Deterministic so runs are comparable
+static guint32 lcg(guint32 * state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+static BenchFrame *frame_new(gint width, gint height)
+{
+    BenchFrame *f = g_new0(BenchFrame, 1);
+    const gsize n = (gsize) width * height;
+    const gdouble wb[3] = { 1.8, 1.0, 1.4 };
+    const gdouble ccm[9] = {
+        1.6, -0.4, -0.2,
+        -0.3, 1.5, -0.2,
+        -0.1, -0.5, 1.6,
+    };
+    guint32 state = 1;
+
+    f->width = width;
+    f->height = height;
+    f->raw = g_new(guint16, n);
+    f->rgb48 = g_new(guint16, n * 3);
+    f->rgb24 = g_new(guint8, n * 3);
+    f->dark = g_new(guint16, n * 3);
+    f->flat = g_new(guint16, n * 3);
+    f->argb64 = g_new0(guint16, n * 4);
+    f->preview = g_new(guint16, n / (PREVIEW_FACTOR * PREVIEW_FACTOR) * 4);
+    f->acc = g_new0(guint32, n * 3);
+    for (gsize i = 0; i < n; ++i) {
+        f->raw[i] = lcg(&state) & 0xFFF;
+    }
+    for (gsize i = 0; i < n * 3; ++i) {
+        f->rgb48[i] = lcg(&state) & 0xFFF;
+        f->rgb24[i] = lcg(&state);
+        f->dark[i] = lcg(&state) & 0xF;
+        // Gains around 1.0 in 4.12 fixed point
+        f->flat[i] = 4096 - 128 + (lcg(&state) & 0xFF);
+    }
+    toupcam_color_init(&f->color, NULL, wb, 2.2, TOUPCAM_LUT_SIZE - 1);
+    toupcam_color_init(&f->color_ccm, ccm, wb, 2.2, TOUPCAM_LUT_SIZE - 1);
+    toupcam_tonemap_init(&f->tonemap, 64, 4000, wb, 2.2);
+    return f;
+}
+
+static void frame_free(BenchFrame * f)
+{
+    g_free(f->raw);
+    g_free(f->rgb48);
+    g_free(f->rgb24);
+    g_free(f->dark);
+    g_free(f->flat);
+    g_free(f->argb64);
+    g_free(f->preview);
+    g_free(f->acc);
+    g_free(f);
+}
+
+// Fastest iteration in seconds
+static gdouble bench_kernel(const BenchKernel * k, BenchFrame * f,
+                            ToupcamWorkers * w, gdouble min_time,
+                            gint min_iters, gint * iters)
+{
+    gdouble best = G_MAXDOUBLE;
+    gint64 start;
+
+    // Warm up caches, page in outputs and start the pool threads
+    k->run(f, w);
+    start = g_get_monotonic_time();
+    *iters = 0;
+    do {
+        gint64 t0 = g_get_monotonic_time();
+        k->run(f, w);
+        gint64 t1 = g_get_monotonic_time();
+        best = MIN(best, (t1 - t0) / (gdouble) G_USEC_PER_SEC);
+        ++*iters;
+    } while (*iters < min_iters
+             || g_get_monotonic_time() - start < min_time * G_USEC_PER_SEC);
+    return best;
+}
+
+typedef enum {
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSON,
+} BenchFormat;
+
+static void print_header(BenchFormat format)
+{
+    switch (format) {
+    case FORMAT_TEXT:
+        printf("%-26s %11s %7s %9s %8s %8s %7s\n", "kernel", "size",
+               "threads", "ms", "GB/s", "ns/pix", "speedup");
+        break;
+    case FORMAT_CSV:
+        printf("version,kernel,width,height,threads,iterations,seconds,"
+               "gbps,ns_per_pixel,speedup\n");
+        break;
+    case FORMAT_JSON:
+        break;
+    }
+}
+
+static void print_result(BenchFormat format, const BenchKernel * k,
+                         const BenchFrame * f, gint threads, gint iters,
+                         gdouble secs, gdouble speedup)
+{
+    const gdouble pixels = (gdouble) f->width * f->height;
+    const gdouble gbps = pixels * (k->bytes_in + k->bytes_out) / secs / 1e9;
+    const gdouble nspp = secs * 1e9 / pixels;
+
+    switch (format) {
+    case FORMAT_TEXT:
+        printf("%-26s %5dx%-5d %7d %9.3f %8.2f %8.3f %7.2f\n", k->name,
+               f->width, f->height, threads, secs * 1e3, gbps, nspp,
+               speedup);
+        break;
+    case FORMAT_CSV:
+        printf("%s,%s,%d,%d,%d,%d,%.9f,%.4f,%.4f,%.4f\n", PACKAGE_VERSION,
+               k->name, f->width, f->height, threads, iters, secs, gbps,
+               nspp, speedup);
+        break;
+    case FORMAT_JSON:
+        // One object per line
+        printf("{\"version\": \"%s\", \"kernel\": \"%s\", \"width\": %d, "
+               "\"height\": %d, \"threads\": %d, \"iterations\": %d, "
+               "\"seconds\": %.9f, \"gbps\": %.4f, \"ns_per_pixel\": %.4f, "
+               "\"speedup\": %.4f}\n", PACKAGE_VERSION, k->name, f->width,
+               f->height, threads, iters, secs, gbps, nspp, speedup);
+        break;
+    }
+    fflush(stdout);
+}
+
+static gboolean parse_size(const char *s, gint * width, gint * height)
+{
+    return sscanf(s, "%dx%d", width, height) == 2 && *width >= 16
+        && *height >= 16;
+}
+
+int main(int argc, char **argv)
+{
+    gchar **sizes = NULL;
+    gchar *kernel_filter = NULL;
+    gchar *format_str = NULL;
+    gint max_threads = 0;
+    gint min_iters = 3;
+    gdouble min_time = 0.5;
+    BenchFormat format = FORMAT_TEXT;
+    GError *error = NULL;
+    GOptionContext *context;
+    GOptionEntry entries[] = {
+        {"size", 's', 0, G_OPTION_ARG_STRING_ARRAY, &sizes,
+         "Frame size, may be repeated (default: all supported)", "WxH"},
+        {"kernel", 'k', 0, G_OPTION_ARG_STRING, &kernel_filter,
+         "Only run kernels whose name contains this", "NAME"},
+        {"threads", 't', 0, G_OPTION_ARG_INT, &max_threads,
+         "Largest worker count (default: number of CPUs)", "N"},
+        {"min-time", 0, 0, G_OPTION_ARG_DOUBLE, &min_time,
+         "Seconds to run each case for (default 0.5)", "SECS"},
+        {"min-iterations", 0, 0, G_OPTION_ARG_INT, &min_iters,
+         "Iterations to run each case for (default 3)", "N"},
+        {"format", 'f', 0, G_OPTION_ARG_STRING, &format_str,
+         "text, csv or json (one object per line)", "FORMAT"},
+        {NULL}
+    };
+
+    context = g_option_context_new("- benchmark toupcamsrc kernels");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (!format_str || !strcmp(format_str, "text")) {
+        format = FORMAT_TEXT;
+    } else if (!strcmp(format_str, "csv")) {
+        format = FORMAT_CSV;
+    } else if (!strcmp(format_str, "json")) {
+        format = FORMAT_JSON;
+    } else {
+        fprintf(stderr, "unknown format %s\n", format_str);
+        return 1;
+    }
+    if (max_threads <= 0) {
+        max_threads = g_get_num_processors();
+    }
+    max_threads = MIN(max_threads, TOUPCAM_MAX_WORKERS);
+
+    // 1, 2, 4... plus max_threads itself
+    GArray *threads = g_array_new(FALSE, FALSE, sizeof(gint));
+    for (gint n = 1; n < max_threads; n *= 2) {
+        g_array_append_val(threads, n);
+    }
+    g_array_append_val(threads, max_threads);
+
+    ToupcamWorkers **workers = g_new(ToupcamWorkers *, threads->len);
+    for (guint i = 0; i < threads->len; ++i) {
+        workers[i] = toupcam_workers_new(g_array_index(threads, gint, i));
+    }
+
+    GArray *dims = g_array_new(FALSE, FALSE, sizeof(gint) * 2);
+    if (sizes) {
+        for (gchar ** s = sizes; *s; ++s) {
+            gint wh[2];
+            if (!parse_size(*s, &wh[0], &wh[1])) {
+                fprintf(stderr, "bad size %s\n", *s);
+                return 1;
+            }
+            g_array_append_val(dims, wh);
+        }
+    } else {
+        g_array_append_vals(dims, default_sizes,
+                            G_N_ELEMENTS(default_sizes));
+    }
+
+    if (format == FORMAT_TEXT) {
+        printf("toupcam-bench %s, %d CPUs\n", PACKAGE_VERSION,
+               g_get_num_processors());
+    }
+    print_header(format);
+    for (guint d = 0; d < dims->len; ++d) {
+        const gint *wh = &g_array_index(dims, gint, d * 2);
+        BenchFrame *f = frame_new(wh[0], wh[1]);
+
+        for (gsize k = 0; k < G_N_ELEMENTS(kernels); ++k) {
+            const BenchKernel *kernel = &kernels[k];
+            gdouble single = 0.0;
+
+            if (kernel_filter && !strstr(kernel->name, kernel_filter)) {
+                continue;
+            }
+            for (guint t = 0; t < threads->len; ++t) {
+                gint n = g_array_index(threads, gint, t);
+                gint iters;
+                gdouble secs;
+
+                if (!kernel->threaded && n > 1) {
+                    break;
+                }
+                secs = bench_kernel(kernel, f, workers[t], min_time,
+                                    min_iters, &iters);
+                if (n == 1) {
+                    single = secs;
+                }
+                print_result(format, kernel, f, n, iters, secs,
+                             single / secs);
+            }
+        }
+        frame_free(f);
+    }
+
+    for (guint i = 0; i < threads->len; ++i) {
+        toupcam_workers_free(workers[i]);
+    }
+    g_free(workers);
+    g_array_free(threads, TRUE);
+    g_array_free(dims, TRUE);
+    g_strfreev(sizes);
+    g_free(kernel_filter);
+    g_free(format_str);
+    return 0;
+}
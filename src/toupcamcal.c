@@ -0,0 +1,204 @@
+/* GStreamer ToupCam Plugin
+ * Copyright (C) 2022 Labsmore LLC
+ *
+ * Author John McMaster <johndmcmaster@gmail.com>
+ * Author Kishore Arepalli <kishore.arepalli@gmail.com>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "toupcamcal.h"
+
+/*
+File layout: this header followed by n host endian 16 bit samples
+Files are not intended to be portable between machines
+*/
+struct master_header {
+    char magic[8];
+    guint32 esize;
+    guint32 width;
+    guint32 height;
+    guint32 expotime;
+    guint32 expoagain;
+    guint32 reserved;
+    guint64 n;
+};
+
+static const char *master_magic(ToupcamMasterKind kind)
+{
+    switch (kind) {
+    case TOUPCAM_MASTER_DARK:
+        return "TCDARK01";
+    case TOUPCAM_MASTER_FLAT:
+        return "TCFLAT01";
+    default:
+        return NULL;
+    }
+}
+
+ToupcamMaster *toupcam_master_new(ToupcamMasterKind kind, gsize n)
+{
+    ToupcamMaster *master = g_new0(ToupcamMaster, 1);
+
+    master->kind = kind;
+    master->n = n;
+    master->data = g_new(guint16, n);
+    return master;
+}
+
+void toupcam_master_free(ToupcamMaster * master)
+{
+    if (master) {
+        g_free(master->data);
+        g_free(master);
+    }
+}
+
+ToupcamMaster *toupcam_master_load(const char *fn, ToupcamMasterKind kind)
+{
+    struct master_header header;
+    ToupcamMaster *master;
+    FILE *fp;
+
+    fp = fopen(fn, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1
+        || memcmp(header.magic, master_magic(kind), sizeof(header.magic))) {
+        fclose(fp);
+        return NULL;
+    }
+
+    master = toupcam_master_new(kind, header.n);
+    master->esize = header.esize;
+    master->width = header.width;
+    master->height = header.height;
+    master->expotime = header.expotime;
+    master->expoagain = header.expoagain;
+    if (fread(master->data, sizeof(guint16), master->n, fp) != master->n) {
+        toupcam_master_free(master);
+        master = NULL;
+    }
+    fclose(fp);
+    return master;
+}
+
+gboolean toupcam_master_save(const ToupcamMaster * master, const char *fn)
+{
+    struct master_header header;
+    gboolean ok;
+    FILE *fp;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, master_magic(master->kind), sizeof(header.magic));
+    header.esize = master->esize;
+    header.width = master->width;
+    header.height = master->height;
+    header.expotime = master->expotime;
+    header.expoagain = master->expoagain;
+    header.n = master->n;
+
+    fp = fopen(fn, "wb");
+    if (!fp) {
+        return FALSE;
+    }
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1
+        && fwrite(master->data, sizeof(guint16), master->n,
+                  fp) == master->n;
+    if (fclose(fp)) {
+        ok = FALSE;
+    }
+    return ok;
+}
+
+struct defect_header {
+    char magic[8];
+    guint32 esize;
+    guint32 width;
+    guint32 height;
+    guint32 reserved;
+    guint64 n;
+    guint64 count;
+};
+
+#define DEFECT_MAGIC "TCDEFE01"
+
+ToupcamDefectMap *toupcam_defect_map_new(gsize count)
+{
+    ToupcamDefectMap *map = g_new0(ToupcamDefectMap, 1);
+
+    map->count = count;
+    map->index = g_new(guint32, MAX(count, 1));
+    return map;
+}
+
+void toupcam_defect_map_free(ToupcamDefectMap * map)
+{
+    if (map) {
+        g_free(map->index);
+        g_free(map);
+    }
+}
+
+ToupcamDefectMap *toupcam_defect_map_load(const char *fn)
+{
+    struct defect_header header;
+    ToupcamDefectMap *map;
+    FILE *fp;
+
+    fp = fopen(fn, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1
+        || memcmp(header.magic, DEFECT_MAGIC, sizeof(header.magic))) {
+        fclose(fp);
+        return NULL;
+    }
+
+    map = toupcam_defect_map_new(header.count);
+    map->esize = header.esize;
+    map->width = header.width;
+    map->height = header.height;
+    map->n = header.n;
+    if (fread(map->index, sizeof(guint32), map->count, fp) != map->count) {
+        toupcam_defect_map_free(map);
+        map = NULL;
+    }
+    fclose(fp);
+    return map;
+}
+
+gboolean toupcam_defect_map_save(const ToupcamDefectMap * map,
+                                 const char *fn)
+{
+    struct defect_header header;
+    gboolean ok;
+    FILE *fp;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DEFECT_MAGIC, sizeof(header.magic));
+    header.esize = map->esize;
+    header.width = map->width;
+    header.height = map->height;
+    header.n = map->n;
+    header.count = map->count;
+
+    fp = fopen(fn, "wb");
+    if (!fp) {
+        return FALSE;
+    }
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1
+        && fwrite(map->index, sizeof(guint32), map->count,
+                  fp) == map->count;
+    if (fclose(fp)) {
+        ok = FALSE;
+    }
+    return ok;
+}
@@ -0,0 +1,70 @@
+/* GStreamer ToupCam Plugin
+ * Copyright (C) 2022 Labsmore LLC
+ *
+ * Author John McMaster <johndmcmaster@gmail.com>
+ * Author Kishore Arepalli <kishore.arepalli@gmail.com>
+ */
+
+/*
+Calibration data (master dark / flat frames) and its on disk format
+
+A master is stored per input sample in the SDK pull format for the mode it
+was captured in and is only valid for the esize (and for darks exposure
+and gain) it was captured under
+*/
+
+#ifndef _TOUPCAM_CAL_H_
+#define _TOUPCAM_CAL_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    TOUPCAM_MASTER_NONE = 0,
+    TOUPCAM_MASTER_DARK,
+    TOUPCAM_MASTER_FLAT,
+} ToupcamMasterKind;
+
+typedef struct {
+    ToupcamMasterKind kind;
+    // Settings the master was captured under
+    gint esize;
+    gint width;
+    gint height;
+    guint expotime;
+    guint expoagain;
+    // Samples per frame
+    gsize n;
+    // Dark: sample offset. Flat: gain in 4.12 fixed point
+    guint16 *data;
+} ToupcamMaster;
+
+ToupcamMaster *toupcam_master_new(ToupcamMasterKind kind, gsize n);
+void toupcam_master_free(ToupcamMaster * master);
+// Returns NULL if the file can't be read or isn't a master of this kind
+ToupcamMaster *toupcam_master_load(const char *fn, ToupcamMasterKind kind);
+gboolean toupcam_master_save(const ToupcamMaster * master, const char *fn);
+
+/*
+Hot / dead pixel map
+Sorted input sample indices of defective samples for one esize
+*/
+typedef struct {
+    gint esize;
+    gint width;
+    gint height;
+    // Samples per frame
+    gsize n;
+    gsize count;
+    guint32 *index;
+} ToupcamDefectMap;
+
+ToupcamDefectMap *toupcam_defect_map_new(gsize count);
+void toupcam_defect_map_free(ToupcamDefectMap * map);
+ToupcamDefectMap *toupcam_defect_map_load(const char *fn);
+gboolean toupcam_defect_map_save(const ToupcamDefectMap * map,
+                                 const char *fn);
+
+G_END_DECLS
+#endif
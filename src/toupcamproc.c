@@ -0,0 +1,993 @@
+/* GStreamer ToupCam Plugin
+ * Copyright (C) 2022 Labsmore LLC
+ *
+ * Author John McMaster <johndmcmaster@gmail.com>
+ * Author Kishore Arepalli <kishore.arepalli@gmail.com>
+ */
+
+/*
+Loops are kept simple (restrict pointers, no cross iteration dependencies)
+so that the compiler can vectorize them
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "toupcamproc.h"
+
+static inline guint32 correct_sample(const ToupcamConvParams * p, gsize i,
+                                     guint32 v)
+{
+    if (p->dark) {
+        guint32 d = p->dark[i];
+        v = v > d ? v - d : 0;
+    }
+    if (p->flat) {
+        v = (v * p->flat[i] + (1 << 11)) >> 12;
+        if (v > p->max) {
+            v = p->max;
+        }
+    }
+    return v;
+}
+
+// Input pixel index of the start of crop window row y
+static inline gsize window_pixel(const ToupcamConvParams * p, gint y)
+{
+    const gsize in_width = p->in_width ? p->in_width : p->width;
+
+    return (gsize) (p->in_y + y) * in_width + p->in_x;
+}
+
+static inline gsize out_row_bytes(const ToupcamConvParams * p, gint bpp)
+{
+    return p->out_stride ? p->out_stride : (gsize) p->width * bpp;
+}
+
+static inline guint32 clamp_sample(gint32 v, guint32 max)
+{
+    if (v < 0) {
+        return 0;
+    }
+    return (guint32) v > max ? max : (guint32) v;
+}
+
+// Guards against samples above 12 bits from misbehaving firmware
+static inline guint16 lut_lookup(const guint16 * lut, guint32 v)
+{
+    return lut[MIN(v, TOUPCAM_LUT_SIZE - 1)];
+}
+
+struct _ToupcamWorkers {
+    GThreadPool *pool;
+    gint n;
+    GMutex lock;
+    GCond cond;
+    // Tasks outstanding in the current toupcam_workers_run()
+    gint pending;
+};
+
+typedef struct {
+    ToupcamRowFunc func;
+    gpointer data;
+    gint y0;
+    gint y1;
+} ToupcamWorkerTask;
+
+static void workers_func(gpointer task_data, gpointer user_data)
+{
+    ToupcamWorkers *w = user_data;
+    ToupcamWorkerTask *task = task_data;
+
+    task->func(task->data, task->y0, task->y1);
+    g_mutex_lock(&w->lock);
+    if (--w->pending == 0) {
+        g_cond_signal(&w->cond);
+    }
+    g_mutex_unlock(&w->lock);
+}
+
+ToupcamWorkers *toupcam_workers_new(gint n)
+{
+    ToupcamWorkers *w = g_new0(ToupcamWorkers, 1);
+
+    if (n <= 0) {
+        n = g_get_num_processors();
+    }
+    w->n = CLAMP(n, 1, TOUPCAM_MAX_WORKERS);
+    g_mutex_init(&w->lock);
+    g_cond_init(&w->cond);
+    // The calling thread does one share of the work itself
+    if (w->n > 1) {
+        w->pool = g_thread_pool_new(workers_func, w, w->n - 1, TRUE, NULL);
+        if (!w->pool) {
+            w->n = 1;
+        }
+    }
+    return w;
+}
+
+void toupcam_workers_free(ToupcamWorkers * w)
+{
+    if (w) {
+        if (w->pool) {
+            g_thread_pool_free(w->pool, FALSE, TRUE);
+        }
+        g_mutex_clear(&w->lock);
+        g_cond_clear(&w->cond);
+        g_free(w);
+    }
+}
+
+gint toupcam_workers_count(const ToupcamWorkers * w)
+{
+    return w ? w->n : 1;
+}
+
+void toupcam_workers_run(ToupcamWorkers * w, ToupcamRowFunc func,
+                         gpointer data, gint height)
+{
+    ToupcamWorkerTask tasks[TOUPCAM_MAX_WORKERS];
+    gint n = MIN(toupcam_workers_count(w), height);
+
+    if (n <= 1) {
+        func(data, 0, height);
+        return;
+    }
+
+    w->pending = n - 1;
+    for (gint i = 1; i < n; ++i) {
+        tasks[i].func = func;
+        tasks[i].data = data;
+        tasks[i].y0 = (gint64) height * i / n;
+        tasks[i].y1 = (gint64) height * (i + 1) / n;
+        g_thread_pool_push(w->pool, &tasks[i], NULL);
+    }
+    func(data, 0, height / n);
+
+    g_mutex_lock(&w->lock);
+    while (w->pending) {
+        g_cond_wait(&w->cond, &w->lock);
+    }
+    g_mutex_unlock(&w->lock);
+}
+
+void toupcam_color_init(ToupcamColor * color, const gdouble * ccm,
+                        const gdouble wb[3], gdouble gamma, guint32 max)
+{
+    gdouble lut_gain[3] = { 1.0, 1.0, 1.0 };
+
+    // Apply white balance before the matrix: fold it into the columns
+    color->ccm_enabled = ccm != NULL;
+    if (ccm) {
+        for (gint row = 0; row < 3; ++row) {
+            for (gint col = 0; col < 3; ++col) {
+                gdouble c = CLAMP(ccm[row * 3 + col] * wb[col], -7.99, 7.99);
+                color->ccm[row * 3 + col] = lround(c * 4096);
+            }
+        }
+    } else {
+        for (gint c = 0; c < 3; ++c) {
+            lut_gain[c] = wb[c];
+        }
+    }
+
+    for (gint c = 0; c < 3; ++c) {
+        for (gint v = 0; v < TOUPCAM_LUT_SIZE; ++v) {
+            gdouble x = (gdouble) MIN((guint32) v, max) / max * lut_gain[c];
+            x = MIN(x, 1.0);
+            if (gamma != 1.0) {
+                x = pow(x, 1.0 / gamma);
+            }
+            color->lut[c][v] = lround(x * G_MAXUINT16);
+        }
+    }
+}
+
+// Corrected and color matrixed RGB48 pixel, starting at sample i
+static inline void load_rgb48(const ToupcamConvParams * p,
+                              const guint16 * in, gsize i, guint32 rgb[3])
+{
+    guint32 r = in[i + 0], g = in[i + 1], b = in[i + 2];
+
+    if (p->dark || p->flat) {
+        r = correct_sample(p, i + 0, r);
+        g = correct_sample(p, i + 1, g);
+        b = correct_sample(p, i + 2, b);
+    }
+    if (p->color && p->color->ccm_enabled) {
+        const gint32 *m = p->color->ccm;
+        gint32 r2 = (m[0] * (gint32) r + m[1] * (gint32) g +
+                     m[2] * (gint32) b + (1 << 11)) >> 12;
+        gint32 g2 = (m[3] * (gint32) r + m[4] * (gint32) g +
+                     m[5] * (gint32) b + (1 << 11)) >> 12;
+        gint32 b2 = (m[6] * (gint32) r + m[7] * (gint32) g +
+                     m[8] * (gint32) b + (1 << 11)) >> 12;
+        r = clamp_sample(r2, p->max);
+        g = clamp_sample(g2, p->max);
+        b = clamp_sample(b2, p->max);
+    }
+    rgb[0] = MIN(r, TOUPCAM_LUT_SIZE - 1);
+    rgb[1] = MIN(g, TOUPCAM_LUT_SIZE - 1);
+    rgb[2] = MIN(b, TOUPCAM_LUT_SIZE - 1);
+}
+
+/*
+Box filter one block of preview rows
+acc holds one row of per sample sums
+*/
+static void box_rgb24_rows(const guint8 * in, gsize in_row, gint width,
+                           guint8 * out, gsize stride, gint factor,
+                           gint oy0, gint oy1)
+{
+    const gint ow = width / factor;
+    const guint32 div = factor * factor;
+    guint32 *acc = g_new(guint32, ow * 3);
+
+    for (gint oy = oy0; oy < oy1; ++oy) {
+        guint8 *dst = out + oy * stride;
+
+        memset(acc, 0, ow * 3 * sizeof(guint32));
+        for (gint fy = 0; fy < factor; ++fy) {
+            const guint8 *row = in + ((gsize) oy * factor + fy) * in_row;
+            for (gint ox = 0; ox < ow; ++ox) {
+                const guint8 *px = row + (gsize) ox * factor * 3;
+                for (gint fx = 0; fx < factor * 3; fx += 3) {
+                    acc[ox * 3 + 0] += px[fx + 0];
+                    acc[ox * 3 + 1] += px[fx + 1];
+                    acc[ox * 3 + 2] += px[fx + 2];
+                }
+            }
+        }
+        for (gint i = 0; i < ow * 3; ++i) {
+            dst[i] = (acc[i] + div / 2) / div;
+        }
+    }
+    g_free(acc);
+}
+
+static void box_argb64_rows(const guint8 * in, gsize in_row, gint width,
+                            guint16 * out, gsize stride, gint factor,
+                            gint oy0, gint oy1)
+{
+    const gint ow = width / factor;
+    const guint32 div = factor * factor;
+    guint32 *acc = g_new(guint32, ow * 3);
+
+    for (gint oy = oy0; oy < oy1; ++oy) {
+        guint16 *dst = (guint16 *) ((guint8 *) out + oy * stride);
+
+        memset(acc, 0, ow * 3 * sizeof(guint32));
+        for (gint fy = 0; fy < factor; ++fy) {
+            const guint16 *row = (const guint16 *)
+                (in + ((gsize) oy * factor + fy) * in_row);
+            for (gint ox = 0; ox < ow; ++ox) {
+                const guint16 *px = row + (gsize) ox * factor * 4;
+                // Alpha isn't written by the conversions, skip it
+                for (gint fx = 0; fx < factor * 4; fx += 4) {
+                    acc[ox * 3 + 0] += px[fx + 1];
+                    acc[ox * 3 + 1] += px[fx + 2];
+                    acc[ox * 3 + 2] += px[fx + 3];
+                }
+            }
+        }
+        for (gint ox = 0; ox < ow; ++ox) {
+            dst[ox * 4 + 0] = G_MAXUINT16;
+            dst[ox * 4 + 1] = (acc[ox * 3 + 0] + div / 2) / div;
+            dst[ox * 4 + 2] = (acc[ox * 3 + 1] + div / 2) / div;
+            dst[ox * 4 + 3] = (acc[ox * 3 + 2] + div / 2) / div;
+        }
+    }
+    g_free(acc);
+}
+
+typedef struct {
+    const unsigned char *in;
+    gsize in_stride;
+    unsigned char *out;
+    gsize stride;
+    gint width;
+    gint factor;
+    gboolean argb64;
+} BoxJob;
+
+static void box_rows(gpointer data, gint y0, gint y1)
+{
+    const BoxJob *job = data;
+
+    if (job->argb64) {
+        box_argb64_rows(job->in, job->in_stride, job->width,
+                        (guint16 *) job->out, job->stride, job->factor, y0,
+                        y1);
+    } else {
+        box_rgb24_rows(job->in, job->in_stride, job->width, job->out,
+                       job->stride, job->factor, y0, y1);
+    }
+}
+
+void toupcam_decimate_rgb24(ToupcamWorkers * w, const guint8 * in,
+                            gsize in_stride, gint width, gint height,
+                            guint8 * out, gsize stride, gint factor)
+{
+    BoxJob job = { in, in_stride, out, stride, width, factor, FALSE };
+
+    toupcam_workers_run(w, box_rows, &job, height / factor);
+}
+
+void toupcam_decimate_argb64(ToupcamWorkers * w, const guint16 * in,
+                             gsize in_stride, gint width, gint height,
+                             guint16 * out, gsize stride, gint factor)
+{
+    BoxJob job = { (const unsigned char *) in, in_stride,
+        (unsigned char *) out, stride, width, factor, TRUE
+    };
+
+    toupcam_workers_run(w, box_rows, &job, height / factor);
+}
+
+typedef struct {
+    const ToupcamConvParams *p;
+    const unsigned char *bufin;
+    unsigned char *bufout;
+} ConvJob;
+
+typedef struct {
+    ConvJob *conv;
+    ToupcamRowFunc convert;
+    BoxJob box;
+} PreviewJob;
+
+// Convert the full resolution rows behind a block of preview rows, then
+// decimate them while they are still in cache
+static void preview_rows(gpointer data, gint y0, gint y1)
+{
+    PreviewJob *job = data;
+    const ToupcamConvParams *p = job->conv->p;
+    const gint f = p->preview_factor;
+    // Rows that don't fill a block are only converted
+    const gint end = y1 == p->height / f ? p->height : y1 * f;
+
+    job->convert(job->conv, y0 * f, end);
+    box_rows(&job->box, y0, y1);
+}
+
+static void conv_run(const ToupcamConvParams * p, ToupcamRowFunc convert,
+                     ConvJob * conv, gboolean argb64)
+{
+    const gint preview_height =
+        p->preview ? p->height / p->preview_factor : 0;
+
+    if (preview_height > 0) {
+        PreviewJob job = { conv, convert,
+            {conv->bufout, out_row_bytes(p, argb64 ? 8 : 3), p->preview,
+             p->preview_stride, p->width, p->preview_factor, argb64}
+        };
+        toupcam_workers_run(p->workers, preview_rows, &job,
+                            preview_height);
+    } else {
+        toupcam_workers_run(p->workers, convert, conv, p->height);
+    }
+}
+
+static void GBRG12_rows(gpointer data, gint y0, gint y1)
+{
+    const ConvJob *job = data;
+    const ToupcamConvParams *p = job->p;
+    const guint16 *in = (const guint16 *) job->bufin;
+    const gboolean correct = p->dark || p->flat;
+    const ToupcamColor *color = p->color;
+    const gsize out_row = out_row_bytes(p, 8);
+
+    for (gint y = y0; y < y1; ++y) {
+        gsize i = window_pixel(p, y);
+        guint16 *out = (guint16 *) (job->bufout + y * out_row);
+
+        for (gint x = 0; x < p->width; ++x) {
+            guint32 v = in[i];
+            if (correct) {
+                v = correct_sample(p, i, v);
+            }
+            unsigned colori = (p->in_x + x) % 4;
+            // blue
+            if (colori == 1) {
+                out[3] = color ? lut_lookup(color->lut[2], v) : v << p->shift;
+                // red
+            } else if (colori == 3) {
+                out[1] = color ? lut_lookup(color->lut[0], v) : v << p->shift;
+                // green
+            } else {
+                out[2] = color ? lut_lookup(color->lut[1], v) : v << p->shift;
+            }
+            ++i;
+            out += 4;
+        }
+    }
+}
+
+/*
+Output is ARGB64 in host order: [0] A, [1] R, [2] G, [3] B
+Alpha isn't written
+*/
+void GBRG12_to_ARGB64_x4(const ToupcamConvParams * p,
+                         const unsigned char *bufin, unsigned char *bufout)
+{
+    ConvJob job = { p, bufin, bufout };
+
+    conv_run(p, GBRG12_rows, &job, TRUE);
+}
+
+static void RGB48_rows(gpointer data, gint y0, gint y1)
+{
+    const ConvJob *job = data;
+    const ToupcamConvParams *p = job->p;
+    const guint16 *restrict in = (const guint16 *) job->bufin;
+    const ToupcamColor *color = p->color;
+    const gint shift = p->shift;
+    const gsize out_row = out_row_bytes(p, 8);
+
+    for (gint y = y0; y < y1; ++y) {
+        const gsize start = window_pixel(p, y) * 3;
+        const gsize end = start + (gsize) p->width * 3;
+        guint16 *restrict out = (guint16 *) (job->bufout + y * out_row);
+
+        if (color) {
+            for (gsize i = start; i < end; i += 3) {
+                guint32 rgb[3];
+                load_rgb48(p, in, i, rgb);
+                out[1] = color->lut[0][rgb[0]];
+                out[2] = color->lut[1][rgb[1]];
+                out[3] = color->lut[2][rgb[2]];
+                out += 4;
+            }
+        } else if (p->dark || p->flat) {
+            for (gsize i = start; i < end; i += 3) {
+                out[1] = correct_sample(p, i + 0, in[i + 0]) << shift;
+                out[2] = correct_sample(p, i + 1, in[i + 1]) << shift;
+                out[3] = correct_sample(p, i + 2, in[i + 2]) << shift;
+                out += 4;
+            }
+        } else {
+            for (gsize i = start; i < end; i += 3) {
+                out[1] = in[i + 0] << shift;
+                out[2] = in[i + 1] << shift;
+                out[3] = in[i + 2] << shift;
+                out += 4;
+            }
+        }
+    }
+}
+
+void RGB48_to_ARGB64_x4(const ToupcamConvParams * p,
+                        const unsigned char *bufin, unsigned char *bufout)
+{
+    ConvJob job = { p, bufin, bufout };
+
+    conv_run(p, RGB48_rows, &job, TRUE);
+}
+
+void toupcam_tonemap_init(ToupcamTonemap * tm, guint32 black, guint32 white,
+                          const gdouble gain[3], gdouble gamma)
+{
+    if (white <= black) {
+        white = black + 1;
+    }
+    for (gint c = 0; c < 3; ++c) {
+        for (gint v = 0; v < TOUPCAM_LUT_SIZE; ++v) {
+            gdouble x = v * gain[c];
+            tm->bin[c][v] = MIN(lround(x), TOUPCAM_LUT_SIZE - 1);
+            x = (x - black) / (white - black);
+            x = CLAMP(x, 0.0, 1.0);
+            if (gamma != 1.0) {
+                x = pow(x, 1.0 / gamma);
+            }
+            tm->lut[c][v] = lround(x * G_MAXUINT8);
+        }
+    }
+}
+
+guint32 toupcam_hist_percentile(const guint32 * hist, gsize bins,
+                                gdouble percent)
+{
+    guint64 total = 0;
+    guint64 target;
+    guint64 sum = 0;
+
+    for (gsize i = 0; i < bins; ++i) {
+        total += hist[i];
+    }
+    target = total * CLAMP(percent, 0.0, 100.0) / 100.0;
+    for (gsize i = 0; i < bins; ++i) {
+        sum += hist[i];
+        if (sum > target) {
+            return i;
+        }
+    }
+    return bins - 1;
+}
+
+static void RGB48_RGB24_rows(gpointer data, gint y0, gint y1)
+{
+    const ConvJob *job = data;
+    const ToupcamConvParams *p = job->p;
+    const guint16 *in = (const guint16 *) job->bufin;
+    const ToupcamTonemap *tm = p->tonemap;
+    const gsize row = (gsize) p->width * 3;
+    const gsize out_row = out_row_bytes(p, 3);
+    guint32 hist[TOUPCAM_LUT_SIZE];
+
+    if (p->hist) {
+        memset(hist, 0, sizeof(hist));
+    }
+    for (gint y = y0; y < y1; ++y) {
+        const gsize start = window_pixel(p, y) * 3;
+        guint8 *out = job->bufout + y * out_row;
+
+        for (gsize i = 0; i < row; i += 3) {
+            guint32 rgb[3];
+            load_rgb48(p, in, start + i, rgb);
+            out[i + 0] = tm->lut[0][rgb[0]];
+            out[i + 1] = tm->lut[1][rgb[1]];
+            out[i + 2] = tm->lut[2][rgb[2]];
+        }
+        // Sparse sample of the row while it's still in cache
+        if (p->hist && y % p->hist_step == 0) {
+            const gsize step = (gsize) p->hist_step * 3;
+            for (gsize i = start; i < start + row; i += step) {
+                guint32 rgb[3];
+                load_rgb48(p, in, i, rgb);
+                hist[tm->bin[0][rgb[0]]] += 1;
+                hist[tm->bin[1][rgb[1]]] += 1;
+                hist[tm->bin[2][rgb[2]]] += 1;
+            }
+        }
+    }
+    if (p->hist) {
+        for (gint v = 0; v < TOUPCAM_LUT_SIZE; ++v) {
+            if (hist[v]) {
+                g_atomic_int_add((gint *) & p->hist[v], hist[v]);
+            }
+        }
+    }
+}
+
+void RGB48_to_RGB24_tonemap(const ToupcamConvParams * p,
+                            const unsigned char *bufin,
+                            unsigned char *bufout)
+{
+    ConvJob job = { p, bufin, bufout };
+
+    if (p->hist) {
+        memset(p->hist, 0, TOUPCAM_LUT_SIZE * sizeof(guint32));
+    }
+    conv_run(p, RGB48_RGB24_rows, &job, FALSE);
+}
+
+void toupcam_correct_u8(const ToupcamConvParams * p, const guint8 * in,
+                        guint8 * out)
+{
+    const gsize row = (gsize) p->width * 3;
+    const gsize out_row = out_row_bytes(p, 3);
+
+    for (gint y = 0; y < p->height; ++y) {
+        const gsize start = window_pixel(p, y) * 3;
+        guint8 *dst = out + y * out_row;
+
+        for (gsize i = 0; i < row; ++i) {
+            dst[i] = correct_sample(p, start + i, in[start + i]);
+        }
+    }
+}
+
+static inline gint sample_channel(gboolean bayer, gint y, gsize x)
+{
+    if (bayer) {
+        return ((y & 1) << 1) | (x & 1);
+    }
+    return x % 3;
+}
+
+void toupcam_flat_gain(guint16 * gain, const guint16 * flat,
+                       const guint16 * dark, gsize row_samples,
+                       gint height, gboolean bayer)
+{
+    guint64 sum[4] = { 0 };
+    guint64 count[4] = { 0 };
+    guint64 mean[4];
+    gsize i = 0;
+
+    for (gint y = 0; y < height; ++y) {
+        for (gsize x = 0; x < row_samples; ++x, ++i) {
+            gint c = sample_channel(bayer, y, x);
+            guint32 v = flat[i];
+            if (dark) {
+                v = v > dark[i] ? v - dark[i] : 0;
+            }
+            sum[c] += v;
+            count[c] += 1;
+        }
+    }
+    for (gint c = 0; c < 4; ++c) {
+        mean[c] = count[c] ? sum[c] / count[c] : 0;
+    }
+
+    i = 0;
+    for (gint y = 0; y < height; ++y) {
+        for (gsize x = 0; x < row_samples; ++x, ++i) {
+            gint c = sample_channel(bayer, y, x);
+            guint32 v = flat[i];
+            if (dark) {
+                v = v > dark[i] ? v - dark[i] : 0;
+            }
+            // Dead pixels get the max gain rather than a divide by 0
+            guint64 g = v ? (mean[c] << 12) / v : G_MAXUINT16;
+            gain[i] = MIN(g, G_MAXUINT16);
+        }
+    }
+}
+
+void toupcam_stack_add_u8(guint32 * restrict acc,
+                          const guint8 * restrict in, gsize n)
+{
+    for (gsize i = 0; i < n; ++i) {
+        acc[i] += in[i];
+    }
+}
+
+void toupcam_stack_add_u16(guint32 * restrict acc,
+                           const guint16 * restrict in, gsize n)
+{
+    for (gsize i = 0; i < n; ++i) {
+        acc[i] += in[i];
+    }
+}
+
+/*
+Divide by multiplying with a 32.32 fixed point reciprocal
+Exact for the accumulator range we use (count <= 256, 16 bit samples)
+*/
+static guint64 stack_reciprocal(guint count)
+{
+    return ((G_GUINT64_CONSTANT(1) << 32) + count - 1) / count;
+}
+
+void toupcam_stack_mean_u8(guint8 * restrict out,
+                           const guint32 * restrict acc, gsize n,
+                           guint count)
+{
+    const guint64 recip = stack_reciprocal(count);
+    const guint32 round = count / 2;
+
+    for (gsize i = 0; i < n; ++i) {
+        out[i] = ((acc[i] + round) * recip) >> 32;
+    }
+}
+
+void toupcam_stack_mean_u16(guint16 * restrict out,
+                            const guint32 * restrict acc, gsize n,
+                            guint count)
+{
+    const guint64 recip = stack_reciprocal(count);
+    const guint32 round = count / 2;
+
+    for (gsize i = 0; i < n; ++i) {
+        out[i] = ((acc[i] + round) * recip) >> 32;
+    }
+}
+
+guint64 toupcam_sharpness_u8(const guint8 * in, gsize row_samples,
+                             gint height, gint offset, gint step,
+                             gint row_step)
+{
+    guint64 score = 0;
+
+    for (gint y = 0; y < height; y += row_step) {
+        const guint8 *row = in + y * row_samples;
+        guint32 row_score = 0;
+
+        // 8 bit squared differences can't overflow 32 bits for any sane width
+        for (gsize x = offset; x + step < row_samples; x += step) {
+            gint32 d = (gint32) row[x + step] - row[x];
+            row_score += d * d;
+        }
+        score += row_score;
+    }
+    return score;
+}
+
+guint64 toupcam_sharpness_u16(const guint16 * in, gsize row_samples,
+                              gint height, gint offset, gint step,
+                              gint row_step)
+{
+    guint64 score = 0;
+
+    for (gint y = 0; y < height; y += row_step) {
+        const guint16 *row = in + y * row_samples;
+
+        for (gsize x = offset; x + step < row_samples; x += step) {
+            gint64 d = (gint64) row[x + step] - row[x];
+            score += d * d;
+        }
+    }
+    return score;
+}
+
+void toupcam_profile_u8(const guint8 * in, gsize row_samples, gint width,
+                        gint height, gint offset, gint step, gint skip,
+                        guint32 * cols, guint32 * rows)
+{
+    memset(cols, 0, width * sizeof(*cols));
+    for (gint y = 0; y < height; ++y) {
+        const guint8 *row = in + y * row_samples + offset;
+        guint32 sum = 0;
+
+        if (y % skip == 0) {
+            for (gint x = 0; x < width; ++x) {
+                cols[x] += row[x * step];
+            }
+        }
+        for (gint x = 0; x < width; x += skip) {
+            sum += row[x * step];
+        }
+        rows[y] = sum;
+    }
+}
+
+void toupcam_profile_u16(const guint16 * in, gsize row_samples, gint width,
+                         gint height, gint offset, gint step, gint skip,
+                         guint32 * cols, guint32 * rows)
+{
+    memset(cols, 0, width * sizeof(*cols));
+    for (gint y = 0; y < height; ++y) {
+        const guint16 *row = in + y * row_samples + offset;
+        guint32 sum = 0;
+
+        if (y % skip == 0) {
+            for (gint x = 0; x < width; ++x) {
+                cols[x] += row[x * step];
+            }
+        }
+        for (gint x = 0; x < width; x += skip) {
+            sum += row[x * step];
+        }
+        rows[y] = sum;
+    }
+}
+
+gdouble toupcam_profile_shift(const guint32 * a, const guint32 * b, gint n,
+                              gint max_shift, gdouble * residual)
+{
+    gdouble err[2 * TOUPCAM_PROFILE_MAX_SHIFT + 1];
+    gdouble sum_a = 0, sum_b = 0;
+    gdouble scale, mean;
+    gint best;
+
+    for (gint i = 0; i < n; ++i) {
+        sum_a += a[i];
+        sum_b += b[i];
+    }
+    *residual = 0.0;
+    if (sum_a <= 0 || sum_b <= 0) {
+        return 0.0;
+    }
+    mean = sum_a / n;
+    scale = sum_a / sum_b;
+    max_shift = MIN(max_shift, MIN(TOUPCAM_PROFILE_MAX_SHIFT, n / 4));
+    best = -max_shift;
+
+    // b[i + s] lines up with a[i]
+    for (gint s = -max_shift; s <= max_shift; ++s) {
+        gint i0 = MAX(0, -s);
+        gint i1 = MIN(n, n - s);
+        gdouble e = 0;
+
+        for (gint i = i0; i < i1; ++i) {
+            e += fabs(a[i] - b[i + s] * scale);
+        }
+        err[s + max_shift] = e / ((i1 - i0) * mean);
+        if (err[s + max_shift] < err[best + max_shift]) {
+            best = s;
+        }
+    }
+    *residual = err[best + max_shift];
+
+    // Parabola through the minimum and its neighbours
+    if (best > -max_shift && best < max_shift) {
+        gdouble l = err[best + max_shift - 1];
+        gdouble r = err[best + max_shift + 1];
+        gdouble d = l - 2 * *residual + r;
+
+        if (d > 0) {
+            return best + (l - r) / (2 * d);
+        }
+    }
+    return best;
+}
+
+void toupcam_defects_detect(GArray * out, const guint16 * plane, gsize n,
+                            gdouble sigma, gboolean below)
+{
+    gdouble sum = 0, sum2 = 0;
+
+    for (gsize i = 0; i < n; ++i) {
+        sum += plane[i];
+        sum2 += (gdouble) plane[i] * plane[i];
+    }
+    gdouble mean = sum / n;
+    gdouble std = sqrt(MAX(sum2 / n - mean * mean, 0.0));
+    gdouble hi = mean + sigma * std;
+    gdouble lo = mean - sigma * std;
+
+    for (gsize i = 0; i < n; ++i) {
+        if (plane[i] > hi || (below && plane[i] < lo)) {
+            guint32 index = i;
+            g_array_append_val(out, index);
+        }
+    }
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    guint32 va = *(const guint32 *) a;
+    guint32 vb = *(const guint32 *) b;
+    return va < vb ? -1 : va > vb;
+}
+
+static gboolean is_defect(const guint32 * index, gsize count, guint32 i)
+{
+    return bsearch(&i, index, count, sizeof(guint32), cmp_u32) != NULL;
+}
+
+static void sort_u32(guint32 * v, gint n)
+{
+    for (gint i = 1; i < n; ++i) {
+        guint32 t = v[i];
+        gint j = i - 1;
+        for (; j >= 0 && v[j] > t; --j) {
+            v[j + 1] = v[j];
+        }
+        v[j + 1] = t;
+    }
+}
+
+/*
+Shared by 8 / 16 bit variants
+Only one of data8 / data16 is set
+*/
+static void defects_correct(guint8 * data8, guint16 * data16,
+                            const guint32 * index, gsize count,
+                            gsize row_samples, gint height, gint dx,
+                            gint dy)
+{
+    static const gint offsets[8][2] = {
+        {-1, -1}, {0, -1}, {1, -1},
+        {-1, 0}, {1, 0},
+        {-1, 1}, {0, 1}, {1, 1},
+    };
+
+    for (gsize d = 0; d < count; ++d) {
+        guint32 i = index[d];
+        gint y = i / row_samples;
+        gint x = i % row_samples;
+        guint32 v[8];
+        gint nv = 0;
+
+        for (gint o = 0; o < 8; ++o) {
+            gint nx = x + offsets[o][0] * dx;
+            gint ny = y + offsets[o][1] * dy;
+            if (nx < 0 || nx >= (gint) row_samples || ny < 0
+                || ny >= height) {
+                continue;
+            }
+            guint32 j = ny * row_samples + nx;
+            if (is_defect(index, count, j)) {
+                continue;
+            }
+            v[nv++] = data16 ? data16[j] : data8[j];
+        }
+        if (!nv) {
+            continue;
+        }
+        sort_u32(v, nv);
+        if (data16) {
+            data16[i] = v[nv / 2];
+        } else {
+            data8[i] = v[nv / 2];
+        }
+    }
+}
+
+void toupcam_defects_correct_u8(guint8 * data, const guint32 * index,
+                                gsize count, gsize row_samples,
+                                gint height, gint dx, gint dy)
+{
+    defects_correct(data, NULL, index, count, row_samples, height, dx, dy);
+}
+
+void toupcam_defects_correct_u16(guint16 * data, const guint32 * index,
+                                 gsize count, gsize row_samples,
+                                 gint height, gint dx, gint dy)
+{
+    defects_correct(NULL, data, index, count, row_samples, height, dx, dy);
+}
+
+typedef struct {
+    const ToupcamHdrParams *p;
+    guint16 *out;
+} HdrJob;
+
+static void hdr_rows(gpointer data, gint y0, gint y1)
+{
+    const HdrJob *job = data;
+    const ToupcamHdrParams *p = job->p;
+    const gsize row = p->row_samples;
+    const gfloat half = p->max / 2.0f;
+    gfloat scale[TOUPCAM_HDR_MAX];
+    gint shortest = 0;
+    gfloat *num = g_new(gfloat, row);
+    gfloat *den = g_new(gfloat, row);
+
+    for (gint f = 1; f < p->count; ++f) {
+        if (p->expotime[f] < p->expotime[shortest]) {
+            shortest = f;
+        }
+    }
+    for (gint f = 0; f < p->count; ++f) {
+        scale[f] = (gfloat) MAX(p->expotime[shortest], 1) /
+            MAX(p->expotime[f], 1) * G_MAXUINT16 / p->max;
+    }
+
+    for (gint y = y0; y < y1; ++y) {
+        const gsize off = (gsize) y * row;
+        const guint16 *restrict fallback = p->in[shortest] + off;
+        guint16 *restrict out = job->out + off;
+
+        memset(num, 0, row * sizeof(gfloat));
+        memset(den, 0, row * sizeof(gfloat));
+        for (gint f = 0; f < p->count; ++f) {
+            const guint16 *restrict in = p->in[f] + off;
+            const gfloat s = scale[f];
+            gfloat *restrict n = num;
+            gfloat *restrict d = den;
+            for (gsize x = 0; x < row; ++x) {
+                // Hat: 0 at black and at clipping
+                gfloat v = in[x];
+                gfloat w = half - fabsf(v - half);
+                w = w > 0.0f ? w : 0.0f;
+                n[x] += w * v * s;
+                d[x] += w;
+            }
+        }
+        for (gsize x = 0; x < row; ++x) {
+            // Black or clipped everywhere: the shortest exposure says which
+            gfloat r = den[x] > 0.0f ? num[x] / den[x]
+                : fallback[x] * scale[shortest];
+            guint32 v = r < G_MAXUINT16 ? (guint32) (r + 0.5f) : G_MAXUINT16;
+            out[x] = p->curve ? p->curve[v] : v;
+        }
+    }
+    g_free(num);
+    g_free(den);
+}
+
+void toupcam_hdr_merge(const ToupcamHdrParams * p, guint16 * out)
+{
+    HdrJob job = { p, out };
+
+    toupcam_workers_run(p->workers, hdr_rows, &job, p->height);
+}
+
+void toupcam_hdr_curve_init(guint16 * curve, guint32 max)
+{
+    // Linear below ~toe, logarithmic above
+    const gdouble toe = 64.0;
+    const gdouble norm = log1p(G_MAXUINT16 / toe);
+
+    for (guint32 v = 0; v <= G_MAXUINT16; ++v) {
+        curve[v] = lround(max * log1p(v / toe) / norm);
+    }
+}
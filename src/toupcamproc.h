@@ -0,0 +1,270 @@
+/* GStreamer ToupCam Plugin
+ * Copyright (C) 2022 Labsmore LLC
+ *
+ * Author John McMaster <johndmcmaster@gmail.com>
+ * Author Kishore Arepalli <kishore.arepalli@gmail.com>
+ */
+
+/*
+Image processing kernels used by toupcamsrc
+
+These only operate on plain memory and don't know about the SDK or GStreamer
+buffers so they can be reused / benchmarked without a camera
+Sample counts are in units of samples (ie pixels * channels), not bytes
+*/
+
+#ifndef _TOUPCAM_PROC_H_
+#define _TOUPCAM_PROC_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define TOUPCAM_MAX_WORKERS 64
+
+/*
+Row parallel helper for the conversion kernels
+func is called for disjoint [y0, y1) row ranges, one of them on the calling
+thread, and toupcam_workers_run() returns once all have completed
+n <= 0 uses one thread per CPU
+*/
+typedef struct _ToupcamWorkers ToupcamWorkers;
+typedef void (*ToupcamRowFunc) (gpointer data, gint y0, gint y1);
+
+ToupcamWorkers *toupcam_workers_new(gint n);
+void toupcam_workers_free(ToupcamWorkers * w);
+gint toupcam_workers_count(const ToupcamWorkers * w);
+// w may be NULL to run on the calling thread
+void toupcam_workers_run(ToupcamWorkers * w, ToupcamRowFunc func,
+                         gpointer data, gint height);
+
+// 12 bit input samples
+#define TOUPCAM_LUT_SIZE 4096
+
+/*
+Host side color processing for the 16 bit paths
+White balance, then the color matrix, then a per channel tone curve
+*/
+typedef struct {
+    // Only meaningful for RGB input, a mosaic has one channel per sample
+    gboolean ccm_enabled;
+    // Row major 3x3 in 4.12 fixed point with white balance folded in
+    gint32 ccm[9];
+    // Per output channel (R, G, B): 12 bit in, 16 bit out
+    // White balance is folded in here when there is no matrix
+    guint16 lut[3][TOUPCAM_LUT_SIZE];
+} ToupcamColor;
+
+/*
+ccm: row major 3x3 or NULL
+wb: R, G, B gains
+gamma: 1.0 is linear
+max: largest input sample value, maps to full scale output
+*/
+void toupcam_color_init(ToupcamColor * color, const gdouble * ccm,
+                        const gdouble wb[3], gdouble gamma, guint32 max);
+
+/*
+16 bit to 8 bit output curve, per output channel (R, G, B)
+Indexed by 12 bit sample after correction and color matrix
+*/
+typedef struct {
+    guint8 lut[3][TOUPCAM_LUT_SIZE];
+    // Histogram bin of each sample after the gain, so percentiles are in
+    // the same units as black / white
+    guint16 bin[3][TOUPCAM_LUT_SIZE];
+} ToupcamTonemap;
+
+/*
+Linear stretch of [black, white] to [0, 255] followed by gamma
+Samples are multiplied by the per channel gain first
+*/
+void toupcam_tonemap_init(ToupcamTonemap * tm, guint32 black, guint32 white,
+                          const gdouble gain[3], gdouble gamma);
+// Smallest bin at or above percent (0 to 100) of the histogram total
+guint32 toupcam_hist_percentile(const guint32 * hist, gsize bins,
+                                gdouble percent);
+
+/*
+Parameters for converting a pulled frame to the output format
+Optional stages are skipped when their pointers are NULL
+*/
+typedef struct {
+    gint width;
+    gint height;
+    /*
+       Crop window: convert width x height pixels starting at in_x, in_y of
+       an in_width pixel wide input frame, dark / flat are indexed like the
+       input. 0 in_width => the input is width wide
+     */
+    gint in_x;
+    gint in_y;
+    gint in_width;
+    // Bytes per output row, 0 => packed
+    gsize out_stride;
+    // Largest valid input sample value, ie 4095 for 12 bit
+    guint32 max;
+    // Left shift from uncorrected input samples to 16 bit output
+    // 4 for 12 bit input, 0 for full range (HDR) input
+    gint shift;
+    // Dark offset, one per input sample
+    const guint16 *dark;
+    // Flat field gain in 4.12 fixed point, one per input sample
+    const guint16 *flat;
+    // Color processing, 16 bit paths only
+    const ToupcamColor *color;
+    // NULL to convert on the calling thread
+    ToupcamWorkers *workers;
+    // 8 bit output curve, RGB48_to_RGB24_tonemap() only
+    const ToupcamTonemap *tonemap;
+    /*
+       If set, RGB48_to_RGB24_tonemap() fills this TOUPCAM_LUT_SIZE bin
+       histogram from every hist_step'th pixel of every hist_step'th row
+     */
+    guint32 *hist;
+    gint hist_step;
+    /*
+       If set, also write a preview_factor box filtered copy of the output
+       here (same pixel format, width / factor x height / factor)
+     */
+    unsigned char *preview;
+    // Bytes per preview row
+    gsize preview_stride;
+    gint preview_factor;
+} ToupcamConvParams;
+
+// raw to common format
+void GBRG12_to_ARGB64_x4(const ToupcamConvParams * p,
+                         const unsigned char *bufin,
+                         unsigned char *bufout);
+// high def to common format
+void RGB48_to_ARGB64_x4(const ToupcamConvParams * p,
+                        const unsigned char *bufin, unsigned char *bufout);
+// high def to 8 bit RGB through p->tonemap
+void RGB48_to_RGB24_tonemap(const ToupcamConvParams * p,
+                            const unsigned char *bufin,
+                            unsigned char *bufout);
+/*
+Dark / flat correction of the crop window of an 8 bit RGB frame (no
+conversion needed), out may be the window's origin in in
+*/
+void toupcam_correct_u8(const ToupcamConvParams * p, const guint8 * in,
+                        guint8 * out);
+
+/*
+Turn a (mean) flat frame into per sample gains that normalize each color
+channel to its mean after dark subtraction
+dark may be NULL
+bayer selects 2x2 mosaic channels, otherwise 3 interleaved channels
+*/
+void toupcam_flat_gain(guint16 * gain, const guint16 * flat,
+                       const guint16 * dark, gsize row_samples,
+                       gint height, gboolean bayer);
+
+/*
+Defect detection: append the indices of samples more than sigma standard
+deviations above the plane mean (and below it if below is set) to out
+Indices are appended in increasing order
+*/
+void toupcam_defects_detect(GArray * out, const guint16 * plane, gsize n,
+                            gdouble sigma, gboolean below);
+/*
+Replace each listed sample with the median of its same color neighbors
+Neighbors are dx samples and dy rows away, skipping other defects
+index must be sorted
+*/
+void toupcam_defects_correct_u8(guint8 * data, const guint32 * index,
+                                gsize count, gsize row_samples,
+                                gint height, gint dx, gint dy);
+void toupcam_defects_correct_u16(guint16 * data, const guint32 * index,
+                                 gsize count, gsize row_samples,
+                                 gint height, gint dx, gint dy);
+
+/*
+Box filter decimation: average each factor x factor block into one pixel
+Trailing rows / columns that don't fill a block are dropped
+Alpha isn't read and is written as opaque
+*/
+// in_stride and stride are in bytes per input / output row
+void toupcam_decimate_rgb24(ToupcamWorkers * w, const guint8 * in,
+                            gsize in_stride, gint width, gint height,
+                            guint8 * out, gsize stride, gint factor);
+void toupcam_decimate_argb64(ToupcamWorkers * w, const guint16 * in,
+                             gsize in_stride, gint width, gint height,
+                             guint16 * out, gsize stride, gint factor);
+
+// Frame stacking: sum N frames into a 32 bit accumulator, then average
+void toupcam_stack_add_u8(guint32 * acc, const guint8 * in, gsize n);
+void toupcam_stack_add_u16(guint32 * acc, const guint16 * in, gsize n);
+void toupcam_stack_mean_u8(guint8 * out, const guint32 * acc, gsize n,
+                           guint count);
+void toupcam_stack_mean_u16(guint16 * out, const guint32 * acc, gsize n,
+                            guint count);
+
+/*
+HDR merge of frames of the same scene taken at different exposures
+Each output sample is the weighted mean of the radiance estimates
+v * (shortest exposure / exposure), weighting by distance from black and
+clipping so noisy and blown out samples drop out
+The result is scaled so the shortest exposure's full scale (max) maps to
+65535, then mapped through curve if set
+*/
+#define TOUPCAM_HDR_MAX 8
+
+typedef struct {
+    gint count;
+    // count frames of row_samples x height samples
+    const guint16 *in[TOUPCAM_HDR_MAX];
+    // Exposure time of each frame, any unit
+    guint32 expotime[TOUPCAM_HDR_MAX];
+    gsize row_samples;
+    gint height;
+    // Clipping level of the input samples, ie 4095 for 12 bit
+    guint32 max;
+    // 65536 entries, NULL for linear output
+    const guint16 *curve;
+    ToupcamWorkers *workers;
+} ToupcamHdrParams;
+
+void toupcam_hdr_merge(const ToupcamHdrParams * p, guint16 * out);
+// Log curve from 16 bit radiance to [0, max], ie for 12 bit tone mapping
+void toupcam_hdr_curve_init(guint16 * curve, guint32 max);
+
+/*
+Focus score: sum of squared differences between samples step apart
+Only every row_step'th row is visited
+Start at offset to select a color channel in interleaved formats
+*/
+guint64 toupcam_sharpness_u8(const guint8 * in, gsize row_samples,
+                             gint height, gint offset, gint step,
+                             gint row_step);
+guint64 toupcam_sharpness_u16(const guint16 * in, gsize row_samples,
+                              gint height, gint offset, gint step,
+                              gint row_step);
+
+/*
+Projections of one channel for motion estimation
+cols[x] sums sample x of every skip'th row, rows[y] sums every skip'th sample
+of row y. width is samples per row of the channel, which starts at offset
+and repeats every step in interleaved formats
+*/
+void toupcam_profile_u8(const guint8 * in, gsize row_samples, gint width,
+                        gint height, gint offset, gint step, gint skip,
+                        guint32 * cols, guint32 * rows);
+void toupcam_profile_u16(const guint16 * in, gsize row_samples, gint width,
+                         gint height, gint offset, gint step, gint skip,
+                         guint32 * cols, guint32 * rows);
+
+#define TOUPCAM_PROFILE_MAX_SHIFT 64
+/*
+Shift of profile b relative to a, to a fraction of a sample, within
++/- max_shift (at most TOUPCAM_PROFILE_MAX_SHIFT and a quarter of n)
+Profiles are scaled to equal means first so exposure changes don't count
+*residual is the mean absolute difference left at that shift, as a fraction
+of the mean
+*/
+gdouble toupcam_profile_shift(const guint32 * a, const guint32 * b, gint n,
+                              gint max_shift, gdouble * residual);
+
+G_END_DECLS
+#endif
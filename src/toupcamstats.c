@@ -0,0 +1,118 @@
+/* GStreamer ToupCam Plugin
+ * Copyright (C) 2022 Labsmore LLC
+ *
+ * Author John McMaster <johndmcmaster@gmail.com>
+ * Author Kishore Arepalli <kishore.arepalli@gmail.com>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "toupcamstats.h"
+
+/*
+0 to 3 get their own bin
+Above that: 4 bins per power of 2 selected by the 2 bits below the top one
+*/
+static guint time_bin(guint32 v)
+{
+    guint msb;
+
+    if (v < 4) {
+        return v;
+    }
+    msb = g_bit_storage(v) - 1;
+    return 4 * (msb - 1) + ((v >> (msb - 2)) & 3);
+}
+
+// Largest value that lands in bin
+static guint64 time_bin_max(guint bin)
+{
+    guint msb;
+
+    if (bin < 4) {
+        return bin;
+    }
+    msb = bin / 4 + 1;
+    return (((guint64) (4 + bin % 4 + 1)) << (msb - 2)) - 1;
+}
+
+void toupcam_time_hist_reset(ToupcamTimeHist * h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void toupcam_time_hist_add(ToupcamTimeHist * h, gint64 us)
+{
+    guint32 v = us < 0 ? 0 : MIN(us, G_MAXUINT32);
+
+    h->bins[time_bin(v)]++;
+    h->count++;
+    h->max = MAX(h->max, (guint64) v);
+}
+
+guint64 toupcam_time_hist_percentile(const ToupcamTimeHist * h,
+                                     gdouble percent)
+{
+    guint64 target, sum = 0;
+
+    if (!h->count) {
+        return 0;
+    }
+    target = (guint64) (h->count * percent / 100.0 + 0.5);
+    target = CLAMP(target, 1, h->count);
+    for (guint i = 0; i < TOUPCAM_TIME_HIST_BINS; ++i) {
+        sum += h->bins[i];
+        if (sum >= target) {
+            // Never report more than was actually seen
+            return MIN(time_bin_max(i), h->max);
+        }
+    }
+    return h->max;
+}
+
+ToupcamSpanRing *toupcam_span_ring_new(void)
+{
+    return g_new0(ToupcamSpanRing, 1);
+}
+
+void toupcam_span_ring_free(ToupcamSpanRing * ring)
+{
+    g_free(ring);
+}
+
+void toupcam_span_ring_push(ToupcamSpanRing * ring,
+                            const ToupcamSpan * span)
+{
+    guint head = (guint) g_atomic_int_get(&ring->head);
+
+    ring->spans[head & (TOUPCAM_SPAN_RING_SIZE - 1)] = *span;
+    // Publishes the span (full barrier)
+    g_atomic_int_set(&ring->head, head + 1);
+}
+
+gboolean toupcam_span_ring_pop(ToupcamSpanRing * ring, ToupcamSpan * span)
+{
+    for (;;) {
+        guint head = (guint) g_atomic_int_get(&ring->head);
+
+        if (head == ring->tail) {
+            return FALSE;
+        }
+        if (head - ring->tail > TOUPCAM_SPAN_RING_SIZE) {
+            ring->lost += head - ring->tail - TOUPCAM_SPAN_RING_SIZE;
+            ring->tail = head - TOUPCAM_SPAN_RING_SIZE;
+        }
+        *span = ring->spans[ring->tail & (TOUPCAM_SPAN_RING_SIZE - 1)];
+        // The producer may have started overwriting the slot while we copied
+        head = (guint) g_atomic_int_get(&ring->head);
+        if (head - ring->tail >= TOUPCAM_SPAN_RING_SIZE) {
+            continue;
+        }
+        ring->tail++;
+        return TRUE;
+    }
+}
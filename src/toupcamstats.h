@@ -0,0 +1,77 @@
+/* GStreamer ToupCam Plugin
+ * Copyright (C) 2022 Labsmore LLC
+ *
+ * Author John McMaster <johndmcmaster@gmail.com>
+ * Author Kishore Arepalli <kishore.arepalli@gmail.com>
+ */
+
+/*
+Cheap fixed size latency histograms for the live statistics and per frame
+timing spans for tracing
+Recording is a couple of integer ops / stores so it can run on every frame
+*/
+
+#ifndef _TOUPCAM_STATS_H_
+#define _TOUPCAM_STATS_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+Log scale bins with 4 sub bins per power of 2 (~25% resolution)
+Covers the full 32 bit range of microseconds
+*/
+#define TOUPCAM_TIME_HIST_BINS 124
+
+typedef struct {
+    guint32 bins[TOUPCAM_TIME_HIST_BINS];
+    guint32 count;
+    guint64 max;
+} ToupcamTimeHist;
+
+void toupcam_time_hist_reset(ToupcamTimeHist * h);
+void toupcam_time_hist_add(ToupcamTimeHist * h, gint64 us);
+// Upper bound of the bin holding percent (0 to 100) of the samples, in us
+guint64 toupcam_time_hist_percentile(const ToupcamTimeHist * h,
+                                     gdouble percent);
+
+// When each stage of one frame happened, monotonic us (0 => didn't happen)
+typedef struct {
+    guint seq;
+    // Most recent SDK image event before we woke up
+    gint64 callback;
+    gint64 wake;
+    gint64 pull_start;
+    gint64 pull_end;
+    gint64 convert_end;
+    gint64 push;
+} ToupcamSpan;
+
+// Must be a power of 2
+#define TOUPCAM_SPAN_RING_SIZE 1024
+
+/*
+Lock free single producer / single consumer ring of spans
+The producer never waits: if the consumer falls behind the oldest spans are
+overwritten and counted in lost
+*/
+typedef struct {
+    ToupcamSpan spans[TOUPCAM_SPAN_RING_SIZE];
+    // Spans pushed, atomic, wraps
+    gint head;
+    // Consumer only
+    guint tail;
+    guint lost;
+} ToupcamSpanRing;
+
+ToupcamSpanRing *toupcam_span_ring_new(void);
+void toupcam_span_ring_free(ToupcamSpanRing * ring);
+// Producer side
+void toupcam_span_ring_push(ToupcamSpanRing * ring,
+                            const ToupcamSpan * span);
+// Consumer side, FALSE when empty
+gboolean toupcam_span_ring_pop(ToupcamSpanRing * ring, ToupcamSpan * span);
+
+G_END_DECLS
+#endif